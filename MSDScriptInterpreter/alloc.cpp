@@ -0,0 +1,174 @@
+//
+//  alloc.cpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/17/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include <algorithm>
+#include <cstdlib>
+#include <cxxabi.h>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include "alloc.hpp"
+#include "pointer.hpp"
+#include "catch.hpp"
+#include "value.hpp"
+
+thread_local MemoryAccount *current_account = nullptr;
+thread_local AllocPhase current_alloc_phase = ALLOC_OTHER;
+
+static std::mutex counters_lock;
+static AllocCounter *counters = nullptr;
+
+static const char *alloc_phase_names[ALLOC_PHASES] = {"other", "parse", "optimize", "interp"};
+
+#ifdef MSD_COUNT_REFS
+thread_local unsigned long ref_count_ops = 0;
+#endif
+
+MemoryAccount::MemoryAccount(size_t limit)
+: held(1), peak(0) {
+  this->limit = limit;
+}
+
+void MemoryAccount::charge(size_t bytes) {
+  size_t now = held.fetch_add(bytes, std::memory_order_relaxed) + bytes - 1;
+  if (limit != 0 && now > limit) {
+    held.fetch_sub(bytes, std::memory_order_relaxed);
+    throw std::runtime_error("memory limit exceeded");
+  }
+  size_t old_peak = peak.load(std::memory_order_relaxed);
+  while (now > old_peak && !peak.compare_exchange_weak(old_peak, now, std::memory_order_relaxed))
+    ;
+}
+
+void MemoryAccount::credit(size_t bytes) {
+  if (held.fetch_sub(bytes, std::memory_order_acq_rel) == bytes)
+    delete this;
+}
+
+size_t MemoryAccount::live_bytes() {
+  return held.load() - 1;
+}
+
+size_t MemoryAccount::peak_bytes() {
+  return peak.load();
+}
+
+void MemoryAccount::release() {
+  if (held.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    delete this;
+}
+
+AllocCounter::AllocCounter(const std::type_info &type) {
+  int status;
+  char *name = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+  this->type = (status == 0) ? name : type.name();
+  free(name);
+  for (int phase = 0; phase < ALLOC_PHASES; phase++) {
+    allocations[phase] = 0;
+    bytes[phase] = 0;
+  }
+  std::lock_guard<std::mutex> guard(counters_lock);
+  this->next = counters;
+  counters = this;
+}
+
+void print_alloc_stats(std::ostream &out) {
+  struct Row {
+    const AllocCounter *counter;
+    int phase;
+    unsigned long allocations;
+    unsigned long bytes;
+  };
+  std::vector<Row> rows;
+  unsigned long phase_allocations[ALLOC_PHASES] = {};
+  unsigned long phase_bytes[ALLOC_PHASES] = {};
+  {
+    std::lock_guard<std::mutex> guard(counters_lock);
+    for (const AllocCounter *c = counters; c != nullptr; c = c->next) {
+      for (int phase = 0; phase < ALLOC_PHASES; phase++) {
+        Row row = {c, phase, c->allocations[phase].load(), c->bytes[phase].load()};
+        if (row.allocations == 0)
+          continue;
+        rows.push_back(row);
+        phase_allocations[phase] += row.allocations;
+        phase_bytes[phase] += row.bytes;
+      }
+    }
+  }
+  std::sort(rows.begin(), rows.end(), [](const Row &a, const Row &b) {
+    return a.bytes > b.bytes;
+  });
+
+  out << std::left << std::setw(16) << "type" << std::setw(10) << "phase" << std::right
+      << std::setw(14) << "allocations" << std::setw(14) << "bytes" << std::endl;
+  for (const Row &row : rows) {
+    out << std::left << std::setw(16) << row.counter->type << std::setw(10) << alloc_phase_names[row.phase]
+        << std::right << std::setw(14) << row.allocations << std::setw(14) << row.bytes << std::endl;
+  }
+  for (int phase = 0; phase < ALLOC_PHASES; phase++) {
+    if (phase_allocations[phase] == 0)
+      continue;
+    out << std::left << std::setw(16) << "total" << std::setw(10) << alloc_phase_names[phase]
+        << std::right << std::setw(14) << phase_allocations[phase] << std::setw(14) << phase_bytes[phase]
+        << std::endl;
+  }
+}
+
+TEST_CASE( "MemoryAccount" ) {
+  SECTION( "charges NEW while current" ) {
+    MemoryAccount *account = new MemoryAccount(0);
+    PTR(Val) before = NEW(NumVal)(1);
+    current_account = account;
+    PTR(Val) during = NEW(NumVal)(2);
+    current_account = nullptr;
+    CHECK( account->live_bytes() >= sizeof(NumVal) );
+    size_t charged = account->live_bytes();
+    during = nullptr;
+    CHECK( account->live_bytes() == 0 );
+    CHECK( account->peak_bytes() == charged );
+    before = nullptr;
+    account->release();
+  }
+
+  SECTION( "limit" ) {
+    MemoryAccount *account = new MemoryAccount(sizeof(NumVal) * 8);
+    current_account = account;
+    std::vector<PTR(Val)> vals;
+    CHECK_THROWS_WITH( [&] { while (true) vals.push_back(NEW(NumVal)(0)); }(),
+                      "memory limit exceeded" );
+    current_account = nullptr;
+    CHECK( account->peak_bytes() <= sizeof(NumVal) * 8 );
+    CHECK( account->live_bytes() > 0 );
+    vals.clear();
+    CHECK( account->live_bytes() == 0 );
+    account->release();
+  }
+}
+
+TEST_CASE( "allocation stats" ) {
+  // counts directly, so this works whether or not `NEW` is counting
+  AllocCounter &counter = alloc_counter<NumVal>();
+  CHECK( counter.type == "NumVal" );
+  unsigned long before = counter.allocations[ALLOC_INTERP];
+  unsigned long before_bytes = counter.bytes[ALLOC_INTERP];
+  {
+    AllocPhaseScope phase(ALLOC_INTERP);
+    PTR(Val) v = std::allocate_shared<NumVal>(AccountingAllocator<NumVal>(nullptr, &counter), 5);
+    CHECK( v->to_string() == "5" );
+  }
+  CHECK( current_alloc_phase == ALLOC_OTHER );
+  CHECK( counter.allocations[ALLOC_INTERP] == before + 1 );
+  CHECK( counter.bytes[ALLOC_INTERP] >= before_bytes + sizeof(NumVal) );
+
+  std::ostringstream report;
+  print_alloc_stats(report);
+  CHECK( report.str().find("NumVal          interp") != std::string::npos );
+  CHECK( report.str().find("total           interp") != std::string::npos );
+}
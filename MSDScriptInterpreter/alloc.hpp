@@ -0,0 +1,175 @@
+//
+//  alloc.hpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/17/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef alloc_hpp
+#define alloc_hpp
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <ostream>
+#include <string>
+#include <typeinfo>
+#include <utility>
+
+/*
+ * Bytes allocated through `NEW` on behalf of one evaluation. The
+ * account lives until both its owner has released it and every byte
+ * has been given back, so objects that outlive the evaluation (such
+ * as its result) can still be freed. Safe to share between threads.
+ * */
+class MemoryAccount {
+public:
+  // `limit` of 0 means unlimited
+  MemoryAccount(size_t limit);
+
+  // Throws `runtime_error` if `bytes` more would exceed the limit
+  void charge(size_t bytes);
+  void credit(size_t bytes);
+  size_t live_bytes();
+  size_t peak_bytes();
+
+  // Called once by the owner, who may not use the account afterwards
+  void release();
+
+private:
+  size_t limit;
+  // Live bytes, plus one while the owner holds the account, so a
+  // single atomic tracks both the usage and the account's lifetime
+  std::atomic<size_t> held;
+  std::atomic<size_t> peak;
+};
+
+// The account `NEW` charges on this thread, if any
+extern thread_local MemoryAccount *current_account;
+
+// Building with `MSD_ALLOC_STATS` counts every `NEW` allocation by
+// type and by the phase it was made in
+#ifdef MSD_ALLOC_STATS
+static const bool alloc_stats_enabled = true;
+#else
+static const bool alloc_stats_enabled = false;
+#endif
+
+enum AllocPhase {
+  ALLOC_OTHER,
+  ALLOC_PARSE,
+  ALLOC_OPTIMIZE,
+  ALLOC_INTERP,
+  ALLOC_PHASES
+};
+
+// The phase this thread's allocations are attributed to
+extern thread_local AllocPhase current_alloc_phase;
+
+// Attributes allocations to `phase` until the scope ends
+class AllocPhaseScope {
+public:
+  AllocPhaseScope(AllocPhase phase) : saved(current_alloc_phase) {
+    current_alloc_phase = phase;
+  }
+  ~AllocPhaseScope() {
+    current_alloc_phase = saved;
+  }
+
+private:
+  AllocPhase saved;
+};
+
+// Allocation counts for one type; never freed, so counts can be
+// reported at any time
+class AllocCounter {
+public:
+  AllocCounter(const std::type_info &type);
+
+  void record(size_t size) {
+    allocations[current_alloc_phase].fetch_add(1, std::memory_order_relaxed);
+    bytes[current_alloc_phase].fetch_add(size, std::memory_order_relaxed);
+  }
+
+  std::string type;
+  std::atomic<unsigned long> allocations[ALLOC_PHASES];
+  std::atomic<unsigned long> bytes[ALLOC_PHASES];
+  AllocCounter *next;
+};
+
+template <class T>
+AllocCounter &alloc_counter() {
+  static AllocCounter *counter = new AllocCounter(typeid(T));
+  return *counter;
+}
+
+// Writes every type's counts, largest byte counts first, and the
+// totals for each phase
+void print_alloc_stats(std::ostream &out);
+
+// Charges its allocations to the account that was current when it
+// was made, and records them in `counter`; either may be null.
+// `allocate_shared` keeps a copy to free the block with.
+template <class T>
+class AccountingAllocator {
+public:
+  typedef T value_type;
+
+  MemoryAccount *account;
+  AllocCounter *counter;
+
+  explicit AccountingAllocator(MemoryAccount *account, AllocCounter *counter = nullptr)
+  : account(account), counter(counter) {}
+  template <class U>
+  AccountingAllocator(const AccountingAllocator<U> &other)
+  : account(other.account), counter(other.counter) {}
+
+  T *allocate(size_t n) {
+    if (counter != nullptr)
+      counter->record(n * sizeof(T));
+    if (account == nullptr)
+      return static_cast<T *>(::operator new(n * sizeof(T)));
+    account->charge(n * sizeof(T));
+    try {
+      return static_cast<T *>(::operator new(n * sizeof(T)));
+    } catch (...) {
+      account->credit(n * sizeof(T));
+      throw;
+    }
+  }
+
+  void deallocate(T *p, size_t n) {
+    ::operator delete(p);
+    if (account != nullptr)
+      account->credit(n * sizeof(T));
+  }
+};
+
+template <class T, class U>
+bool operator==(const AccountingAllocator<T> &a, const AccountingAllocator<U> &b) {
+  return a.account == b.account && a.counter == b.counter;
+}
+
+template <class T, class U>
+bool operator!=(const AccountingAllocator<T> &a, const AccountingAllocator<U> &b) {
+  return !(a == b);
+}
+
+// What `NEW(T)` expands to: a plain `make_shared` unless an account is
+// being charged or allocations are being counted
+template <class T, class... Args>
+inline std::shared_ptr<T> make_accounted(Args &&... args) {
+  MemoryAccount *account = current_account;
+#ifdef MSD_ALLOC_STATS
+  return std::allocate_shared<T>(AccountingAllocator<T>(account, &alloc_counter<T>()),
+                                 std::forward<Args>(args)...);
+#else
+  if (account == nullptr)
+    return std::make_shared<T>(std::forward<Args>(args)...);
+  return std::allocate_shared<T>(AccountingAllocator<T>(account), std::forward<Args>(args)...);
+#endif
+}
+
+#endif /* alloc_hpp */
@@ -0,0 +1,211 @@
+//
+//  batch.cpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/6/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include <cctype>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include "batch.hpp"
+#include "thread_pool.hpp"
+#include "catch.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include "budget.hpp"
+#include "cache.hpp"
+#include "env.hpp"
+#include "parse.hpp"
+
+std::string run_program(const std::string &source, bool optimize_mode) {
+  PTR(Expr) e = program_cache.get(source, optimize_mode);
+  if (optimize_mode)
+    return e->to_string();
+  return interp_limited(e, NEW(EmptyEnv)(), default_limits)->to_string();
+}
+
+std::string run_program_line(const std::string &source, bool optimize_mode) {
+  try {
+    return run_program(source, optimize_mode);
+  } catch (std::exception &err) {
+    return (std::string)"error: " + err.what();
+  }
+}
+
+bool read_program(std::istream &in, BatchFraming framing, std::string &source) {
+  if (framing == LINE_FRAMING) {
+    // blank lines separate nothing, so they are skipped
+    while (std::getline(in, source)) {
+      if (source.find_first_not_of(" \t\r") != std::string::npos)
+        return true;
+    }
+    return false;
+  }
+  
+  in >> std::ws;
+  if (in.peek() == EOF)
+    return false;
+  // `>>` would accept a sign and wrap a negative length around
+  size_t length;
+  if (!isdigit(in.peek()) || !(in >> length) || in.get() != '\n')
+    throw std::runtime_error("expected a program length");
+  if (length > MAX_PROGRAM_LENGTH)
+    throw std::runtime_error("program too long");
+  source.resize(length);
+  if (!in.read(&source[0], length))
+    throw std::runtime_error("program shorter than its length");
+  return true;
+}
+
+void run_batch(std::istream &in, std::ostream &out, BatchFraming framing, bool optimize_mode) {
+  std::string source;
+  while (read_program(in, framing, source))
+    out << run_program_line(source, optimize_mode) << '\n';
+  out.flush();
+}
+
+/*
+ * Holds results that finished out of order until every earlier
+ * result has been written
+ * */
+class ReorderBuffer {
+public:
+  ReorderBuffer() {
+    next = 0;
+  }
+  
+  // Notifies while still holding the lock, since the writer may
+  // destroy the buffer as soon as it sees the last result
+  void put(size_t seq, std::string line) {
+    std::lock_guard<std::mutex> guard(lock);
+    done[seq] = std::move(line);
+    ready.notify_one();
+  }
+  
+  // Writes results in order until result `upto` has been written,
+  // waiting for any that are not finished yet
+  void write_through(std::ostream &out, size_t upto) {
+    std::unique_lock<std::mutex> guard(lock);
+    while (next < upto) {
+      ready.wait(guard, [this] { return done.count(next) > 0; });
+      std::string line = std::move(done[next]);
+      done.erase(next++);
+      guard.unlock();
+      out << line << '\n';
+      guard.lock();
+    }
+  }
+  
+private:
+  std::mutex lock;
+  std::condition_variable ready;
+  std::map<size_t, std::string> done;
+  size_t next;
+};
+
+void run_parallel_batch(std::istream &in, std::ostream &out, BatchFraming framing,
+                        bool optimize_mode, ThreadPool &pool) {
+  // Bounds how far reading runs ahead of writing, so a huge input
+  // doesn't pile up in memory behind one slow program
+  const size_t window = 64 * pool.size();
+  ReorderBuffer buffer;
+  size_t seq = 0;
+  std::string source;
+  try {
+    while (read_program(in, framing, source)) {
+      if (seq >= window)
+        buffer.write_through(out, seq - window + 1);
+      pool.submit([&buffer, seq, source = std::move(source), optimize_mode] {
+        buffer.put(seq, run_program_line(source, optimize_mode));
+      });
+      seq++;
+    }
+  } catch (...) {
+    // the queued tasks still refer to `buffer`, whatever went wrong
+    buffer.write_through(out, seq);
+    out.flush();
+    throw;
+  }
+  buffer.write_through(out, seq);
+  out.flush();
+}
+
+/* for tests */
+static std::string run_batch_str(std::string s, BatchFraming framing, bool optimize_mode) {
+  std::istringstream in(s);
+  std::ostringstream out;
+  run_batch(in, out, framing, optimize_mode);
+  return out.str();
+}
+
+TEST_CASE( "batch" ) {
+  SECTION( "run_program" ) {
+    CHECK( run_program("1 + 2", false) == "3" );
+    CHECK( run_program("_let x = y _in 1 + 2", true) == "(_let x = y _in 3)" );
+    CHECK_THROWS_WITH( run_program("x", false), "free variable: x" );
+    CHECK( run_program_line("x", false) == "error: free variable: x" );
+    CHECK( run_program_line("(1", false) == "error: expected a close parenthesis" );
+  }
+  
+  SECTION( "line framing" ) {
+    CHECK( run_batch_str("1 + 2\n_true\n", LINE_FRAMING, false) == "3\n_true\n" );
+    CHECK( run_batch_str("1 + 2\n\n  \n_true", LINE_FRAMING, false) == "3\n_true\n" );
+    CHECK( run_batch_str("1 + )\n_if 1 _then 2 _else 3\n4 * 5\n", LINE_FRAMING, false)
+          == "error: expected a digit or open parenthesis or letter at )\n"
+             "error: can't make numval a bool\n"
+             "20\n" );
+    CHECK( run_batch_str("x + 1 + 2\n", LINE_FRAMING, true) == "(x + 3)\n" );
+  }
+  
+  SECTION( "length framing" ) {
+    CHECK( run_batch_str("5\n1 + 2\n10\n_let x = )\n", LENGTH_FRAMING, false)
+          == "3\nerror: expected a digit or open parenthesis or letter at )\n" );
+    CHECK( run_batch_str("11\n1 +\n2\n+\n3\n\n2\n42", LENGTH_FRAMING, false) == "6\n42\n" );
+    CHECK( run_batch_str("", LENGTH_FRAMING, false) == "" );
+    CHECK_THROWS_WITH( run_batch_str("x\n1", LENGTH_FRAMING, false), "expected a program length" );
+    CHECK_THROWS_WITH( run_batch_str("10\n1", LENGTH_FRAMING, false), "program shorter than its length" );
+    CHECK_THROWS_WITH( run_batch_str("-1\n1", LENGTH_FRAMING, false), "expected a program length" );
+    CHECK_THROWS_WITH( run_batch_str("18446744073709551615\n1", LENGTH_FRAMING, false), "program too long" );
+    CHECK_THROWS_WITH( run_batch_str("99999999999999999999999\n1", LENGTH_FRAMING, false),
+                      "expected a program length" );
+    CHECK_THROWS_WITH( run_batch_str(std::to_string(MAX_PROGRAM_LENGTH + 1) + "\n1", LENGTH_FRAMING, false),
+                      "program too long" );
+  }
+  
+  SECTION( "parallel" ) {
+    std::string programs;
+    for (int i = 0; i < 500; i++) {
+      if (i % 7 == 0)
+        programs += "_let f = _fun (x) x * " + std::to_string(i) + " _in f(y)\n";
+      else if (i % 3 == 0)
+        programs += "_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1 "
+                    "_else fib(fib)(x + -1) + fib(fib)(x + -2) _in fib(fib)(" + std::to_string(i % 15) + ")\n";
+      else
+        programs += std::to_string(i) + " * " + std::to_string(i) + "\n";
+    }
+    
+    std::string expected = run_batch_str(programs, LINE_FRAMING, false);
+    ThreadPool pool(4);
+    std::istringstream in(programs);
+    std::ostringstream out;
+    run_parallel_batch(in, out, LINE_FRAMING, false, pool);
+    CHECK( out.str() == expected );
+    
+    std::istringstream bad_in("3\n1+2xyz");
+    std::ostringstream bad_out;
+    CHECK_THROWS_WITH( run_parallel_batch(bad_in, bad_out, LENGTH_FRAMING, false, pool),
+                      "expected a program length" );
+    CHECK( bad_out.str() == "3\n" );
+    
+    std::istringstream huge_in("3\n1+2\n18446744073709551615\n1");
+    std::ostringstream huge_out;
+    CHECK_THROWS_WITH( run_parallel_batch(huge_in, huge_out, LENGTH_FRAMING, false, pool),
+                      "program too long" );
+    CHECK( huge_out.str() == "3\n" );
+  }
+}
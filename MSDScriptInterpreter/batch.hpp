@@ -0,0 +1,54 @@
+//
+//  batch.hpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/6/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef batch_hpp
+#define batch_hpp
+
+#include <iostream>
+#include <string>
+
+class ThreadPool;
+
+// How programs are separated in a batch input stream: one program
+// per line, or each program preceded by its byte length and a newline
+enum BatchFraming {
+  LINE_FRAMING,
+  LENGTH_FRAMING
+};
+
+// Longest program a length prefix may announce, in a framed batch or
+// from a server client, so a bad length can't make either allocate
+// without bound
+static const size_t MAX_PROGRAM_LENGTH = 64 * 1024 * 1024;
+
+// Parses and then interprets (or optimizes) one program, returning
+// the text that would be printed for it. Trees come from
+// `program_cache`, so a repeated program isn't parsed again. Throws `runtime_error` for
+// parse and evaluation errors.
+std::string run_program(const std::string &source, bool optimize_mode);
+
+// Like `run_program`, but reports an error as "error: <message>"
+// instead of throwing
+std::string run_program_line(const std::string &source, bool optimize_mode);
+
+// Reads the next program from `in` into `source`, returning false at
+// the end of the input. Throws `runtime_error` for a bad length prefix,
+// including one over `MAX_PROGRAM_LENGTH`.
+bool read_program(std::istream &in, BatchFraming framing, std::string &source);
+
+// Evaluates every program in `in`, writing one result or error line
+// per program to `out`
+void run_batch(std::istream &in, std::ostream &out, BatchFraming framing, bool optimize_mode);
+
+// Like `run_batch`, but evaluates the programs concurrently on `pool`.
+// Each program gets its own `Expr`/`Val`/`Env` objects, and results
+// are still written in input order.
+void run_parallel_batch(std::istream &in, std::ostream &out, BatchFraming framing,
+                        bool optimize_mode, ThreadPool &pool);
+
+#endif /* batch_hpp */
@@ -0,0 +1,315 @@
+//
+//  bigint.cpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/3/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include <algorithm>
+#include <climits>
+#include <stdexcept>
+#include "bigint.hpp"
+#include "catch.hpp"
+
+typedef std::vector<uint32_t> Mag;
+
+// Operands with fewer limbs than this use schoolbook multiplication
+static const size_t KARATSUBA_THRESHOLD = 32;
+
+static void trim(Mag &m) {
+  while (!m.empty() && m.back() == 0)
+    m.pop_back();
+}
+
+static int cmp_mag(const Mag &a, const Mag &b) {
+  if (a.size() != b.size())
+    return a.size() < b.size() ? -1 : 1;
+  for (size_t i = a.size(); i-- > 0; ) {
+    if (a[i] != b[i])
+      return a[i] < b[i] ? -1 : 1;
+  }
+  return 0;
+}
+
+static Mag add_mag(const Mag &a, const Mag &b) {
+  const Mag &longer = a.size() >= b.size() ? a : b;
+  const Mag &shorter = a.size() >= b.size() ? b : a;
+  Mag result(longer.size() + 1);
+  uint64_t carry = 0;
+  for (size_t i = 0; i < longer.size(); i++) {
+    uint64_t sum = (uint64_t)longer[i] + (i < shorter.size() ? shorter[i] : 0) + carry;
+    result[i] = (uint32_t)sum;
+    carry = sum >> 32;
+  }
+  result[longer.size()] = (uint32_t)carry;
+  trim(result);
+  return result;
+}
+
+// Assumes `a` >= `b`
+static Mag sub_mag(const Mag &a, const Mag &b) {
+  Mag result(a.size());
+  int64_t borrow = 0;
+  for (size_t i = 0; i < a.size(); i++) {
+    int64_t diff = (int64_t)a[i] - (i < b.size() ? b[i] : 0) - borrow;
+    borrow = diff < 0;
+    result[i] = (uint32_t)(diff + (borrow << 32));
+  }
+  trim(result);
+  return result;
+}
+
+// Adds `x` into `result` starting at limb `shift`
+static void add_shifted(Mag &result, const Mag &x, size_t shift) {
+  if (result.size() < x.size() + shift + 1)
+    result.resize(x.size() + shift + 1);
+  uint64_t carry = 0;
+  size_t i = 0;
+  for (; i < x.size(); i++) {
+    uint64_t sum = (uint64_t)result[i + shift] + x[i] + carry;
+    result[i + shift] = (uint32_t)sum;
+    carry = sum >> 32;
+  }
+  for (i += shift; carry != 0; i++) {
+    if (i == result.size())
+      result.push_back(0);
+    uint64_t sum = (uint64_t)result[i] + carry;
+    result[i] = (uint32_t)sum;
+    carry = sum >> 32;
+  }
+}
+
+static Mag mult_schoolbook(const Mag &a, const Mag &b) {
+  if (a.empty() || b.empty())
+    return Mag();
+  Mag result(a.size() + b.size());
+  for (size_t i = 0; i < a.size(); i++) {
+    uint64_t carry = 0;
+    for (size_t j = 0; j < b.size(); j++) {
+      uint64_t cur = (uint64_t)a[i] * b[j] + result[i + j] + carry;
+      result[i + j] = (uint32_t)cur;
+      carry = cur >> 32;
+    }
+    result[i + b.size()] = (uint32_t)carry;
+  }
+  trim(result);
+  return result;
+}
+
+static Mag low_limbs(const Mag &m, size_t n) {
+  Mag result(m.begin(), m.begin() + std::min(n, m.size()));
+  trim(result);
+  return result;
+}
+
+static Mag high_limbs(const Mag &m, size_t n) {
+  if (m.size() <= n)
+    return Mag();
+  return Mag(m.begin() + n, m.end());
+}
+
+// Karatsuba: with a = a1*B + a0 and b = b1*B + b0,
+// a*b = z2*B^2 + (z1 - z2 - z0)*B + z0 where
+// z0 = a0*b0, z2 = a1*b1 and z1 = (a0 + a1)*(b0 + b1)
+static Mag mult_mag(const Mag &a, const Mag &b) {
+  if (std::min(a.size(), b.size()) < KARATSUBA_THRESHOLD)
+    return mult_schoolbook(a, b);
+
+  size_t half = std::max(a.size(), b.size()) / 2;
+  Mag a0 = low_limbs(a, half), a1 = high_limbs(a, half);
+  Mag b0 = low_limbs(b, half), b1 = high_limbs(b, half);
+
+  Mag z0 = mult_mag(a0, b0);
+  Mag z2 = mult_mag(a1, b1);
+  Mag z1 = sub_mag(sub_mag(mult_mag(add_mag(a0, a1), add_mag(b0, b1)), z0), z2);
+
+  Mag result = z0;
+  add_shifted(result, z1, half);
+  add_shifted(result, z2, 2 * half);
+  trim(result);
+  return result;
+}
+
+// Multiplies `m` by `factor` and adds `addend`, in place
+static void mult_add_small(Mag &m, uint32_t factor, uint32_t addend) {
+  uint64_t carry = addend;
+  for (size_t i = 0; i < m.size(); i++) {
+    uint64_t cur = (uint64_t)m[i] * factor + carry;
+    m[i] = (uint32_t)cur;
+    carry = cur >> 32;
+  }
+  if (carry != 0)
+    m.push_back((uint32_t)carry);
+}
+
+// Divides `m` by `divisor` in place, returning the remainder
+static uint32_t div_small(Mag &m, uint32_t divisor) {
+  uint64_t rem = 0;
+  for (size_t i = m.size(); i-- > 0; ) {
+    uint64_t cur = (rem << 32) | m[i];
+    m[i] = (uint32_t)(cur / divisor);
+    rem = cur % divisor;
+  }
+  trim(m);
+  return (uint32_t)rem;
+}
+
+BigInt::BigInt() {
+  this->negative = false;
+}
+
+BigInt::BigInt(long long n) {
+  this->negative = n < 0;
+  unsigned long long u = negative ? 0ULL - (unsigned long long)n : (unsigned long long)n;
+  while (u != 0) {
+    mag.push_back((uint32_t)u);
+    u >>= 32;
+  }
+}
+
+BigInt BigInt::from_string(const std::string &digits) {
+  BigInt result;
+  size_t i = 0;
+  bool negative = false;
+  if (i < digits.size() && digits[i] == '-') {
+    negative = true;
+    i++;
+  }
+  if (i == digits.size())
+    throw std::runtime_error("expected a digit");
+
+  // Consume nine digits at a time, so most steps are one
+  // multiply-add over the magnitude
+  while (i < digits.size()) {
+    uint32_t chunk = 0, scale = 1;
+    for (size_t n = 0; n < 9 && i < digits.size(); n++, i++) {
+      if (!isdigit(digits[i]))
+        throw std::runtime_error("expected a digit");
+      chunk = chunk * 10 + (digits[i] - '0');
+      scale *= 10;
+    }
+    mult_add_small(result.mag, scale, chunk);
+  }
+  trim(result.mag);
+  result.negative = negative && !result.is_zero();
+  return result;
+}
+
+bool BigInt::is_zero() const {
+  return mag.empty();
+}
+
+bool BigInt::fits_int() const {
+  if (mag.size() > 1)
+    return false;
+  if (mag.empty())
+    return true;
+  return mag[0] <= (negative ? (uint32_t)INT_MAX + 1 : (uint32_t)INT_MAX);
+}
+
+int BigInt::to_int() const {
+  if (mag.empty())
+    return 0;
+  long long value = mag[0];
+  return (int)(negative ? -value : value);
+}
+
+BigInt BigInt::add(const BigInt &other) const {
+  BigInt result;
+  if (negative == other.negative) {
+    result.mag = add_mag(mag, other.mag);
+    result.negative = negative;
+  } else if (cmp_mag(mag, other.mag) >= 0) {
+    result.mag = sub_mag(mag, other.mag);
+    result.negative = negative;
+  } else {
+    result.mag = sub_mag(other.mag, mag);
+    result.negative = other.negative;
+  }
+  if (result.is_zero())
+    result.negative = false;
+  return result;
+}
+
+BigInt BigInt::mult(const BigInt &other) const {
+  BigInt result;
+  result.mag = mult_mag(mag, other.mag);
+  result.negative = !result.is_zero() && (negative != other.negative);
+  return result;
+}
+
+bool BigInt::equals(const BigInt &other) const {
+  return negative == other.negative && mag == other.mag;
+}
+
+std::string BigInt::to_string() const {
+  if (is_zero())
+    return "0";
+
+  Mag m = mag;
+  std::string digits;
+  while (!m.empty()) {
+    uint32_t chunk = div_small(m, 1000000000);
+    for (int n = 0; n < 9 && (chunk != 0 || !m.empty()); n++) {
+      digits += (char)('0' + chunk % 10);
+      chunk /= 10;
+    }
+  }
+  if (negative)
+    digits += '-';
+  std::reverse(digits.begin(), digits.end());
+  return digits;
+}
+
+TEST_CASE( "BigInt" ) {
+  SECTION( "to_string" ) {
+    CHECK( BigInt(0).to_string() == "0" );
+    CHECK( BigInt(-7).to_string() == "-7" );
+    CHECK( BigInt(1000000000).to_string() == "1000000000" );
+    CHECK( BigInt(LLONG_MIN).to_string() == "-9223372036854775808" );
+  }
+
+  SECTION( "from_string" ) {
+    CHECK( BigInt::from_string("0").is_zero() );
+    CHECK( ! BigInt::from_string("-0").negative );
+    CHECK( BigInt::from_string("123").equals(BigInt(123)) );
+    CHECK( BigInt::from_string("-9223372036854775808").equals(BigInt(LLONG_MIN)) );
+    CHECK( BigInt::from_string("1000000000000000000000000000001").to_string()
+          == "1000000000000000000000000000001" );
+    CHECK_THROWS_WITH( BigInt::from_string("-"), "expected a digit" );
+    CHECK_THROWS_WITH( BigInt::from_string("12x"), "expected a digit" );
+  }
+
+  SECTION( "fits_int" ) {
+    CHECK( BigInt(2147483647).fits_int() );
+    CHECK( BigInt(-2147483648LL).fits_int() );
+    CHECK( BigInt(-2147483648LL).to_int() == INT_MIN );
+    CHECK( ! BigInt(2147483648LL).fits_int() );
+    CHECK( ! BigInt(-2147483649LL).fits_int() );
+  }
+
+  SECTION( "add" ) {
+    CHECK( BigInt(4294967295LL).add(BigInt(1)).to_string() == "4294967296" );
+    CHECK( BigInt(-4294967296LL).add(BigInt(1)).to_string() == "-4294967295" );
+    CHECK( BigInt(5).add(BigInt(-5)).is_zero() );
+    CHECK( ! BigInt(5).add(BigInt(-5)).negative );
+    CHECK( BigInt(3).add(BigInt(-10)).to_string() == "-7" );
+  }
+
+  SECTION( "mult" ) {
+    BigInt max64 = BigInt::from_string("18446744073709551615");
+    CHECK( max64.mult(max64).to_string() == "340282366920938463426481119284349108225" );
+    CHECK( BigInt(-3).mult(BigInt(4)).to_string() == "-12" );
+    CHECK( BigInt(-3).mult(BigInt(0)).to_string() == "0" );
+
+    // large enough for the Karatsuba path
+    std::string a, b;
+    for (int i = 0; i < 40; i++)
+      a += "1234567890";
+    for (int i = 0; i < 35; i++)
+      b += "9876543210";
+    CHECK( BigInt::from_string(a).mult(BigInt::from_string("-" + b)).to_string()
+          == "-121932631137021795226185032733866788594511507391563633592367611644557885992987901082152001356500521260478584238530711635101356484634964180575979271268846212448009449776913427830902591068411383935373250876390536335924374758420969588324950170080780338132906565925773509803825636301507392162263222069437570492264881877758600670629071315348228256363354936899862393689986239368998623936899862393689986239356805360823197682871071482965982319764485749123237326627002607834168148300563603581771039233348571810852003969836915075858862975473403444336092059112484377379135954884702347203149109891782798506325068602347185735406186461057765434857491222360920590123609205801112635258986434993786160646167367779295611949397448712086533622923332237463801111263526900" );
+  }
+}
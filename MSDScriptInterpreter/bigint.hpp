@@ -0,0 +1,43 @@
+//
+//  bigint.hpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/3/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef bigint_hpp
+#define bigint_hpp
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/*
+ * Arbitrary-precision integer, used by `NumVal` only once a
+ * result no longer fits in an `int`
+ * */
+class BigInt {
+public:
+  bool negative;
+  // Magnitude in base 2^32, least significant limb first, with no
+  // high zero limbs (so zero is the empty vector)
+  std::vector<uint32_t> mag;
+
+  BigInt();
+  BigInt(long long n);
+
+  // Parses an optional `-` followed by decimal digits
+  static BigInt from_string(const std::string &digits);
+
+  bool is_zero() const;
+  bool fits_int() const;
+  int to_int() const;
+
+  BigInt add(const BigInt &other) const;
+  BigInt mult(const BigInt &other) const;
+  bool equals(const BigInt &other) const;
+  std::string to_string() const;
+};
+
+#endif /* bigint_hpp */
@@ -0,0 +1,434 @@
+//
+//  budget.cpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/15/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <sstream>
+#include <stdexcept>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "budget.hpp"
+#include "expr.hpp"
+#include "env.hpp"
+#include "value.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+#include "trace.hpp"
+#include "flat.hpp"
+
+// Steps between reads of the clock when there is a deadline, and the
+// most fuel a budget takes at once
+static const long CLOCK_CHECK_STEPS = 4096;
+
+// Stack kept free below the deepest call, for what runs between two
+// calls: evaluating the rest of a function body, printing an error
+static const size_t STACK_RESERVE = 256 * 1024;
+
+// The floor for a stack running from `low` up for `size` bytes
+static char *stack_floor_in(char *low, size_t size) {
+  return low + std::min(STACK_RESERVE, size / 4);
+}
+
+// The floor for this thread's own stack, found once per thread
+static char *thread_stack_floor() {
+  static thread_local char *floor = nullptr;
+  if (floor == nullptr) {
+    size_t size;
+    char *low;
+#ifdef __APPLE__
+    size = pthread_get_stacksize_np(pthread_self());
+    low = (char *)pthread_get_stackaddr_np(pthread_self()) - size;
+#else
+    pthread_attr_t attr;
+    void *addr;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0)
+      throw std::runtime_error("cannot find the thread's stack");
+    pthread_attr_getstack(&attr, &addr, &size);
+    pthread_attr_destroy(&attr);
+    low = (char *)addr;
+#endif
+    floor = stack_floor_in(low, size);
+  }
+  return floor;
+}
+
+EvalLimits default_limits = {0, 0, 0};
+
+thread_local EvalBudget *current_budget = nullptr;
+
+EvalBudget::EvalBudget(const EvalLimits &limits, long slice_steps)
+: total_steps(0) {
+  this->stack_floor = thread_stack_floor();
+  this->limits = limits;
+  this->slice_steps = slice_steps;
+  this->deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(limits.max_millis);
+  this->root = this;
+  this->steps_to_clock_check = CLOCK_CHECK_STEPS;
+  this->slice_left = slice_steps;
+  this->owner = nullptr;
+  // start the first chunk without charging a step
+  this->countdown = this->chunk = -1;
+  refill();
+}
+
+EvalBudget::EvalBudget(EvalBudget &parent)
+: total_steps(0) {
+  this->stack_floor = thread_stack_floor();
+  this->limits = parent.limits;
+  this->slice_steps = 0;
+  this->deadline = parent.deadline;
+  this->root = parent.root;
+  this->steps_to_clock_check = CLOCK_CHECK_STEPS;
+  this->slice_left = 0;
+  this->owner = nullptr;
+  // the first step refills, so constructing one never throws
+  this->countdown = this->chunk = 0;
+}
+
+EvalBudget::~EvalBudget() {
+  if (root != this)
+    root->total_steps += chunk - countdown;
+}
+
+void EvalBudget::refill() {
+  if ((char *)__builtin_frame_address(0) < stack_floor)
+    throw std::runtime_error("recursion too deep");
+
+  // `countdown` ran from `chunk` down to -1, so chunk + 1 steps were taken
+  long used = chunk - countdown;
+  chunk = countdown;
+  long total = (root->total_steps += used);
+
+  if (limits.max_steps != 0 && total > limits.max_steps)
+    throw std::runtime_error("out of fuel");
+
+  if (limits.max_millis != 0) {
+    steps_to_clock_check -= used;
+    if (steps_to_clock_check <= 0) {
+      steps_to_clock_check = CLOCK_CHECK_STEPS;
+      if (std::chrono::steady_clock::now() >= deadline)
+        throw std::runtime_error("time limit exceeded");
+    }
+  }
+
+  if (slice_steps != 0) {
+    slice_left -= used;
+    if (slice_left <= 0) {
+      slice_left = slice_steps;
+      if (owner != nullptr)
+        owner->yield();
+    }
+  }
+
+  // the next refill comes at whichever check is due first; fuel is
+  // taken in small chunks, since forked budgets may share it
+  long next = LONG_MAX / 2;
+  if (limits.max_steps != 0)
+    next = std::min(next, std::min(limits.max_steps - total, CLOCK_CHECK_STEPS));
+  if (limits.max_millis != 0)
+    next = std::min(next, steps_to_clock_check);
+  if (slice_steps != 0)
+    next = std::min(next, slice_left);
+  chunk = countdown = std::max(next - 1, 0L);
+}
+
+long EvalBudget::steps_used() {
+  return root->total_steps + (chunk - countdown);
+}
+
+// Runs `interp` under `limits`, filling in `usage` if given; memory
+// is only accounted for when it is limited or reported
+template <typename F>
+static PTR(Val) with_limits(const EvalLimits &limits, EvalUsage *usage, F interp) {
+  AllocPhaseScope phase(ALLOC_INTERP);
+  TraceSpan span("interp");
+  EvalBudget budget(limits, 0);
+  MemoryAccount *account = nullptr;
+  if (limits.max_bytes != 0 || usage != nullptr)
+    account = new MemoryAccount(limits.max_bytes);
+  EvalBudget *saved_budget = current_budget;
+  MemoryAccount *saved_account = current_account;
+  current_budget = &budget;
+  current_account = account;
+  PTR(Val) result;
+  std::exception_ptr error;
+  try {
+    result = interp();
+  } catch (...) {
+    error = std::current_exception();
+  }
+  current_budget = saved_budget;
+  current_account = saved_account;
+  if (usage != nullptr) {
+    usage->steps = budget.steps_used();
+    usage->peak_bytes = account->peak_bytes();
+  }
+  if (account != nullptr)
+    account->release();
+  if (error)
+    std::rethrow_exception(error);
+  return result;
+}
+
+PTR(Val) run_limited(const EvalLimits &limits, EvalUsage *usage,
+                     const std::function<PTR(Val)()> &interp) {
+  return with_limits(limits, usage, interp);
+}
+
+PTR(Val) interp_limited(PTR(Expr) e, PTR(Env) env, const EvalLimits &limits,
+                        EvalUsage *usage) {
+  return with_limits(limits, usage, [&] { return e->interp(env); });
+}
+
+PTR(Val) interp_limited(PTR(FlatAst) program, PTR(Env) env, const EvalLimits &limits,
+                        EvalUsage *usage) {
+  return with_limits(limits, usage, [&] { return program->interp(env); });
+}
+
+Evaluation::Evaluation(PTR(Expr) e, PTR(Env) env, const EvalLimits &limits, long slice_steps,
+                       size_t stack_size)
+: budget(limits, slice_steps) {
+  this->e = e;
+  this->env = env;
+  this->started = false;
+  this->done = false;
+  this->cancelled = false;
+  this->budget.owner = this;
+  this->account = new MemoryAccount(limits.max_bytes);
+
+  // reserved, not committed, so a large stack costs only what is used;
+  // the lowest page is left inaccessible to catch an overflow
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  this->stack_size = (stack_size + page - 1) / page * page + page;
+  int flags = MAP_PRIVATE | MAP_ANON;
+#ifdef MAP_NORESERVE
+  flags |= MAP_NORESERVE;
+#endif
+  void *mem = mmap(nullptr, this->stack_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (mem == MAP_FAILED)
+    throw std::runtime_error("cannot allocate an evaluation stack");
+  mprotect(mem, page, PROT_NONE);
+  this->stack = (char *)mem;
+  this->budget.stack_floor = stack_floor_in(stack + page, this->stack_size - page);
+
+  getcontext(&context);
+  context.uc_stack.ss_sp = stack;
+  context.uc_stack.ss_size = this->stack_size;
+  context.uc_link = nullptr;
+  // `makecontext` passes only `int`s, so `this` is split in two
+  uintptr_t self = (uintptr_t)this;
+  makecontext(&context, (void (*)())entry, 2,
+              (unsigned)((uint64_t)self >> 32), (unsigned)(self & 0xffffffffu));
+}
+
+Evaluation::~Evaluation() {
+  // resuming a cancelled evaluation makes its next step throw, which
+  // unwinds and frees everything the evaluation holds on its stack
+  if (started && !done) {
+    cancelled = true;
+    resume();
+  }
+  munmap(stack, stack_size);
+  account->release();
+}
+
+void Evaluation::entry(unsigned hi, unsigned lo) {
+  Evaluation *self = (Evaluation *)(((uintptr_t)hi << 32) | (uintptr_t)lo);
+  try {
+    self->value = self->e->interp(self->env);
+  } catch (...) {
+    self->error = std::current_exception();
+  }
+  self->done = true;
+  swapcontext(&self->context, &self->caller);
+}
+
+bool Evaluation::resume() {
+  if (done)
+    return true;
+  started = true;
+  AllocPhaseScope phase(ALLOC_INTERP);
+  TraceSpan span("interp");
+  EvalBudget *saved_budget = current_budget;
+  MemoryAccount *saved_account = current_account;
+  current_budget = &budget;
+  current_account = account;
+  swapcontext(&caller, &context);
+  current_budget = saved_budget;
+  current_account = saved_account;
+  return done;
+}
+
+void Evaluation::yield() {
+  swapcontext(&context, &caller);
+  if (cancelled)
+    throw std::runtime_error("evaluation cancelled");
+}
+
+bool Evaluation::finished() {
+  return done;
+}
+
+long Evaluation::steps_used() {
+  return budget.steps_used();
+}
+
+size_t Evaluation::peak_bytes() {
+  return account->peak_bytes();
+}
+
+PTR(Val) Evaluation::result() {
+  if (!done)
+    throw std::runtime_error("evaluation not finished");
+  if (error)
+    std::rethrow_exception(error);
+  return value;
+}
+
+void run_round_robin(std::vector<Evaluation *> &evaluations) {
+  bool any_left = true;
+  while (any_left) {
+    any_left = false;
+    for (Evaluation *evaluation : evaluations) {
+      if (!evaluation->resume())
+        any_left = true;
+    }
+  }
+}
+
+/* for tests */
+static PTR(Expr) parse_str(std::string s) {
+  std::istringstream in(s);
+  return parse(in);
+}
+
+static const char *COUNTDOWN_PROG =
+  "_let f = _fun (f) _fun (n) _if n == 0 _then 0 _else f(f)(n + -1) _in f(f)";
+
+#ifndef MSD_NO_BUDGET
+TEST_CASE( "budget" ) {
+  SECTION( "fuel" ) {
+    // each round is two calls, f(f) and then (n)
+    PTR(Expr) e = parse_str((std::string)COUNTDOWN_PROG + "(10)");
+    EvalLimits enough = {22, 0, 0};
+    EvalLimits short_one = {21, 0, 0};
+    CHECK( interp_limited(e, NEW(EmptyEnv)(), enough)->equals(NEW(NumVal)(0)) );
+    CHECK_THROWS_WITH( interp_limited(e, NEW(EmptyEnv)(), short_one), "out of fuel" );
+    CHECK( current_budget == nullptr );
+  }
+
+  SECTION( "memory" ) {
+    // each level of the closure chain keeps another environment alive
+    PTR(Expr) e = parse_str((std::string)COUNTDOWN_PROG + "(1000)");
+    EvalUsage small, large;
+    interp_limited(e, NEW(EmptyEnv)(), default_limits, &small);
+    interp_limited(parse_str((std::string)COUNTDOWN_PROG + "(2000)"), NEW(EmptyEnv)(), default_limits, &large);
+    CHECK( small.steps == 2002 );
+    CHECK( small.peak_bytes > 1000 * sizeof(ExtendedEnv) );
+    CHECK( large.peak_bytes > small.peak_bytes );
+
+    EvalLimits limits = {0, 0, small.peak_bytes + small.peak_bytes / 10};
+    CHECK( interp_limited(e, NEW(EmptyEnv)(), limits)->equals(NEW(NumVal)(0)) );
+    CHECK_THROWS_WITH( interp_limited(parse_str((std::string)COUNTDOWN_PROG + "(2000)"),
+                                      NEW(EmptyEnv)(), limits),
+                      "memory limit exceeded" );
+    CHECK( current_account == nullptr );
+  }
+
+  SECTION( "deadline" ) {
+    PTR(Expr) e = parse_str("_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1"
+                            " _else fib(fib)(x + -2) + fib(fib)(x + -1) _in fib(fib)(40)");
+    EvalLimits limits = {0, 20, 0};
+    CHECK_THROWS_WITH( interp_limited(e, NEW(EmptyEnv)(), limits), "time limit exceeded" );
+  }
+
+  SECTION( "depth" ) {
+    // each call is nested in the last, so the stack runs out long
+    // before the fuel does
+    PTR(Expr) e = parse_str("_let f = _fun (x) x(x) _in f(f)");
+    EvalLimits fuel = {100000, 0, 0};
+    CHECK_THROWS_WITH( interp_limited(e, NEW(EmptyEnv)(), fuel), "recursion too deep" );
+    CHECK_THROWS_WITH( interp_limited(e, NEW(EmptyEnv)(), default_limits), "recursion too deep" );
+    CHECK_THROWS_WITH( interp_limited(FlatAst::from_expr(e), NEW(EmptyEnv)(), default_limits),
+                      "recursion too deep" );
+    CHECK( current_budget == nullptr );
+
+    EvalLimits unlimited = {0, 0, 0};
+    Evaluation evaluation(e, NEW(EmptyEnv)(), unlimited, 0, 1024 * 1024);
+    CHECK( evaluation.resume() );
+    CHECK_THROWS_WITH( evaluation.result(), "recursion too deep" );
+
+    // recursion that fits still finishes
+    CHECK( interp_limited(parse_str((std::string)COUNTDOWN_PROG + "(10000)"), NEW(EmptyEnv)(), fuel)
+          ->equals(NEW(NumVal)(0)) );
+  }
+
+  SECTION( "yield and resume" ) {
+    PTR(Expr) e = parse_str((std::string)COUNTDOWN_PROG + "(1000)");
+    EvalLimits unlimited = {0, 0, 0};
+    Evaluation evaluation(e, NEW(EmptyEnv)(), unlimited, 100);
+    int slices = 1;
+    while (!evaluation.resume())
+      slices++;
+    CHECK( slices == 21 );
+    CHECK( evaluation.steps_used() == 2002 );
+    CHECK( evaluation.peak_bytes() > 1000 * sizeof(ExtendedEnv) );
+    CHECK( evaluation.result()->equals(NEW(NumVal)(0)) );
+    CHECK( current_budget == nullptr );
+    CHECK( current_account == nullptr );
+  }
+
+  SECTION( "round robin" ) {
+    EvalLimits unlimited = {0, 0, 0};
+    EvalLimits limited = {50, 0, 0};
+    Evaluation a(parse_str((std::string)COUNTDOWN_PROG + "(300)"), NEW(EmptyEnv)(), unlimited, 10);
+    Evaluation b(parse_str((std::string)COUNTDOWN_PROG + "(30)"), NEW(EmptyEnv)(), limited, 10);
+    Evaluation c(parse_str("1 + 2"), NEW(EmptyEnv)(), unlimited, 10);
+    std::vector<Evaluation *> evaluations = {&a, &b, &c};
+    run_round_robin(evaluations);
+    CHECK( a.result()->equals(NEW(NumVal)(0)) );
+    CHECK_THROWS_WITH( b.result(), "out of fuel" );
+    CHECK( c.result()->equals(NEW(NumVal)(3)) );
+  }
+
+  SECTION( "cancel" ) {
+    EvalLimits unlimited = {0, 0, 0};
+    {
+      Evaluation evaluation(parse_str("_let f = _fun (x) x(x) _in f(f)"),
+                            NEW(EmptyEnv)(), unlimited, 10);
+      CHECK( ! evaluation.resume() );
+      CHECK( ! evaluation.finished() );
+    }
+    CHECK( current_budget == nullptr );
+  }
+}
+#endif
+
+TEST_CASE( "budget overhead", "[.][bench]" ) {
+  PTR(Expr) e = parse_str("_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1"
+                          " _else fib(fib)(x + -2) + fib(fib)(x + -1) _in fib(fib)(25)");
+  EvalLimits unlimited = {0, 0, 0};
+  EvalLimits limited = {LONG_MAX / 4, 60 * 60 * 1000, 0};
+
+  auto time = [&](const EvalLimits &limits) {
+    auto start = std::chrono::steady_clock::now();
+    interp_limited(e, NEW(EmptyEnv)(), limits);
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  };
+  // interleaved, keeping the best of each, so drift in machine load
+  // affects both sides alike
+  double off = 1e30, on = 1e30;
+  for (int i = 0; i < 9; i++) {
+    off = std::min(off, time(unlimited));
+    on = std::min(on, time(limited));
+  }
+  WARN( "no budget: " << off << " ms, fuel and deadline: " << on << " ms ("
+       << (on / off - 1) * 100 << "% overhead)" );
+}
@@ -0,0 +1,176 @@
+//
+//  budget.hpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/15/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef budget_hpp
+#define budget_hpp
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <vector>
+#include <ucontext.h>
+#include "pointer.hpp"
+
+class Expr;
+class FlatAst;
+class Val;
+class Env;
+class Evaluation;
+class MemoryAccount;
+
+// Limits for one evaluation; 0 means unlimited
+struct EvalLimits {
+  // Function calls the evaluation may make. Only calls can make an
+  // evaluation run longer than the size of its program, so they are
+  // the steps that get counted.
+  long max_steps;
+  // Wall-clock time from when the evaluation is created, including
+  // time spent suspended between slices
+  long max_millis;
+  // Bytes of live objects allocated through `NEW`
+  size_t max_bytes;
+};
+
+// What one evaluation used
+struct EvalUsage {
+  long steps;
+  size_t peak_bytes;
+};
+
+// Limits applied by `interp_limited` callers such as `run_program`;
+// set once at startup
+extern EvalLimits default_limits;
+
+/*
+ * Step and time accounting for the evaluation running on this thread.
+ * The per-call cost is a decrement of `countdown` and a comparison
+ * with `stack_floor`; the slower checks (fuel, clock and time slice)
+ * run in `refill` once either fails.
+ * */
+class EvalBudget {
+public:
+  long countdown;
+  // The lowest native stack address a call may start at, which limits
+  // how deeply the evaluation can recurse: below it, `refill` throws
+  // before the stack overflows
+  char *stack_floor;
+
+  EvalBudget(const EvalLimits &limits, long slice_steps);
+  // A budget for part of `parent`'s evaluation forked onto this
+  // thread: its steps count against the parent's fuel, and it has the
+  // parent's deadline
+  EvalBudget(EvalBudget &parent);
+  // Adds a forked budget's remaining steps to its parent's
+  ~EvalBudget();
+
+  // Charges the steps since the last refill, throwing `runtime_error`
+  // when out of fuel, time or stack, and yielding at the end of a time
+  // slice
+  void refill();
+  long steps_used();
+
+private:
+  friend class Evaluation;
+
+  EvalLimits limits;
+  long slice_steps;
+  std::chrono::steady_clock::time_point deadline;
+  // this budget, or the one a forked budget charges its steps to
+  EvalBudget *root;
+
+  long chunk;
+  // steps charged by refills of this budget and any forked from it
+  std::atomic<long> total_steps;
+  long steps_to_clock_check;
+  long slice_left;
+  Evaluation *owner;
+};
+
+extern thread_local EvalBudget *current_budget;
+
+// Building with `MSD_NO_BUDGET` removes the step charging, so fuel,
+// time limits and the depth limit no longer apply
+#ifdef MSD_NO_BUDGET
+static const bool budget_enabled = false;
+#else
+static const bool budget_enabled = true;
+#endif
+
+// Called once per function call. Building with `MSD_NO_BUDGET`
+// removes even the null check, and with it the depth limit.
+inline void charge_step() {
+#ifndef MSD_NO_BUDGET
+  EvalBudget *budget = current_budget;
+  if (budget != nullptr
+      && (--budget->countdown < 0 || (char *)__builtin_frame_address(0) < budget->stack_floor))
+    budget->refill();
+#endif
+}
+
+// Runs `interp` under `limits`, filling in `usage` if given. Every
+// evaluation gets a budget, so even an unlimited one stops with
+// `runtime_error` rather than overflowing the stack.
+PTR(Val) run_limited(const EvalLimits &limits, EvalUsage *usage,
+                     const std::function<PTR(Val)()> &interp);
+
+// Interprets `e` under `limits`, filling in `usage` if given
+PTR(Val) interp_limited(PTR(Expr) e, PTR(Env) env, const EvalLimits &limits,
+                        EvalUsage *usage = nullptr);
+// The same for a program in flat form
+PTR(Val) interp_limited(PTR(FlatAst) program, PTR(Env) env, const EvalLimits &limits,
+                        EvalUsage *usage = nullptr);
+
+/*
+ * An evaluation that runs on its own stack, so it can stop after a
+ * slice of `slice_steps` steps and be resumed later, letting a
+ * scheduler share a thread fairly between long evaluations. Resume
+ * it only from the thread that started it.
+ * */
+class Evaluation {
+public:
+  Evaluation(PTR(Expr) e, PTR(Env) env, const EvalLimits &limits, long slice_steps,
+             size_t stack_size = 64 * 1024 * 1024);
+  // Unwinds an unfinished evaluation before freeing its stack. The
+  // result may outlive it.
+  ~Evaluation();
+
+  // Runs the next slice; returns true once the evaluation is finished
+  bool resume();
+  bool finished();
+  long steps_used();
+  size_t peak_bytes();
+  // The value, or rethrows the evaluation's error
+  PTR(Val) result();
+
+private:
+  friend class EvalBudget;
+
+  PTR(Expr) e;
+  PTR(Env) env;
+  EvalBudget budget;
+  MemoryAccount *account;
+  PTR(Val) value;
+  std::exception_ptr error;
+  bool started;
+  bool done;
+  bool cancelled;
+
+  char *stack;
+  size_t stack_size;
+  ucontext_t context;
+  ucontext_t caller;
+
+  static void entry(unsigned hi, unsigned lo);
+  void yield();
+};
+
+// Resumes each unfinished evaluation in turn until all are finished
+void run_round_robin(std::vector<Evaluation *> &evaluations);
+
+#endif /* budget_hpp */
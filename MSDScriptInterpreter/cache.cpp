@@ -0,0 +1,215 @@
+//
+//  cache.cpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/20/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include <chrono>
+#include <sstream>
+#include "cache.hpp"
+#include "expr.hpp"
+#include "parse.hpp"
+#include "batch.hpp"
+#include "catch.hpp"
+#include "trace.hpp"
+
+ProgramCache program_cache(1024);
+
+uint64_t hash_source(const std::string &source) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : source) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+ProgramCache::ProgramCache(size_t capacity, size_t max_bytes) {
+  this->capacity = capacity;
+  this->max_bytes = max_bytes;
+  this->source_bytes = 0;
+  this->hit_count = 0;
+  this->miss_count = 0;
+}
+
+std::list<ProgramCache::Entry>::iterator ProgramCache::find(uint64_t hash, const std::string &source,
+                                                            bool optimized) {
+  auto range = index.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second->optimized == optimized && it->second->source == source)
+      return it->second;
+  }
+  return entries.end();
+}
+
+void ProgramCache::evict_to(size_t count, size_t max_bytes) {
+  while (entries.size() > count || source_bytes > max_bytes) {
+    auto last = std::prev(entries.end());
+    auto range = index.equal_range(last->hash);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second == last) {
+        index.erase(it);
+        break;
+      }
+    }
+    source_bytes -= last->source.size();
+    entries.pop_back();
+  }
+}
+
+PTR(Expr) ProgramCache::get(const std::string &source, bool optimized) {
+  uint64_t hash = hash_source(source);
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto found = find(hash, source, optimized);
+    if (found != entries.end()) {
+      hit_count++;
+      entries.splice(entries.begin(), entries, found);
+      return found->tree;
+    }
+    miss_count++;
+  }
+
+  // parsed without the lock, so a slow parse doesn't hold up hits
+  std::istringstream in(source);
+  PTR(Expr) tree = parse(in);
+  if (optimized) {
+    AllocPhaseScope phase(ALLOC_OPTIMIZE);
+    TraceSpan span("optimize");
+    tree = tree->optimize();
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  if (capacity == 0 || source.size() > max_bytes)
+    return tree;
+  // another thread may have added it meanwhile
+  auto found = find(hash, source, optimized);
+  if (found != entries.end())
+    return found->tree;
+  Entry entry = {hash, source, optimized, tree};
+  entries.push_front(entry);
+  index.insert(std::make_pair(hash, entries.begin()));
+  source_bytes += source.size();
+  evict_to(capacity, max_bytes);
+  return tree;
+}
+
+void ProgramCache::set_capacity(size_t capacity) {
+  std::lock_guard<std::mutex> guard(lock);
+  this->capacity = capacity;
+  evict_to(capacity, max_bytes);
+}
+
+void ProgramCache::set_max_bytes(size_t max_bytes) {
+  std::lock_guard<std::mutex> guard(lock);
+  this->max_bytes = max_bytes;
+  evict_to(capacity, max_bytes);
+}
+
+size_t ProgramCache::size() {
+  std::lock_guard<std::mutex> guard(lock);
+  return entries.size();
+}
+
+size_t ProgramCache::bytes() {
+  std::lock_guard<std::mutex> guard(lock);
+  return source_bytes;
+}
+
+unsigned long ProgramCache::hits() {
+  std::lock_guard<std::mutex> guard(lock);
+  return hit_count;
+}
+
+unsigned long ProgramCache::misses() {
+  std::lock_guard<std::mutex> guard(lock);
+  return miss_count;
+}
+
+TEST_CASE( "ProgramCache" ) {
+  SECTION( "hits return the same tree" ) {
+    ProgramCache cache(4);
+    PTR(Expr) a = cache.get("1 + 2", false);
+    CHECK( cache.get("1 + 2", false) == a );
+    CHECK( cache.get("1 + 2", true) != a );
+    CHECK( cache.get("1 + 2", true)->to_string() == "3" );
+    CHECK( cache.hits() == 2 );
+    CHECK( cache.misses() == 2 );
+    CHECK( cache.size() == 2 );
+  }
+
+  SECTION( "evicts the least recently used" ) {
+    ProgramCache cache(2);
+    PTR(Expr) one = cache.get("1", false);
+    cache.get("2", false);
+    cache.get("1", false);
+    cache.get("3", false);
+    CHECK( cache.size() == 2 );
+    CHECK( cache.get("1", false) == one );
+    CHECK( cache.misses() == 3 );
+    cache.get("2", false);
+    CHECK( cache.misses() == 4 );
+
+    cache.set_capacity(0);
+    CHECK( cache.size() == 0 );
+    CHECK( cache.get("1", false)->to_string() == "1" );
+    CHECK( cache.size() == 0 );
+  }
+
+  SECTION( "bounded by source bytes" ) {
+    ProgramCache cache(100, 12);
+    PTR(Expr) a = cache.get("1 + 2", false);
+    cache.get("3 + 4", false);
+    CHECK( cache.bytes() == 10 );
+    // a third 5-byte source pushes out the least recently used
+    cache.get("5 + 6", false);
+    CHECK( cache.size() == 2 );
+    CHECK( cache.bytes() == 10 );
+    CHECK( cache.get("1 + 2", false) != a );
+
+    // too long to cache at all
+    cache.get("1 + 2 + 3 + 4", false);
+    CHECK( cache.bytes() <= 12 );
+    CHECK( cache.get("1 + 2 + 3 + 4", false)->to_string() == "(1 + (2 + (3 + 4)))" );
+    CHECK( cache.misses() == 6 );
+
+    cache.set_max_bytes(5);
+    CHECK( cache.size() == 1 );
+    CHECK( cache.bytes() == 5 );
+  }
+
+  SECTION( "parse errors aren't cached" ) {
+    ProgramCache cache(2);
+    CHECK_THROWS_WITH( cache.get("(1", false), "expected a close parenthesis" );
+    CHECK( cache.size() == 0 );
+  }
+
+  SECTION( "hash" ) {
+    CHECK( hash_source("") == 14695981039346656037ULL );
+    CHECK( hash_source("1 + 2") != hash_source("2 + 1") );
+  }
+}
+
+TEST_CASE( "program cache speedup", "[.][bench]" ) {
+  // a few hundred distinct programs, each seen many times
+  std::vector<std::string> programs;
+  for (int i = 0; i < 200; i++) {
+    programs.push_back("_let f = _fun (x) _if x == 0 _then 0 _else x + " + std::to_string(i)
+                       + " _in (_let g = _fun (y) y * y _in g(f(3)) + g(f(4)) + g(f(5)))");
+  }
+
+  auto time = [&](size_t capacity) {
+    program_cache.set_capacity(capacity);
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < 50; round++) {
+      for (const std::string &program : programs)
+        run_program(program, false);
+    }
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  };
+  double uncached = time(0);
+  double cached = time(1024);
+  WARN( "uncached: " << uncached << " ms, cached: " << cached << " ms" );
+}
@@ -0,0 +1,80 @@
+//
+//  cache.hpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/20/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef cache_hpp
+#define cache_hpp
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "pointer.hpp"
+
+class Expr;
+
+// 64-bit FNV-1a
+uint64_t hash_source(const std::string &source);
+
+/*
+ * Parsed (and optionally optimized) trees keyed by their source text,
+ * so a program seen before skips `parse` and `optimize`. Holds at most
+ * `capacity` trees whose sources total at most `max_bytes`, evicting
+ * the least recently used. Every node takes at least one character of
+ * source, so bounding the sources bounds the trees too. Safe to share
+ * between threads; a tree it returns may be evaluated by several
+ * threads at once.
+ * */
+class ProgramCache {
+public:
+  static const size_t DEFAULT_MAX_BYTES = 16 * 1024 * 1024;
+
+  // A `capacity` or `max_bytes` of 0 caches nothing; a source longer
+  // than `max_bytes` is never cached
+  ProgramCache(size_t capacity, size_t max_bytes = DEFAULT_MAX_BYTES);
+
+  // The tree for `source`, parsed and, if `optimized`, optimized on a
+  // miss. Throws `runtime_error` for a parse error, which isn't cached.
+  PTR(Expr) get(const std::string &source, bool optimized);
+
+  void set_capacity(size_t capacity);
+  void set_max_bytes(size_t max_bytes);
+  size_t size();
+  // total length of the cached sources
+  size_t bytes();
+  unsigned long hits();
+  unsigned long misses();
+
+private:
+  struct Entry {
+    uint64_t hash;
+    std::string source;
+    bool optimized;
+    PTR(Expr) tree;
+  };
+
+  std::mutex lock;
+  size_t capacity;
+  size_t max_bytes;
+  size_t source_bytes;
+  // most recently used first
+  std::list<Entry> entries;
+  std::unordered_multimap<uint64_t, std::list<Entry>::iterator> index;
+  unsigned long hit_count;
+  unsigned long miss_count;
+
+  // with `lock` held
+  std::list<Entry>::iterator find(uint64_t hash, const std::string &source, bool optimized);
+  // evicts until at most `count` entries totalling `max_bytes` remain
+  void evict_to(size_t count, size_t max_bytes);
+};
+
+// Used by `run_program`
+extern ProgramCache program_cache;
+
+#endif /* cache_hpp */
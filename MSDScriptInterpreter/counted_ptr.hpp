@@ -0,0 +1,88 @@
+//
+//  counted_ptr.hpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/27/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef counted_ptr_hpp
+#define counted_ptr_hpp
+
+#include <memory>
+#include <utility>
+
+// Reference count increments and decrements made by `CountedPtr`s on
+// this thread
+extern thread_local unsigned long ref_count_ops;
+
+/*
+ * A `shared_ptr` that counts the atomic reference count updates it
+ * makes: one per copy of an owning pointer, and one when an owning
+ * pointer is dropped. Moves, and pointers without a control block
+ * (such as immortal values), are free. Used as `PTR` when building
+ * with `MSD_COUNT_REFS`, to measure refcount traffic.
+ * */
+template <class T>
+class CountedPtr : public std::shared_ptr<T> {
+public:
+  CountedPtr() {}
+  CountedPtr(std::nullptr_t) {}
+
+  CountedPtr(const CountedPtr &other) : std::shared_ptr<T>(other) {
+    count_copy();
+  }
+  CountedPtr(CountedPtr &&other) : std::shared_ptr<T>(std::move(other)) {}
+
+  template <class U>
+  CountedPtr(const std::shared_ptr<U> &other) : std::shared_ptr<T>(other) {
+    count_copy();
+  }
+  template <class U>
+  CountedPtr(std::shared_ptr<U> &&other) : std::shared_ptr<T>(std::move(other)) {}
+
+  ~CountedPtr() {
+    if (this->use_count() != 0)
+      ref_count_ops++;
+  }
+
+  CountedPtr &operator=(const CountedPtr &other) {
+    CountedPtr(other).swap(*this);
+    return *this;
+  }
+  CountedPtr &operator=(CountedPtr &&other) {
+    CountedPtr(std::move(other)).swap(*this);
+    return *this;
+  }
+  template <class U>
+  CountedPtr &operator=(const std::shared_ptr<U> &other) {
+    CountedPtr(other).swap(*this);
+    return *this;
+  }
+  template <class U>
+  CountedPtr &operator=(std::shared_ptr<U> &&other) {
+    CountedPtr(std::move(other)).swap(*this);
+    return *this;
+  }
+  CountedPtr &operator=(std::nullptr_t) {
+    CountedPtr().swap(*this);
+    return *this;
+  }
+
+private:
+  void count_copy() {
+    if (this->use_count() != 0)
+      ref_count_ops++;
+  }
+};
+
+// `dynamic_pointer_cast`, counting the copy it makes
+template <class T, class U>
+CountedPtr<T> counted_cast(const std::shared_ptr<U> &p) {
+  CountedPtr<T> result = std::dynamic_pointer_cast<T>(p);
+  if (result.use_count() != 0)
+    ref_count_ops++;
+  return result;
+}
+
+#endif /* counted_ptr_hpp */
@@ -6,21 +6,28 @@
 //  Copyright © 2020 Warner Nielsen. All rights reserved.
 //
 
+#include <utility>
 #include "env.hpp"
+#include "reclaim.hpp"
 
 EmptyEnv::EmptyEnv() {}
 
-PTR(Val) EmptyEnv::lookup(std::string find_name) {
+PTR(Val) EmptyEnv::lookup(Symbol find_name) {
   throw std::runtime_error("free variable: " + find_name);
 }
 
-ExtendedEnv::ExtendedEnv(std::string name, PTR(Val) val, PTR(Env) rest) {
+ExtendedEnv::ExtendedEnv(Symbol name, PTR(Val) val, PTR(Env) rest) {
   this->name = name;
-  this->val = val;
-  this->rest = rest;
+  this->val = std::move(val);
+  this->rest = std::move(rest);
 }
 
-PTR(Val) ExtendedEnv::lookup(std::string find_name) {
+ExtendedEnv::~ExtendedEnv() {
+  destroy_iteratively(val);
+  destroy_iteratively(rest);
+}
+
+PTR(Val) ExtendedEnv::lookup(Symbol find_name) {
   if (find_name == name)
     return val;
   else
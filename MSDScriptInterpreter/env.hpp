@@ -11,28 +11,30 @@
 
 #include <string>
 #include "pointer.hpp"
+#include "symbol.hpp"
 
 class Val;
 
 class Env {
 public:
-  virtual PTR(Val) lookup(std::string find_name) = 0;
+  virtual PTR(Val) lookup(Symbol find_name) = 0;
 };
 
 class EmptyEnv : public Env {
 public:
   EmptyEnv();
-  PTR(Val) lookup(std::string find_name);
+  PTR(Val) lookup(Symbol find_name);
 };
 
 class ExtendedEnv : public Env {
 public:
-  std::string name;
+  Symbol name;
   PTR(Val) val;
   PTR(Env) rest;
   
-  ExtendedEnv(std::string name, PTR(Val) val, PTR(Env) rest);
-  PTR(Val) lookup(std::string find_name);
+  ExtendedEnv(Symbol name, PTR(Val) val, PTR(Env) rest);
+  ~ExtendedEnv();
+  PTR(Val) lookup(Symbol find_name);
 };
 
 
@@ -6,34 +6,89 @@
 //  Copyright © 2020 Warner Nielsen. All rights reserved.
 //
 
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <sstream>
+#include <typeinfo>
+#include <utility>
 #include "expr.hpp"
 #include "catch.hpp"
 #include "value.hpp"
 #include "env.hpp"
+#include "bigint.hpp"
+#include "parallel.hpp"
+#include "budget.hpp"
+#include "serialize.hpp"
+#include "parse.hpp"
+#include "reclaim.hpp"
+#include "hooks.hpp"
+
+// Saturating, so a huge tree doesn't wrap around to a small weight
+static unsigned add_weights(unsigned a, unsigned b) {
+  unsigned sum = a + b;
+  return sum < a ? UINT_MAX : sum;
+}
+
+void Expr::print(std::ostream &out) {
+  std::vector<PrintItem> pending;
+  pending.push_back(PrintItem{this, nullptr});
+  while (!pending.empty()) {
+    PrintItem item = pending.back();
+    pending.pop_back();
+    if (item.expr != nullptr)
+      item.expr->print_node(out, pending);
+    else
+      out << item.text;
+  }
+}
+
+std::string Expr::to_string() {
+  std::ostringstream out;
+  print(out);
+  return out.str();
+}
+
+static void push_print(std::vector<PrintItem> &pending, const char *text) {
+  pending.push_back(PrintItem{nullptr, text});
+}
+
+static void push_print(std::vector<PrintItem> &pending, const PTR(Expr) &e) {
+  pending.push_back(PrintItem{&*e, nullptr});
+}
 
 NumExpr::NumExpr(int rep) {
+  this->weight = 1;
   this->rep = rep;
-  val = NEW(NumVal)(rep);
+  val = NumVal::make(rep);
 }
 
-bool NumExpr::equals(PTR(Expr) e) {
+// For literals outside `int` range; `rep` is unused
+NumExpr::NumExpr(const BigInt &big) {
+  this->weight = 1;
+  this->rep = 0;
+  val = NEW(NumVal)(big);
+}
+
+bool NumExpr::equals(const PTR(Expr) &e) {
   PTR(NumExpr) n = CAST(NumExpr)(e);
   if (n == NULL)
     return false;
   else
-    return rep == n->rep;
+    return val->equals(n->val);
 }
 
-PTR(Val) NumExpr::interp(PTR(Env) env) {
+PTR(Val) NumExpr::interp(const PTR(Env) &env) {
+  NodeScope scope(NUM_NODE);
   return val;
 }
 
-PTR(Expr) NumExpr::subst(std::string var, PTR(Val) new_val) {
-  return NEW(NumExpr)(rep);
+PTR(Expr) NumExpr::subst(Symbol var, const PTR(Val) &new_val) {
+  return val->to_expr();
 }
 
 PTR(Expr) NumExpr::optimize() {
-  return NEW(NumExpr)(rep);
+  return val->to_expr();
 }
 
 
@@ -41,16 +96,33 @@ bool NumExpr::containsVarExpr() {
   return false;
 }
 
-std::string NumExpr::to_string() {
-  return std::to_string(rep);
+void NumExpr::print_node(std::ostream &out, std::vector<PrintItem> &pending) {
+  val->print(out);
+}
+
+void NumExpr::serialize(ExprWriter &out) {
+  PTR(NumVal) n = CAST(NumVal)(val);
+  if (n->big == nullptr) {
+    out.write_tag(NUM_TAG);
+    out.write_int(n->rep);
+  } else {
+    out.write_tag(BIG_NUM_TAG);
+    out.write_big(*n->big);
+  }
 }
 
 AddExpr::AddExpr(PTR(Expr) lhs, PTR(Expr) rhs) {
-  this->lhs = lhs;
-  this->rhs = rhs;
+  this->weight = add_weights(1, add_weights(lhs->weight, rhs->weight));
+  this->lhs = std::move(lhs);
+  this->rhs = std::move(rhs);
+}
+
+AddExpr::~AddExpr() {
+  destroy_iteratively(lhs);
+  destroy_iteratively(rhs);
 }
 
-bool AddExpr::equals(PTR(Expr) e) {
+bool AddExpr::equals(const PTR(Expr) &e) {
   PTR(AddExpr) a = CAST(AddExpr)(e);
   if (a == NULL)
     return false;
@@ -58,11 +130,14 @@ bool AddExpr::equals(PTR(Expr) e) {
     return (lhs->equals(a->lhs) && rhs->equals(a->rhs));
 }
 
-PTR(Val) AddExpr::interp(PTR(Env) env) {
-  return lhs->interp(env)->add_to(rhs->interp(env));
+PTR(Val) AddExpr::interp(const PTR(Env) &env) {
+  NodeScope scope(ADD_NODE);
+  PTR(Val) lhs_val, rhs_val;
+  interp_operands(lhs, rhs, env, lhs_val, rhs_val);
+  return lhs_val->add_to(rhs_val);
 }
 
-PTR(Expr) AddExpr::subst(std::string var, PTR(Val) new_val) {
+PTR(Expr) AddExpr::subst(Symbol var, const PTR(Val) &new_val) {
   return NEW(AddExpr)(lhs->subst(var, new_val),
                      (rhs->subst(var, new_val)));
 }
@@ -80,16 +155,32 @@ bool AddExpr::containsVarExpr() {
   return (lhs->containsVarExpr() || rhs->containsVarExpr());
 }
 
-std::string AddExpr::to_string() {
-  return "(" + lhs->to_string() + " + " + rhs->to_string() + ")";
+void AddExpr::print_node(std::ostream &out, std::vector<PrintItem> &pending) {
+  out << "(";
+  push_print(pending, ")");
+  push_print(pending, rhs);
+  push_print(pending, " + ");
+  push_print(pending, lhs);
+}
+
+void AddExpr::serialize(ExprWriter &out) {
+  out.write_tag(ADD_TAG);
+  lhs->serialize(out);
+  rhs->serialize(out);
 }
 
 MultExpr::MultExpr(PTR(Expr) lhs, PTR(Expr) rhs) {
-  this->lhs = lhs;
-  this->rhs = rhs;
+  this->weight = add_weights(1, add_weights(lhs->weight, rhs->weight));
+  this->lhs = std::move(lhs);
+  this->rhs = std::move(rhs);
+}
+
+MultExpr::~MultExpr() {
+  destroy_iteratively(lhs);
+  destroy_iteratively(rhs);
 }
 
-bool MultExpr::equals(PTR(Expr) e) {
+bool MultExpr::equals(const PTR(Expr) &e) {
   PTR(MultExpr) m = CAST(MultExpr)(e);
   if (m == NULL)
     return false;
@@ -97,11 +188,14 @@ bool MultExpr::equals(PTR(Expr) e) {
     return (lhs->equals(m->lhs) && rhs->equals(m->rhs));
 }
 
-PTR(Val) MultExpr::interp(PTR(Env) env) {
-  return lhs->interp(env)->mult_with(rhs->interp(env));
+PTR(Val) MultExpr::interp(const PTR(Env) &env) {
+  NodeScope scope(MULT_NODE);
+  PTR(Val) lhs_val, rhs_val;
+  interp_operands(lhs, rhs, env, lhs_val, rhs_val);
+  return lhs_val->mult_with(rhs_val);
 }
 
-PTR(Expr) MultExpr::subst(std::string var, PTR(Val) new_val) {
+PTR(Expr) MultExpr::subst(Symbol var, const PTR(Val) &new_val) {
   return NEW(MultExpr)(lhs->subst(var, new_val),
                       rhs->subst(var, new_val));
 }
@@ -119,27 +213,39 @@ bool MultExpr::containsVarExpr() {
   return (lhs->containsVarExpr() || rhs->containsVarExpr());
 }
 
-std::string MultExpr::to_string() {
-  return "(" + lhs->to_string() + " * " + rhs->to_string() + ")";
+void MultExpr::print_node(std::ostream &out, std::vector<PrintItem> &pending) {
+  out << "(";
+  push_print(pending, ")");
+  push_print(pending, rhs);
+  push_print(pending, " * ");
+  push_print(pending, lhs);
 }
 
-VarExpr::VarExpr(std::string name) {
+void MultExpr::serialize(ExprWriter &out) {
+  out.write_tag(MULT_TAG);
+  lhs->serialize(out);
+  rhs->serialize(out);
+}
+
+VarExpr::VarExpr(Symbol name) {
+  this->weight = 1;
   this->name = name;
 }
 
-bool VarExpr::equals(PTR(Expr) e) {
+bool VarExpr::equals(const PTR(Expr) &e) {
   PTR(VarExpr) v = CAST(VarExpr)(e);
   if (v == NULL)
     return false;
   else
-    return name.compare(v->name) == 0;
+    return name == v->name;
 }
 
-PTR(Val) VarExpr::interp(PTR(Env) env) {
+PTR(Val) VarExpr::interp(const PTR(Env) &env) {
+  NodeScope scope(VAR_NODE);
   return env->lookup(name);
 }
 
-PTR(Expr) VarExpr::subst(std::string var, PTR(Val) new_val) {
+PTR(Expr) VarExpr::subst(Symbol var, const PTR(Val) &new_val) {
   if (name == var)
     return new_val->to_expr();
   else
@@ -154,17 +260,28 @@ bool VarExpr::containsVarExpr() {
   return true;
 }
 
-std::string VarExpr::to_string() {
-  return name;
+void VarExpr::print_node(std::ostream &out, std::vector<PrintItem> &pending) {
+  out << name;
+}
+
+void VarExpr::serialize(ExprWriter &out) {
+  out.write_tag(VAR_TAG);
+  out.write_name(name);
 }
 
-LetExpr::LetExpr(std::string name, PTR(Expr) rhs, PTR(Expr) body) {
+LetExpr::LetExpr(Symbol name, PTR(Expr) rhs, PTR(Expr) body) {
+  this->weight = add_weights(1, add_weights(rhs->weight, body->weight));
   this->name = name;
-  this->rhs = rhs;
-  this->body = body;
+  this->rhs = std::move(rhs);
+  this->body = std::move(body);
 }
 
-bool LetExpr::equals(PTR(Expr) e) {
+LetExpr::~LetExpr() {
+  destroy_iteratively(rhs);
+  destroy_iteratively(body);
+}
+
+bool LetExpr::equals(const PTR(Expr) &e) {
   PTR(LetExpr) l = CAST(LetExpr)(e);
   if (l == NULL)
     return false;
@@ -172,13 +289,14 @@ bool LetExpr::equals(PTR(Expr) e) {
     return (name == l->name && rhs->equals(l->rhs) && body->equals(l->body));
 }
 
-PTR(Val) LetExpr::interp(PTR(Env) env) {
+PTR(Val) LetExpr::interp(const PTR(Env) &env) {
+  NodeScope scope(LET_NODE);
   PTR(Val) rhs_val = rhs->interp(env);
-  PTR(Env) new_env = NEW(ExtendedEnv) (name, rhs_val, env);
+  PTR(Env) new_env = NEW(ExtendedEnv) (name, std::move(rhs_val), env);
   return body->interp(new_env);
 }
 
-PTR(Expr) LetExpr::subst(std::string var, PTR(Val) new_val) {
+PTR(Expr) LetExpr::subst(Symbol var, const PTR(Val) &new_val) {
   if (name == var)
     return NEW(LetExpr)(name, rhs->subst(var, new_val), body->subst(var, new_val));
   else
@@ -199,15 +317,27 @@ PTR(Expr) LetExpr::optimize() {
   }
 }
 
-std::string LetExpr::to_string() {
-  return "(_let " + name + " = " + rhs->to_string() + " _in " + body->to_string() + ")";
+void LetExpr::print_node(std::ostream &out, std::vector<PrintItem> &pending) {
+  out << "(_let " << name << " = ";
+  push_print(pending, ")");
+  push_print(pending, body);
+  push_print(pending, " _in ");
+  push_print(pending, rhs);
+}
+
+void LetExpr::serialize(ExprWriter &out) {
+  out.write_tag(LET_TAG);
+  out.write_name(name);
+  rhs->serialize(out);
+  body->serialize(out);
 }
 
 BoolExpr::BoolExpr(bool rep) {
+  this->weight = 1;
   this->rep = rep;
 }
 
-bool BoolExpr::equals(PTR(Expr) e) {
+bool BoolExpr::equals(const PTR(Expr) &e) {
   PTR(BoolExpr) b = CAST(BoolExpr)(e);
   if (b == NULL)
     return false;
@@ -215,11 +345,12 @@ bool BoolExpr::equals(PTR(Expr) e) {
     return rep == b->rep;
 }
 
-PTR(Val) BoolExpr::interp(PTR(Env) env) {
-  return NEW(BoolVal)(rep);
+PTR(Val) BoolExpr::interp(const PTR(Env) &env) {
+  NodeScope scope(BOOL_NODE);
+  return BoolVal::make(rep);
 }
 
-PTR(Expr) BoolExpr::subst(std::string var, PTR(Val) new_val) {
+PTR(Expr) BoolExpr::subst(Symbol var, const PTR(Val) &new_val) {
   return NEW(BoolExpr)(rep);
 }
 
@@ -232,20 +363,32 @@ bool BoolExpr::containsVarExpr() {
   return false;
 }
 
-std::string BoolExpr::to_string() {
+void BoolExpr::print_node(std::ostream &out, std::vector<PrintItem> &pending) {
   if (rep)
-    return "_true";
+    out << "_true";
   else
-    return "_false";
+    out << "_false";
+}
+
+void BoolExpr::serialize(ExprWriter &out) {
+  out.write_tag(rep ? TRUE_TAG : FALSE_TAG);
 }
 
 IfExpr::IfExpr(PTR(Expr) test_part, PTR(Expr) then_part, PTR(Expr) else_part) {
-  this->test_part = test_part;
-  this->then_part = then_part;
-  this->else_part = else_part;
+  this->weight = add_weights(1, add_weights(test_part->weight,
+                                            std::max(then_part->weight, else_part->weight)));
+  this->test_part = std::move(test_part);
+  this->then_part = std::move(then_part);
+  this->else_part = std::move(else_part);
+}
+
+IfExpr::~IfExpr() {
+  destroy_iteratively(test_part);
+  destroy_iteratively(then_part);
+  destroy_iteratively(else_part);
 }
 
-bool IfExpr::equals(PTR(Expr) e) {
+bool IfExpr::equals(const PTR(Expr) &e) {
   PTR(IfExpr) ie = CAST(IfExpr)(e);
   if (ie == NULL)
     return false;
@@ -253,14 +396,15 @@ bool IfExpr::equals(PTR(Expr) e) {
     return (test_part->equals(ie->test_part) && then_part->equals(ie->then_part) && else_part->equals(ie->else_part));
 }
 
-PTR(Val) IfExpr::interp(PTR(Env) env) {
+PTR(Val) IfExpr::interp(const PTR(Env) &env) {
+  NodeScope scope(IF_NODE);
   if (test_part->interp(env)->is_true())
     return then_part->interp(env);
   else
     return else_part->interp(env);
 }
 
-PTR(Expr) IfExpr::subst(std::string var, PTR(Val) new_val) {
+PTR(Expr) IfExpr::subst(Symbol var, const PTR(Val) &new_val) {
   return NEW(IfExpr)(test_part->subst(var, new_val), then_part->subst(var, new_val), else_part->subst(var, new_val));
 }
 
@@ -280,16 +424,35 @@ bool IfExpr::containsVarExpr() {
   return (test_part->containsVarExpr() || then_part->containsVarExpr() || else_part->containsVarExpr());
 }
 
-std::string IfExpr::to_string() {
-  return "(_if " + test_part->to_string() + " _then " + then_part->to_string() + " _else " + else_part->to_string() + ")";
+void IfExpr::print_node(std::ostream &out, std::vector<PrintItem> &pending) {
+  out << "(_if ";
+  push_print(pending, ")");
+  push_print(pending, else_part);
+  push_print(pending, " _else ");
+  push_print(pending, then_part);
+  push_print(pending, " _then ");
+  push_print(pending, test_part);
+}
+
+void IfExpr::serialize(ExprWriter &out) {
+  out.write_tag(IF_TAG);
+  test_part->serialize(out);
+  then_part->serialize(out);
+  else_part->serialize(out);
 }
 
 CompExpr::CompExpr(PTR(Expr) lhs, PTR(Expr) rhs) {
-  this->lhs = lhs;
-  this->rhs = rhs;
+  this->weight = add_weights(1, add_weights(lhs->weight, rhs->weight));
+  this->lhs = std::move(lhs);
+  this->rhs = std::move(rhs);
+}
+
+CompExpr::~CompExpr() {
+  destroy_iteratively(lhs);
+  destroy_iteratively(rhs);
 }
 
-bool CompExpr::equals(PTR(Expr) e) {
+bool CompExpr::equals(const PTR(Expr) &e) {
   PTR(CompExpr) ce = CAST(CompExpr)(e);
   if (ce == NULL)
     return false;
@@ -297,11 +460,14 @@ bool CompExpr::equals(PTR(Expr) e) {
     return (lhs->equals(ce->lhs) && rhs->equals(ce->rhs));
 }
 
-PTR(Val) CompExpr::interp(PTR(Env) env) {
-  return NEW(BoolVal)(lhs->interp(env)->equals(rhs->interp(env)));
+PTR(Val) CompExpr::interp(const PTR(Env) &env) {
+  NodeScope scope(COMP_NODE);
+  PTR(Val) lhs_val, rhs_val;
+  interp_operands(lhs, rhs, env, lhs_val, rhs_val);
+  return BoolVal::make(lhs_val->equals(rhs_val));
 }
 
-PTR(Expr) CompExpr::subst(std::string var, PTR(Val) new_val) {
+PTR(Expr) CompExpr::subst(Symbol var, const PTR(Val) &new_val) {
   return NEW(CompExpr)(lhs->subst(var, new_val), rhs->subst(var, new_val));
 }
 
@@ -316,16 +482,32 @@ bool CompExpr::containsVarExpr() {
   return lhs->containsVarExpr() || rhs->containsVarExpr();
 }
 
-std::string CompExpr::to_string() {
-  return "(" + lhs->to_string() + " == " + rhs->to_string() + ")";
+void CompExpr::print_node(std::ostream &out, std::vector<PrintItem> &pending) {
+  out << "(";
+  push_print(pending, ")");
+  push_print(pending, rhs);
+  push_print(pending, " == ");
+  push_print(pending, lhs);
 }
 
-FunExpr::FunExpr(std::string formal_arg, PTR(Expr) body) {
+void CompExpr::serialize(ExprWriter &out) {
+  out.write_tag(COMP_TAG);
+  lhs->serialize(out);
+  rhs->serialize(out);
+}
+
+// Making a closure is cheap; the body's cost counts at the call
+FunExpr::FunExpr(Symbol formal_arg, PTR(Expr) body) {
+  this->weight = 1;
   this->formal_arg = formal_arg;
-  this->body = body;
+  this->body = std::move(body);
+}
+
+FunExpr::~FunExpr() {
+  destroy_iteratively(body);
 }
 
-bool FunExpr::equals(PTR(Expr) e) {
+bool FunExpr::equals(const PTR(Expr) &e) {
   PTR(FunExpr) fe = CAST(FunExpr)(e);
   if (fe == NULL)
     return false;
@@ -333,11 +515,12 @@ bool FunExpr::equals(PTR(Expr) e) {
     return (formal_arg == fe->formal_arg && body->equals(fe->body));
 }
 
-PTR(Val) FunExpr::interp(PTR(Env) env) {
+PTR(Val) FunExpr::interp(const PTR(Env) &env) {
+  NodeScope scope(FUN_NODE);
   return NEW(FunVal)(formal_arg, body, env);
 }
 
-PTR(Expr) FunExpr::subst(std::string var, PTR(Val) new_val) {
+PTR(Expr) FunExpr::subst(Symbol var, const PTR(Val) &new_val) {
   if( var == formal_arg) {
     return NEW(FunExpr)(formal_arg, body);
   }
@@ -353,16 +536,33 @@ bool FunExpr::containsVarExpr() {
   return true;
 }
 
-std::string FunExpr::to_string() {
-  return "(_fun (" + formal_arg + ") " + body->to_string() + ")";
+void FunExpr::print_node(std::ostream &out, std::vector<PrintItem> &pending) {
+  out << "(_fun (" << formal_arg << ") ";
+  push_print(pending, ")");
+  push_print(pending, body);
+}
+
+void FunExpr::serialize(ExprWriter &out) {
+  out.write_tag(FUN_TAG);
+  out.write_name(formal_arg);
+  body->serialize(out);
 }
 
 CallExpr::CallExpr(PTR(Expr) to_be_called, PTR(Expr) actual_arg) {
-  this->to_be_called = to_be_called;
-  this->actual_arg = actual_arg;
+  this->weight = add_weights(CALL_WEIGHT, add_weights(to_be_called->weight, actual_arg->weight));
+  this->to_be_called = std::move(to_be_called);
+  this->actual_arg = std::move(actual_arg);
+  this->ic_body = nullptr;
+  this->ic_hits = 0;
+  this->ic_misses = 0;
+}
+
+CallExpr::~CallExpr() {
+  destroy_iteratively(to_be_called);
+  destroy_iteratively(actual_arg);
 }
 
-bool CallExpr::equals(PTR(Expr) e) {
+bool CallExpr::equals(const PTR(Expr) &e) {
   PTR(CallExpr) ce = CAST(CallExpr)(e);
   if (ce == NULL)
     return false;
@@ -370,11 +570,33 @@ bool CallExpr::equals(PTR(Expr) e) {
     return (to_be_called->equals(ce->to_be_called) && actual_arg->equals(ce->actual_arg));
 }
 
-PTR(Val) CallExpr::interp(PTR(Env) env) {
-  return to_be_called->interp(env)->call(actual_arg->interp(env));
+PTR(Val) CallExpr::interp(const PTR(Env) &env) {
+  NodeScope scope(CALL_NODE);
+  charge_step();
+  PTR(Val) callee = to_be_called->interp(env);
+  PTR(Val) arg = actual_arg->interp(env);
+  
+  // a hit costs a comparison of the callee's dynamic type, with no
+  // cast or virtual call
+  Val *val = callee.get();
+  if (typeid(*val) == typeid(FunVal)) {
+    FunVal *fun = static_cast<FunVal *>(val);
+    Expr *body = fun->body.get();
+    Symbol formal_arg = ic_formal.load(std::memory_order_relaxed);
+    if (body == ic_body.load(std::memory_order_relaxed) && fun->formal_arg == formal_arg) {
+      ic_hits.fetch_add(1, std::memory_order_relaxed);
+      FunctionScope function(body);
+      return body->interp(NEW(ExtendedEnv)(formal_arg, std::move(arg), fun->env));
+    }
+    ic_body.store(body, std::memory_order_relaxed);
+    ic_formal.store(fun->formal_arg, std::memory_order_relaxed);
+  }
+  
+  ic_misses.fetch_add(1, std::memory_order_relaxed);
+  return callee->call(std::move(arg));
 }
 
-PTR(Expr) CallExpr::subst(std::string var, PTR(Val) new_val) {
+PTR(Expr) CallExpr::subst(Symbol var, const PTR(Val) &new_val) {
   return NEW(CallExpr)(to_be_called->subst(var, new_val), actual_arg->subst(var, new_val));
 }
 
@@ -386,8 +608,17 @@ bool CallExpr::containsVarExpr() {
   return true;
 }
 
-std::string CallExpr::to_string() {
-  return to_be_called->to_string() + " (" + actual_arg->to_string() + ")";
+void CallExpr::print_node(std::ostream &out, std::vector<PrintItem> &pending) {
+  push_print(pending, ")");
+  push_print(pending, actual_arg);
+  push_print(pending, " (");
+  push_print(pending, to_be_called);
+}
+
+void CallExpr::serialize(ExprWriter &out) {
+  out.write_tag(CALL_TAG);
+  to_be_called->serialize(out);
+  actual_arg->serialize(out);
 }
 
 TEST_CASE( "NumExpr" ) {
@@ -829,9 +1060,94 @@ TEST_CASE( "CallExpr" ) {
           == "(_fun (x) (x + 3)) (5)" );
   }
   
+  SECTION( "inline cache" ) {
+    PTR(Expr) f = NEW(FunExpr)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(1)));
+    PTR(Env) env = NEW(ExtendedEnv)("f", f->interp(NEW(EmptyEnv)()), NEW(EmptyEnv)());
+    PTR(CallExpr) call = NEW(CallExpr)(NEW(VarExpr)("f"), NEW(NumExpr)(4));
+    CHECK( call->interp(env)->equals(NEW(NumVal)(5)) );
+    CHECK( call->interp(env)->equals(NEW(NumVal)(5)) );
+    CHECK( call->interp(env)->equals(NEW(NumVal)(5)) );
+    CHECK( call->ic_misses == 1 );
+    CHECK( call->ic_hits == 2 );
+    
+    // a different closure at the same site replaces the cached one
+    PTR(Env) env2 = NEW(ExtendedEnv)("f", NEW(FunExpr)("y", NEW(NumExpr)(7))->interp(NEW(EmptyEnv)()), NEW(EmptyEnv)());
+    CHECK( call->interp(env2)->equals(NEW(NumVal)(7)) );
+    CHECK( call->interp(env)->equals(NEW(NumVal)(5)) );
+    CHECK( call->ic_misses == 3 );
+    CHECK( call->ic_hits == 2 );
+    
+    // closures of one function share the entry, each with its own env
+    PTR(Expr) adder = NEW(FunExpr)("x", NEW(FunExpr)("y", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("y"))));
+    PTR(Val) add_one = NEW(CallExpr)(adder, NEW(NumExpr)(1))->interp(NEW(EmptyEnv)());
+    PTR(Val) add_two = NEW(CallExpr)(adder, NEW(NumExpr)(2))->interp(NEW(EmptyEnv)());
+    PTR(CallExpr) add_call = NEW(CallExpr)(NEW(VarExpr)("g"), NEW(NumExpr)(4));
+    CHECK( add_call->interp(NEW(ExtendedEnv)("g", add_one, NEW(EmptyEnv)()))->equals(NEW(NumVal)(5)) );
+    CHECK( add_call->interp(NEW(ExtendedEnv)("g", add_two, NEW(EmptyEnv)()))->equals(NEW(NumVal)(6)) );
+    CHECK( add_call->ic_misses == 1 );
+    CHECK( add_call->ic_hits == 1 );
+    // and the site keeps neither closure alive
+    CHECK( add_one.use_count() == 1 );
+    CHECK( add_two.use_count() == 1 );
+    
+    PTR(CallExpr) bad_call = NEW(CallExpr)(NEW(NumExpr)(1), NEW(NumExpr)(2));
+    CHECK_THROWS_WITH( bad_call->interp(NEW(EmptyEnv)()), "can't use call on numval" );
+    CHECK_THROWS_WITH( bad_call->interp(NEW(EmptyEnv)()), "can't use call on numval" );
+    CHECK( bad_call->ic_hits == 0 );
+  }
+  
   SECTION( "test macros conversion" ) {
     PTR(Expr) add_e = NEW(AddExpr) (NEW(VarExpr)("x"), NEW(NumExpr)(5));
     PTR(Val) three_v = NEW(NumVal)(3);
     CHECK( add_e->subst("x", three_v)->to_string() == "(3 + 5)");
   }
 }
+
+TEST_CASE( "print" ) {
+  SECTION( "matches to_string" ) {
+    PTR(Expr) e = NEW(LetExpr)("f", NEW(FunExpr)("x", NEW(IfExpr)(NEW(CompExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(0)),
+                                                                 NEW(BoolExpr)(true),
+                                                                 NEW(MultExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(-2)))),
+                               NEW(CallExpr)(NEW(VarExpr)("f"), NEW(AddExpr)(NEW(NumExpr)(1), NEW(BoolExpr)(false))));
+    std::ostringstream out;
+    e->print(out);
+    CHECK( out.str() == "(_let f = (_fun (x) (_if (x == 0) _then _true _else (x * -2))) _in f ((1 + _false)))" );
+    CHECK( e->to_string() == out.str() );
+  }
+  
+  SECTION( "deep trees" ) {
+    // deep enough that printing recursively would overflow the stack
+    const int DEPTH = 1000000;
+    PTR(Expr) left = NEW(NumExpr)(0);
+    PTR(Expr) right = NEW(NumExpr)(0);
+    for (int i = 0; i < DEPTH; i++) {
+      left = NEW(AddExpr)(left, NEW(NumExpr)(1));
+      right = NEW(FunExpr)("x", right);
+    }
+    std::string left_text = left->to_string();
+    CHECK( left_text.size() == DEPTH * 6 + 1 );
+    CHECK( left_text.substr(DEPTH - 1, 12) == "(0 + 1) + 1)" );
+    std::string right_text = right->to_string();
+    CHECK( right_text.size() == DEPTH * 11 + 1 );
+    CHECK( right_text.substr(0, 20) == "(_fun (x) (_fun (x) " );
+  }
+}
+
+TEST_CASE( "refcount traffic", "[.][bench]" ) {
+  std::istringstream in("_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1"
+                        " _else fib(fib)(x + -2) + fib(fib)(x + -1) _in fib(fib)(22)");
+  PTR(Expr) e = parse(in);
+  e->interp(NEW(EmptyEnv)());
+
+#ifdef MSD_COUNT_REFS
+  unsigned long ops = ref_count_ops;
+#endif
+  auto start = std::chrono::steady_clock::now();
+  e->interp(NEW(EmptyEnv)());
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+#ifdef MSD_COUNT_REFS
+  WARN( "fib(22): " << ref_count_ops - ops << " refcount updates, " << ms << " ms" );
+#else
+  WARN( "fib(22): " << ms << " ms (build with MSD_COUNT_REFS to count refcount updates)" );
+#endif
+}
@@ -9,32 +9,61 @@
 #ifndef expr_hpp
 #define expr_hpp
 
+#include <atomic>
+#include <ostream>
 #include <string>
+#include <vector>
 #include "pointer.hpp"
+#include "symbol.hpp"
 
 /*
  * Objects to be returned by the parser
  * */
 class Val;
 class Env;
+class BigInt;
+class ExprWriter;
+class Expr;
+
+// A piece of `Expr::print` output still to be written: an expression,
+// or literal text when `expr` is null
+struct PrintItem {
+  Expr *expr;
+  const char *text;
+};
 
 class Expr {
 public:
-  virtual bool equals(PTR(Expr) e) = 0;
+  // Rough cost of evaluating this expression: its node count, with
+  // each call counted as `CALL_WEIGHT` nodes. Set by every constructor.
+  unsigned weight;
+  static const unsigned CALL_WEIGHT = 1000;
+  
+  virtual bool equals(const PTR(Expr) &e) = 0;
   
   // To compute the number value of an expression,
   // assuming that all variables are 0
-  virtual PTR(Val) interp(PTR(Env) env) = 0;
+  virtual PTR(Val) interp(const PTR(Env) &env) = 0;
   
   // To substitute a number in place of a variable
-  virtual PTR(Expr) subst(std::string var, PTR(Val) val) = 0;
+  virtual PTR(Expr) subst(Symbol var, const PTR(Val) &val) = 0;
   
   virtual PTR(Expr) optimize() = 0;
   
   // return true or false if PTR(Expr)  has a variable
   virtual bool containsVarExpr() = 0;
   
-  virtual std::string to_string() = 0;
+  // Writes the expression to `out` in one pass. Pending pieces are kept
+  // on an explicit stack, so deep trees don't deepen the call stack.
+  void print(std::ostream &out);
+  std::string to_string();
+  
+  // Writes the start of this node and pushes the rest (children and
+  // text) onto `pending`, last piece first
+  virtual void print_node(std::ostream &out, std::vector<PrintItem> &pending) = 0;
+  
+  // Appends the compiled form of this expression (see serialize.hpp)
+  virtual void serialize(ExprWriter &out) = 0;
 };
 
 class NumExpr : public Expr {
@@ -43,14 +72,16 @@ public:
   PTR(Val) val;
   
   NumExpr(int rep);
-  bool equals(PTR(Expr) e);
+  NumExpr(const BigInt &big);
+  bool equals(const PTR(Expr) &e);
   
-  PTR(Val) interp(PTR(Env) env);
-  PTR(Expr) subst(std::string var, PTR(Val) val);
+  PTR(Val) interp(const PTR(Env) &env);
+  PTR(Expr) subst(Symbol var, const PTR(Val) &val);
   PTR(Expr) optimize();
   
   bool containsVarExpr();
-  std::string to_string();
+  void print_node(std::ostream &out, std::vector<PrintItem> &pending);
+  void serialize(ExprWriter &out);
 };
 
 class AddExpr : public Expr {
@@ -59,14 +90,16 @@ public:
   PTR(Expr) rhs;
   
   AddExpr(PTR(Expr) lhs, PTR(Expr) rhs);
-  bool equals(PTR(Expr) e);
+  ~AddExpr();
+  bool equals(const PTR(Expr) &e);
   
-  PTR(Val) interp(PTR(Env) env);
-  PTR(Expr) subst(std::string var, PTR(Val) val);
+  PTR(Val) interp(const PTR(Env) &env);
+  PTR(Expr) subst(Symbol var, const PTR(Val) &val);
   PTR(Expr) optimize();
   
   bool containsVarExpr();
-  std::string to_string();
+  void print_node(std::ostream &out, std::vector<PrintItem> &pending);
+  void serialize(ExprWriter &out);
 };
 
 class MultExpr : public Expr {
@@ -75,46 +108,51 @@ public:
   PTR(Expr) rhs;
   
   MultExpr(PTR(Expr) lhs, PTR(Expr) rhs);
-  bool equals(PTR(Expr) e);
+  ~MultExpr();
+  bool equals(const PTR(Expr) &e);
   
-  PTR(Val) interp(PTR(Env) env);
-  PTR(Expr) subst(std::string var, PTR(Val) val);
+  PTR(Val) interp(const PTR(Env) &env);
+  PTR(Expr) subst(Symbol var, const PTR(Val) &val);
   PTR(Expr) optimize();
   
   bool containsVarExpr();
-  std::string to_string();
+  void print_node(std::ostream &out, std::vector<PrintItem> &pending);
+  void serialize(ExprWriter &out);
 };
 
 class VarExpr : public Expr {
 public:
-  std::string name;
+  Symbol name;
   
-  VarExpr(std::string name);
-  bool equals(PTR(Expr) e);
+  VarExpr(Symbol name);
+  bool equals(const PTR(Expr) &e);
   
-  PTR(Val) interp(PTR(Env) env);
-  PTR(Expr) subst(std::string var, PTR(Val) val);
+  PTR(Val) interp(const PTR(Env) &env);
+  PTR(Expr) subst(Symbol var, const PTR(Val) &val);
   PTR(Expr) optimize();
   
   bool containsVarExpr();
-  std::string to_string();
+  void print_node(std::ostream &out, std::vector<PrintItem> &pending);
+  void serialize(ExprWriter &out);
 };
 
 class LetExpr : public Expr {
 public:
-  std::string name;
+  Symbol name;
   PTR(Expr) rhs;
   PTR(Expr) body;
   
-  LetExpr(std::string name, PTR(Expr) rhs, PTR(Expr) body);
-  bool equals(PTR(Expr) e);
+  LetExpr(Symbol name, PTR(Expr) rhs, PTR(Expr) body);
+  ~LetExpr();
+  bool equals(const PTR(Expr) &e);
   
-  PTR(Val) interp(PTR(Env) env);
-  PTR(Expr) subst(std::string var, PTR(Val) val);
+  PTR(Val) interp(const PTR(Env) &env);
+  PTR(Expr) subst(Symbol var, const PTR(Val) &val);
   PTR(Expr) optimize();
   
   bool containsVarExpr();
-  std::string to_string();
+  void print_node(std::ostream &out, std::vector<PrintItem> &pending);
+  void serialize(ExprWriter &out);
 };
 
 class BoolExpr : public Expr {
@@ -122,14 +160,15 @@ public:
   bool rep;
   
   BoolExpr(bool rep);
-  bool equals(PTR(Expr) e);
+  bool equals(const PTR(Expr) &e);
   
-  PTR(Val) interp(PTR(Env) env);
-  PTR(Expr) subst(std::string var, PTR(Val) val);
+  PTR(Val) interp(const PTR(Env) &env);
+  PTR(Expr) subst(Symbol var, const PTR(Val) &val);
   PTR(Expr) optimize();
   
   bool containsVarExpr();
-  std::string to_string();
+  void print_node(std::ostream &out, std::vector<PrintItem> &pending);
+  void serialize(ExprWriter &out);
 };
 
 class IfExpr : public Expr {
@@ -139,14 +178,16 @@ public:
   PTR(Expr) else_part;
   
   IfExpr(PTR(Expr) test_part, PTR(Expr) then_part, PTR(Expr) else_part);
-  bool equals(PTR(Expr) e);
+  ~IfExpr();
+  bool equals(const PTR(Expr) &e);
   
-  PTR(Val) interp(PTR(Env) env);
-  PTR(Expr) subst(std::string var, PTR(Val) val);
+  PTR(Val) interp(const PTR(Env) &env);
+  PTR(Expr) subst(Symbol var, const PTR(Val) &val);
   PTR(Expr) optimize();
   
   bool containsVarExpr();
-  std::string to_string();
+  void print_node(std::ostream &out, std::vector<PrintItem> &pending);
+  void serialize(ExprWriter &out);
 };
 
 class CompExpr : public Expr {
@@ -155,30 +196,34 @@ public:
   PTR(Expr) rhs;
   
   CompExpr(PTR(Expr) lhs, PTR(Expr) rhs);
-  bool equals(PTR(Expr) e);
+  ~CompExpr();
+  bool equals(const PTR(Expr) &e);
   
-  PTR(Val) interp(PTR(Env) env);
-  PTR(Expr) subst(std::string var, PTR(Val) val);
+  PTR(Val) interp(const PTR(Env) &env);
+  PTR(Expr) subst(Symbol var, const PTR(Val) &val);
   PTR(Expr) optimize();
   
   bool containsVarExpr();
-  std::string to_string();
+  void print_node(std::ostream &out, std::vector<PrintItem> &pending);
+  void serialize(ExprWriter &out);
 };
 
 class FunExpr : public Expr {
 public:
-  std::string formal_arg;
+  Symbol formal_arg;
   PTR(Expr) body;
   
-  FunExpr(std::string formal_arg, PTR(Expr) body);
-  bool equals(PTR(Expr) e);
+  FunExpr(Symbol formal_arg, PTR(Expr) body);
+  ~FunExpr();
+  bool equals(const PTR(Expr) &e);
   
-  PTR(Val) interp(PTR(Env) env);
-  PTR(Expr) subst(std::string var, PTR(Val) val);
+  PTR(Val) interp(const PTR(Env) &env);
+  PTR(Expr) subst(Symbol var, const PTR(Val) &val);
   PTR(Expr) optimize();
   
   bool containsVarExpr();
-  std::string to_string();
+  void print_node(std::ostream &out, std::vector<PrintItem> &pending);
+  void serialize(ExprWriter &out);
 };
 
 class CallExpr : public Expr {
@@ -186,15 +231,27 @@ public:
   PTR(Expr) to_be_called;
   PTR(Expr) actual_arg;
   
+  // Monomorphic inline cache: the body and parameter of the last
+  // function called from this site, so a call to any closure of the
+  // same function skips the `Val::call` dispatch. It keeps no
+  // reference to the closure. Several threads may evaluate one tree,
+  // so the fields are relaxed atomics; a torn update only costs a miss.
+  std::atomic<Expr *> ic_body;
+  std::atomic<Symbol> ic_formal;
+  std::atomic<unsigned long> ic_hits;
+  std::atomic<unsigned long> ic_misses;
+  
   CallExpr(PTR(Expr) lhs, PTR(Expr) rhs);
-  bool equals(PTR(Expr) e);
+  ~CallExpr();
+  bool equals(const PTR(Expr) &e);
   
-  PTR(Val) interp(PTR(Env) env);
-  PTR(Expr) subst(std::string var, PTR(Val) val);
+  PTR(Val) interp(const PTR(Env) &env);
+  PTR(Expr) subst(Symbol var, const PTR(Val) &val);
   PTR(Expr) optimize();
   
   bool containsVarExpr();
-  std::string to_string();
+  void print_node(std::ostream &out, std::vector<PrintItem> &pending);
+  void serialize(ExprWriter &out);
 };
 
 #endif /* expr_hpp */
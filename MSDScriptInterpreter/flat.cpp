@@ -0,0 +1,691 @@
+//
+//  flat.cpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 5/15/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include <climits>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <unistd.h>
+#include "flat.hpp"
+#include "catch.hpp"
+#include "expr.hpp"
+#include "env.hpp"
+#include "parse.hpp"
+#include "bigint.hpp"
+#include "budget.hpp"
+#include "serialize.hpp"
+#include "reclaim.hpp"
+#include "trace.hpp"
+
+// The kind of `e`, with its children left to right in `kids`
+static NodeKind expr_kind(Expr *e, Expr *kids[3], int &count) {
+  count = 0;
+  if (dynamic_cast<NumExpr *>(e) != nullptr)
+    return NUM_NODE;
+  if (dynamic_cast<BoolExpr *>(e) != nullptr)
+    return BOOL_NODE;
+  if (dynamic_cast<VarExpr *>(e) != nullptr)
+    return VAR_NODE;
+  if (AddExpr *a = dynamic_cast<AddExpr *>(e)) {
+    kids[count++] = &*a->lhs;
+    kids[count++] = &*a->rhs;
+    return ADD_NODE;
+  }
+  if (MultExpr *m = dynamic_cast<MultExpr *>(e)) {
+    kids[count++] = &*m->lhs;
+    kids[count++] = &*m->rhs;
+    return MULT_NODE;
+  }
+  if (CompExpr *c = dynamic_cast<CompExpr *>(e)) {
+    kids[count++] = &*c->lhs;
+    kids[count++] = &*c->rhs;
+    return COMP_NODE;
+  }
+  if (LetExpr *l = dynamic_cast<LetExpr *>(e)) {
+    kids[count++] = &*l->rhs;
+    kids[count++] = &*l->body;
+    return LET_NODE;
+  }
+  if (IfExpr *i = dynamic_cast<IfExpr *>(e)) {
+    kids[count++] = &*i->test_part;
+    kids[count++] = &*i->then_part;
+    kids[count++] = &*i->else_part;
+    return IF_NODE;
+  }
+  if (FunExpr *f = dynamic_cast<FunExpr *>(e)) {
+    kids[count++] = &*f->body;
+    return FUN_NODE;
+  }
+  if (CallExpr *c = dynamic_cast<CallExpr *>(e)) {
+    kids[count++] = &*c->to_be_called;
+    kids[count++] = &*c->actual_arg;
+    return CALL_NODE;
+  }
+  throw std::runtime_error("unknown expression");
+}
+
+// The children of `node`, left to right
+static int node_children(const FlatNode &node, uint32_t kids[3]) {
+  switch (node.kind) {
+    case ADD_NODE:
+    case MULT_NODE:
+    case COMP_NODE:
+    case CALL_NODE:
+      kids[0] = node.a;
+      kids[1] = node.b;
+      return 2;
+    case LET_NODE:
+      kids[0] = node.b;
+      kids[1] = node.c;
+      return 2;
+    case IF_NODE:
+      kids[0] = node.a;
+      kids[1] = node.b;
+      kids[2] = node.c;
+      return 3;
+    case FUN_NODE:
+      kids[0] = node.b;
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+PTR(FlatAst) FlatAst::from_expr(const PTR(Expr) &e) {
+  PTR(FlatAst) program = NEW(FlatAst)();
+  std::unordered_map<Symbol, uint32_t> name_index;
+  auto name = [&](Symbol name) {
+    auto found = name_index.find(name);
+    if (found != name_index.end())
+      return found->second;
+    uint32_t index = (uint32_t)program->names.size();
+    program->names.push_back(name);
+    name_index[name] = index;
+    return index;
+  };
+
+  // nodes whose children are still being added, innermost last
+  struct Frame {
+    Expr *e;
+    NodeKind kind;
+    int count;
+    int done;
+    Expr *kids[3];
+    uint32_t index[3];
+  };
+  std::vector<Frame> stack;
+  auto push = [&](Expr *e) {
+    Frame frame = {e, NUM_NODE, 0, 0, {nullptr, nullptr, nullptr}, {0, 0, 0}};
+    frame.kind = expr_kind(e, frame.kids, frame.count);
+    stack.push_back(frame);
+  };
+
+  push(&*e);
+  while (!stack.empty()) {
+    Frame &top = stack.back();
+    if (top.done < top.count) {
+      push(top.kids[top.done]);
+      continue;
+    }
+    if (program->nodes.size() >= UINT32_MAX)
+      throw std::runtime_error("program too large for the flat form");
+
+    FlatNode node = {(uint32_t)top.kind, top.index[0], top.index[1], top.index[2]};
+    switch (top.kind) {
+      case NUM_NODE:
+        node.a = (uint32_t)program->literals.size();
+        program->literals.push_back(static_cast<NumExpr *>(top.e)->val);
+        break;
+      case BOOL_NODE:
+        node.a = static_cast<BoolExpr *>(top.e)->rep;
+        break;
+      case VAR_NODE:
+        node.a = name(static_cast<VarExpr *>(top.e)->name);
+        break;
+      case LET_NODE:
+        node = {LET_NODE, name(static_cast<LetExpr *>(top.e)->name), top.index[0], top.index[1]};
+        break;
+      case FUN_NODE:
+        node = {FUN_NODE, name(static_cast<FunExpr *>(top.e)->formal_arg), top.index[0], 0};
+        break;
+      default:
+        break;
+    }
+    uint32_t index = (uint32_t)program->nodes.size();
+    program->nodes.push_back(node);
+    stack.pop_back();
+    if (!stack.empty()) {
+      Frame &parent = stack.back();
+      parent.index[parent.done++] = index;
+    }
+  }
+  program->root = (uint32_t)program->nodes.size() - 1;
+  return program;
+}
+
+PTR(Expr) FlatAst::to_expr() {
+  return to_expr(root);
+}
+
+PTR(Expr) FlatAst::to_expr(uint32_t index) {
+  // a node is visited once to queue its children, then again to build
+  // it from theirs, which are the last ones built
+  std::vector<std::pair<uint32_t, bool>> work;
+  std::vector<PTR(Expr)> built;
+  work.push_back(std::make_pair(index, false));
+  while (!work.empty()) {
+    std::pair<uint32_t, bool> item = work.back();
+    work.pop_back();
+    const FlatNode &node = nodes[item.first];
+    uint32_t kids[3];
+    int count = node_children(node, kids);
+    if (!item.second) {
+      work.push_back(std::make_pair(item.first, true));
+      for (int i = count - 1; i >= 0; i--)
+        work.push_back(std::make_pair(kids[i], false));
+      continue;
+    }
+
+    PTR(Expr) c[3];
+    for (int i = count - 1; i >= 0; i--) {
+      c[i] = std::move(built.back());
+      built.pop_back();
+    }
+    switch (node.kind) {
+      case NUM_NODE:
+        built.push_back(literals[node.a]->to_expr());
+        break;
+      case BOOL_NODE:
+        built.push_back(NEW(BoolExpr)(node.a != 0));
+        break;
+      case VAR_NODE:
+        built.push_back(NEW(VarExpr)(names[node.a]));
+        break;
+      case ADD_NODE:
+        built.push_back(NEW(AddExpr)(c[0], c[1]));
+        break;
+      case MULT_NODE:
+        built.push_back(NEW(MultExpr)(c[0], c[1]));
+        break;
+      case COMP_NODE:
+        built.push_back(NEW(CompExpr)(c[0], c[1]));
+        break;
+      case LET_NODE:
+        built.push_back(NEW(LetExpr)(names[node.a], c[0], c[1]));
+        break;
+      case IF_NODE:
+        built.push_back(NEW(IfExpr)(c[0], c[1], c[2]));
+        break;
+      case FUN_NODE:
+        built.push_back(NEW(FunExpr)(names[node.a], c[0]));
+        break;
+      case CALL_NODE:
+        built.push_back(NEW(CallExpr)(c[0], c[1]));
+        break;
+      default:
+        throw std::runtime_error("bad node kind");
+    }
+  }
+  return built.back();
+}
+
+PTR(Val) FlatAst::interp(const PTR(Env) &env) {
+  return interp(root, env);
+}
+
+PTR(Val) FlatAst::interp(uint32_t index, const PTR(Env) &env) {
+  const FlatNode &node = nodes[index];
+  NodeScope scope((NodeKind)node.kind);
+  switch (node.kind) {
+    case NUM_NODE:
+      return literals[node.a];
+    case BOOL_NODE:
+      return BoolVal::make(node.a != 0);
+    case VAR_NODE:
+      return env->lookup(names[node.a]);
+    case ADD_NODE: {
+      PTR(Val) lhs_val = interp(node.a, env);
+      return lhs_val->add_to(interp(node.b, env));
+    }
+    case MULT_NODE: {
+      PTR(Val) lhs_val = interp(node.a, env);
+      return lhs_val->mult_with(interp(node.b, env));
+    }
+    case COMP_NODE: {
+      PTR(Val) lhs_val = interp(node.a, env);
+      return BoolVal::make(lhs_val->equals(interp(node.b, env)));
+    }
+    case LET_NODE: {
+      PTR(Val) rhs_val = interp(node.b, env);
+      return interp(node.c, NEW(ExtendedEnv)(names[node.a], std::move(rhs_val), env));
+    }
+    case IF_NODE:
+      if (interp(node.a, env)->is_true())
+        return interp(node.b, env);
+      else
+        return interp(node.c, env);
+    case FUN_NODE:
+      return NEW(FlatFunVal)(shared_from_this(), index, env);
+    case CALL_NODE: {
+      charge_step();
+      PTR(Val) callee = interp(node.a, env);
+      return callee->call(interp(node.b, env));
+    }
+    default:
+      throw std::runtime_error("bad node kind");
+  }
+}
+
+void FlatAst::print(std::ostream &out, uint32_t index) {
+  // a node, or literal text when `text` is set
+  struct Item {
+    uint32_t index;
+    const char *text;
+  };
+  std::vector<Item> pending;
+  pending.push_back(Item{index, nullptr});
+  while (!pending.empty()) {
+    Item item = pending.back();
+    pending.pop_back();
+    if (item.text != nullptr) {
+      out << item.text;
+      continue;
+    }
+    const FlatNode &node = nodes[item.index];
+    // the rest of the node is pushed last piece first
+    const char *infix = nullptr;
+    switch (node.kind) {
+      case NUM_NODE:
+        literals[node.a]->print(out);
+        break;
+      case BOOL_NODE:
+        out << (node.a != 0 ? "_true" : "_false");
+        break;
+      case VAR_NODE:
+        out << names[node.a];
+        break;
+      case ADD_NODE:
+        infix = " + ";
+        break;
+      case MULT_NODE:
+        infix = " * ";
+        break;
+      case COMP_NODE:
+        infix = " == ";
+        break;
+      case LET_NODE:
+        out << "(_let " << names[node.a] << " = ";
+        pending.push_back(Item{0, ")"});
+        pending.push_back(Item{node.c, nullptr});
+        pending.push_back(Item{0, " _in "});
+        pending.push_back(Item{node.b, nullptr});
+        break;
+      case IF_NODE:
+        out << "(_if ";
+        pending.push_back(Item{0, ")"});
+        pending.push_back(Item{node.c, nullptr});
+        pending.push_back(Item{0, " _else "});
+        pending.push_back(Item{node.b, nullptr});
+        pending.push_back(Item{0, " _then "});
+        pending.push_back(Item{node.a, nullptr});
+        break;
+      case FUN_NODE:
+        out << "(_fun (" << names[node.a] << ") ";
+        pending.push_back(Item{0, ")"});
+        pending.push_back(Item{node.b, nullptr});
+        break;
+      case CALL_NODE:
+        pending.push_back(Item{0, ")"});
+        pending.push_back(Item{node.b, nullptr});
+        pending.push_back(Item{0, " ("});
+        pending.push_back(Item{node.a, nullptr});
+        break;
+      default:
+        throw std::runtime_error("bad node kind");
+    }
+    if (infix != nullptr) {
+      out << "(";
+      pending.push_back(Item{0, ")"});
+      pending.push_back(Item{node.b, nullptr});
+      pending.push_back(Item{0, infix});
+      pending.push_back(Item{node.a, nullptr});
+    }
+  }
+}
+
+std::string FlatAst::to_string() {
+  std::ostringstream out;
+  print(out, root);
+  return out.str();
+}
+
+std::string FlatAst::serialize() {
+  std::string out(FLAT_MAGIC, sizeof(FLAT_MAGIC));
+  out += (char)FLAT_VERSION;
+  append_varint(out, names.size());
+  for (Symbol name : names) {
+    append_varint(out, name.str().size());
+    out += name.str();
+  }
+  // each literal is 0 and an `int`, or 1 and a big number's sign and limbs
+  append_varint(out, literals.size());
+  for (const PTR(Val) &literal : literals) {
+    NumVal *n = static_cast<NumVal *>(literal.get());
+    if (n->big == nullptr) {
+      append_varint(out, 0);
+      append_int(out, n->rep);
+    } else {
+      append_varint(out, 1);
+      append_big(out, *n->big);
+    }
+  }
+  append_varint(out, nodes.size());
+  append_varint(out, root);
+  out.append((const char *)nodes.data(), nodes.size() * sizeof(FlatNode));
+  return out;
+}
+
+// Whether node `index` refers only to earlier nodes and to entries
+// that exist, so that evaluation can't go out of bounds or loop
+static bool valid_node(const FlatAst &program, uint32_t index) {
+  const FlatNode &node = program.nodes[index];
+  switch (node.kind) {
+    case NUM_NODE:
+      return node.a < program.literals.size();
+    case BOOL_NODE:
+      return node.a <= 1;
+    case VAR_NODE:
+      return node.a < program.names.size();
+    case ADD_NODE:
+    case MULT_NODE:
+    case COMP_NODE:
+    case CALL_NODE:
+      return node.a < index && node.b < index;
+    case LET_NODE:
+      return node.a < program.names.size() && node.b < index && node.c < index;
+    case IF_NODE:
+      return node.a < index && node.b < index && node.c < index;
+    case FUN_NODE:
+      return node.a < program.names.size() && node.b < index;
+    default:
+      return false;
+  }
+}
+
+PTR(FlatAst) FlatAst::deserialize(const char *data, size_t size) {
+  AllocPhaseScope phase(ALLOC_PARSE);
+  TraceSpan span("load");
+  if (size < sizeof(FLAT_MAGIC) + 1 || memcmp(data, FLAT_MAGIC, sizeof(FLAT_MAGIC)) != 0)
+    throw std::runtime_error("not a flat program");
+  ByteReader in(data + sizeof(FLAT_MAGIC), size - sizeof(FLAT_MAGIC));
+  if (*in.read_bytes(1) != FLAT_VERSION)
+    throw std::runtime_error("unsupported flat program version");
+
+  PTR(FlatAst) program = NEW(FlatAst)();
+  uint64_t count = in.read_varint();
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t length = in.read_varint();
+    program->names.push_back(Symbol(std::string((const char *)in.read_bytes(length), length)));
+  }
+
+  count = in.read_varint();
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t big = in.read_varint();
+    if (big == 0) {
+      long long n = in.read_int();
+      if (n < INT_MIN || n > INT_MAX)
+        ByteReader::bad();
+      program->literals.push_back(NumVal::make((int)n));
+    } else if (big == 1) {
+      program->literals.push_back(NEW(NumVal)(in.read_big()));
+    } else {
+      ByteReader::bad();
+    }
+  }
+
+  count = in.read_varint();
+  uint64_t root = in.read_varint();
+  if (count == 0 || count > size / sizeof(FlatNode) || root >= count)
+    ByteReader::bad();
+  const unsigned char *bytes = in.read_bytes(count * sizeof(FlatNode));
+  if (!in.at_end())
+    ByteReader::bad();
+  program->nodes.resize(count);
+  memcpy(program->nodes.data(), bytes, count * sizeof(FlatNode));
+  program->root = (uint32_t)root;
+  for (uint32_t i = 0; i < count; i++) {
+    if (!valid_node(*program, i))
+      ByteReader::bad();
+  }
+  return program;
+}
+
+bool is_flat_file(const std::string &path) {
+  return file_has_magic(path, FLAT_MAGIC);
+}
+
+PTR(FlatAst) load_flat(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in)
+    throw std::runtime_error("cannot open " + path);
+  std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  return FlatAst::deserialize(data.data(), data.size());
+}
+
+FlatFunVal::FlatFunVal(PTR(FlatAst) program, uint32_t fun, PTR(Env) env) {
+  this->program = std::move(program);
+  this->fun = fun;
+  this->env = std::move(env);
+}
+
+FlatFunVal::~FlatFunVal() {
+  destroy_iteratively(env);
+}
+
+bool FlatFunVal::equals(const PTR(Val) &other_val) {
+  PTR(FlatFunVal) other_fun_val = CAST(FlatFunVal)(other_val);
+  if (other_fun_val == nullptr)
+    return false;
+  else
+    return to_expr()->equals(other_fun_val->to_expr());
+}
+
+PTR(Val) FlatFunVal::add_to(const PTR(Val) &other_val) {
+  throw std::runtime_error("no adding functions");
+}
+
+PTR(Val) FlatFunVal::mult_with(const PTR(Val) &other_val) {
+  throw std::runtime_error("no multiplying functions");
+}
+
+PTR(Expr) FlatFunVal::to_expr() {
+  return program->to_expr(fun);
+}
+
+void FlatFunVal::print(std::ostream &out) {
+  program->print(out, fun);
+}
+
+bool FlatFunVal::is_true() {
+  throw std::runtime_error("can't make funval a bool");
+}
+
+PTR(Val) FlatFunVal::call(PTR(Val) actual_arg) {
+  const FlatNode &node = program->nodes[fun];
+  return program->interp(node.b, NEW(ExtendedEnv)(program->names[node.a], std::move(actual_arg), env));
+}
+
+static PTR(Expr) parse_str(const std::string &source) {
+  std::istringstream in(source);
+  return parse(in);
+}
+
+// The result of evaluating, or the error it throws
+template <typename F>
+static std::string result_or_error(F interp) {
+  try {
+    return interp()->to_string();
+  } catch (std::runtime_error &err) {
+    return err.what();
+  }
+}
+
+TEST_CASE( "flat AST" ) {
+  const char *programs[] = {
+    "1 + 2 * 3",
+    "_let x = 5 _in x * x + -1",
+    "_if 1 == 2 _then _false _else _true",
+    "_let x = y _in x + 2",
+    "_true + 1",
+    "_let f = _fun (x) x + 1 _in f(41)",
+    "_let y = 2 _in _fun (x) x * y",
+    "_let fib = _fun (fib) _fun (x)"
+    "  _if x == 0 _then 1"
+    "  _else _if x == 1 _then 1"
+    "  _else fib(fib)(x + -1) + fib(fib)(x + -2)"
+    " _in fib(fib)(15)",
+    "123456789012345678901234567890 * -98765432109876543210",
+  };
+
+  SECTION( "matches the tree" ) {
+    for (const char *source : programs) {
+      INFO( source );
+      PTR(Expr) e = parse_str(source);
+      PTR(FlatAst) flat = FlatAst::from_expr(e);
+      CHECK( flat->to_string() == e->to_string() );
+      CHECK( flat->to_expr()->equals(e) );
+      CHECK( result_or_error([&] { return flat->interp(NEW(EmptyEnv)()); })
+            == result_or_error([&] { return e->interp(NEW(EmptyEnv)()); }) );
+    }
+  }
+
+  SECTION( "layout" ) {
+    PTR(FlatAst) flat = FlatAst::from_expr(parse_str("_let x = 1 _in x + x"));
+    REQUIRE( flat->nodes.size() == 5 );
+    CHECK( flat->names.size() == 1 );
+    CHECK( flat->literals.size() == 1 );
+    CHECK( flat->root == 4 );
+    CHECK( flat->nodes[4].kind == LET_NODE );
+    CHECK( flat->nodes[4].b == 0 );
+    CHECK( flat->nodes[4].c == 3 );
+    CHECK( flat->nodes[3].kind == ADD_NODE );
+    CHECK( flat->nodes[3].a == 1 );
+    CHECK( flat->nodes[3].b == 2 );
+    CHECK( sizeof(FlatNode) == 16 );
+  }
+
+  SECTION( "closures keep their program" ) {
+    PTR(Val) f = FlatAst::from_expr(parse_str("_let y = 2 _in _fun (x) x * y"))->interp(NEW(EmptyEnv)());
+    CHECK( f->to_string() == "(_fun (x) (x * y))" );
+    CHECK( f->call(NumVal::make(21))->equals(NumVal::make(42)) );
+    CHECK( f->to_expr()->equals(parse_str("_fun (x) x * y")) );
+    CHECK( f->equals(FlatAst::from_expr(parse_str("_fun (x) x * y"))->interp(NEW(EmptyEnv)())) );
+    CHECK( ! f->equals(FlatAst::from_expr(parse_str("_fun (x) x + y"))->interp(NEW(EmptyEnv)())) );
+    CHECK_THROWS_WITH( f->mult_with(NumVal::make(1)), "no multiplying functions" );
+  }
+
+  SECTION( "the same nodes are evaluated" ) {
+    PTR(Expr) e = parse_str(programs[7]);
+    NodeCounter tree_count, flat_count;
+    eval_hooks = &tree_count;
+    e->interp(NEW(EmptyEnv)());
+    eval_hooks = &flat_count;
+    FlatAst::from_expr(e)->interp(NEW(EmptyEnv)());
+    eval_hooks = nullptr;
+    CHECK( flat_count.nodes == tree_count.nodes );
+  }
+
+#ifndef MSD_NO_BUDGET
+  SECTION( "limits apply" ) {
+    EvalLimits limits = {100, 0, 0};
+    CHECK_THROWS( interp_limited(FlatAst::from_expr(parse_str(programs[7])), NEW(EmptyEnv)(), limits) );
+    EvalUsage usage;
+    EvalLimits unlimited = {0, 0, 0};
+    CHECK( interp_limited(FlatAst::from_expr(parse_str(programs[5])), NEW(EmptyEnv)(), unlimited, &usage)
+          ->to_string() == "42" );
+    CHECK( usage.steps == 1 );
+  }
+#endif
+
+  SECTION( "deep trees" ) {
+    PTR(Expr) e = NEW(NumExpr)(0);
+    for (int i = 0; i < 1000000; i++)
+      e = NEW(AddExpr)(e, NEW(VarExpr)("x"));
+    PTR(FlatAst) flat = FlatAst::from_expr(e);
+    CHECK( flat->nodes.size() == 2000001 );
+    CHECK( flat->names.size() == 1 );
+    CHECK( flat->to_string().size() == 1000000 * 6 + 1 );
+    CHECK( flat->to_expr()->weight == e->weight );
+  }
+}
+
+TEST_CASE( "flat serialize" ) {
+  SECTION( "round trip" ) {
+    const char *programs[] = {
+      "-2147483648",
+      "2147483647 + -7",
+      "123456789012345678901234567890 * -98765432109876543210",
+      "_if 1 == 2 _then _true _else _false",
+      "_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1"
+      " _else fib(fib)(x + -2) + fib(fib)(x + -1) _in fib(fib)(10)"
+    };
+    for (const char *source : programs) {
+      INFO( source );
+      PTR(FlatAst) flat = FlatAst::from_expr(parse_str(source));
+      std::string bytes = flat->serialize();
+      PTR(FlatAst) loaded = FlatAst::deserialize(bytes.data(), bytes.size());
+      CHECK( loaded->to_string() == flat->to_string() );
+      CHECK( loaded->nodes.size() == flat->nodes.size() );
+      CHECK( loaded->interp(NEW(EmptyEnv)())->equals(flat->interp(NEW(EmptyEnv)())) );
+    }
+  }
+
+  SECTION( "rejects bad data" ) {
+    std::string bytes = FlatAst::from_expr(parse_str("_let x = 1 _in x + 2"))->serialize();
+    CHECK_THROWS_WITH( FlatAst::deserialize(bytes.data(), bytes.size() - 1), "bad compiled program" );
+    CHECK_THROWS_WITH( FlatAst::deserialize((bytes + "x").data(), bytes.size() + 1), "bad compiled program" );
+    CHECK_THROWS_WITH( FlatAst::deserialize("1 + 2", 5), "not a flat program" );
+    std::string tree_bytes = serialize_expr(parse_str("1"));
+    CHECK_THROWS_WITH( FlatAst::deserialize(tree_bytes.data(), tree_bytes.size()), "not a flat program" );
+
+    // the `ADD` node (the fourth) made to refer to itself
+    std::string cycle = bytes;
+    uint32_t self = 3;
+    size_t add = cycle.size() - 2 * sizeof(FlatNode) + offsetof(FlatNode, b);
+    memcpy(&cycle[add], &self, sizeof(self));
+    CHECK_THROWS_WITH( FlatAst::deserialize(cycle.data(), cycle.size()), "bad compiled program" );
+
+    // the literal 1 stored as the big number with limbs [1, 0], which
+    // would make `1 == 1` false
+    std::string one = FlatAst::from_expr(parse_str("1 == 1"))->serialize();
+    // after the header, no names, and the first of two literals
+    size_t literal = sizeof(FLAT_MAGIC) + 3;
+    REQUIRE( one.substr(literal - 1, 3) == std::string("\x02\x00\x02", 3) );
+    std::string unnormal = one;
+    unnormal.replace(literal, 2, std::string("\x01\x00\x02\x01\x00", 5));
+    CHECK_THROWS_WITH( FlatAst::deserialize(unnormal.data(), unnormal.size()), "bad compiled program" );
+  }
+
+  SECTION( "load from a file" ) {
+    char path[] = "/tmp/msdscript-flat-XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE( fd >= 0 );
+    std::string bytes = FlatAst::from_expr(parse_str("_let x = 6 _in x * 7"))->serialize();
+    REQUIRE( write(fd, bytes.data(), bytes.size()) == (ssize_t)bytes.size() );
+    close(fd);
+    CHECK( is_flat_file(path) );
+    CHECK( ! is_compiled_file(path) );
+    CHECK( load_flat(path)->interp(NEW(EmptyEnv)())->to_string() == "42" );
+    remove(path);
+  }
+}
@@ -0,0 +1,112 @@
+//
+//  flat.hpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 5/15/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef flat_hpp
+#define flat_hpp
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "pointer.hpp"
+#include "symbol.hpp"
+#include "hooks.hpp"
+#include "value.hpp"
+
+class Expr;
+class Env;
+
+// One node of a `FlatAst`: its kind and three operands, which are the
+// indexes of its children or into the side tables
+//
+//   NUM              a: literal
+//   BOOL             a: 1 for `_true`, 0 for `_false`
+//   VAR              a: name
+//   ADD, MULT, COMP  a + b
+//   LET              _let name a = b _in c
+//   IF               _if a _then b _else c
+//   FUN              _fun (name a) b
+//   CALL             a(b)
+struct FlatNode {
+  uint32_t kind;
+  uint32_t a;
+  uint32_t b;
+  uint32_t c;
+};
+
+/*
+ * The flat form of the AST: every node in one array, children before
+ * their parents, so a program is a few contiguous allocations instead
+ * of one per node, and walking it stays within the array. Literal
+ * values and names live in side tables. Evaluation runs on the array
+ * directly; closures refer back to the program they came from, which
+ * they keep alive.
+ *
+ * The arrays are also the serialized form: names and literals as in a
+ * compiled program, then the nodes as they are in memory (see
+ * `serialize`).
+ * */
+class FlatAst : public std::enable_shared_from_this<FlatAst> {
+public:
+  std::vector<FlatNode> nodes;
+  std::vector<PTR(Val)> literals;
+  std::vector<Symbol> names;
+  uint32_t root;
+
+  // Flattens `e` without recursion, so any depth of tree works
+  static PTR(FlatAst) from_expr(const PTR(Expr) &e);
+  // The tree for the whole program, or for the node at `index`
+  PTR(Expr) to_expr();
+  PTR(Expr) to_expr(uint32_t index);
+
+  // Evaluates the whole program, or the node at `index`; reports node
+  // kinds to `eval_hooks` but not function applications
+  PTR(Val) interp(const PTR(Env) &env);
+  PTR(Val) interp(uint32_t index, const PTR(Env) &env);
+
+  // Prints the node at `index` as `Expr::print` does
+  void print(std::ostream &out, uint32_t index);
+  std::string to_string();
+
+  // "MSDF" version, the name and literal tables, the node count and
+  // root, then the nodes in host byte order
+  std::string serialize();
+  // Throws `runtime_error` for data that isn't a complete flat
+  // program, including nodes that refer to anything but earlier nodes
+  static PTR(FlatAst) deserialize(const char *data, size_t size);
+};
+
+static const char FLAT_MAGIC[4] = {'M', 'S', 'D', 'F'};
+static const uint8_t FLAT_VERSION = 1;
+
+// Whether the file at `path` starts like a flat program
+bool is_flat_file(const std::string &path);
+PTR(FlatAst) load_flat(const std::string &path);
+
+// A closure over a function body in a `FlatAst`
+class FlatFunVal : public Val {
+public:
+  PTR(FlatAst) program;
+  // the `FUN` node
+  uint32_t fun;
+  PTR(Env) env;
+
+  FlatFunVal(PTR(FlatAst) program, uint32_t fun, PTR(Env) env);
+  ~FlatFunVal();
+  bool equals(const PTR(Val) &val);
+
+  PTR(Val) add_to(const PTR(Val) &other_val);
+  PTR(Val) mult_with(const PTR(Val) &other_val);
+  PTR(Expr) to_expr();
+  void print(std::ostream &out);
+  bool is_true();
+  PTR(Val) call(PTR(Val) actual_arg);
+};
+
+#endif /* flat_hpp */
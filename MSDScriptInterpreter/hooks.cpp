@@ -0,0 +1,90 @@
+//
+//  hooks.cpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 5/6/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include "hooks.hpp"
+#include "catch.hpp"
+#include "expr.hpp"
+#include "env.hpp"
+#include "parse.hpp"
+#include "value.hpp"
+
+thread_local EvalHooks *eval_hooks = nullptr;
+
+const char *node_kind_name(NodeKind kind) {
+  static const char *names[NODE_KINDS] = {
+    "num", "add", "mult", "var", "let", "bool", "if", "comp", "fun", "call"
+  };
+  return (kind >= 0 && kind < NODE_KINDS) ? names[kind] : "?";
+}
+
+#ifndef MSD_NO_HOOKS
+// Records events as text, checking that they nest
+class RecordingHooks : public EvalHooks {
+public:
+  std::string events;
+  std::vector<NodeKind> nodes;
+  std::vector<Expr *> functions;
+
+  void enter_node(NodeKind kind) {
+    nodes.push_back(kind);
+  }
+  void leave_node(NodeKind kind) {
+    CHECK( nodes.back() == kind );
+    nodes.pop_back();
+    events += node_kind_name(kind);
+    events += " ";
+  }
+  void enter_function(Expr *body) {
+    functions.push_back(body);
+    events += "[";
+  }
+  void leave_function(Expr *body) {
+    CHECK( functions.back() == body );
+    functions.pop_back();
+    events += "] ";
+  }
+};
+
+static PTR(Val) interp_with_hooks(const std::string &source, EvalHooks *hooks) {
+  std::istringstream in(source);
+  PTR(Expr) e = parse(in);
+  eval_hooks = hooks;
+  try {
+    PTR(Val) result = e->interp(NEW(EmptyEnv)());
+    eval_hooks = nullptr;
+    return result;
+  } catch (...) {
+    eval_hooks = nullptr;
+    throw;
+  }
+}
+
+TEST_CASE( "evaluation hooks" ) {
+  RecordingHooks hooks;
+
+  SECTION( "nodes in the order they finish" ) {
+    CHECK( interp_with_hooks("_let x = 2 _in _if x == 2 _then x * 3 _else 0", &hooks)->to_string() == "6" );
+    CHECK( hooks.events == "num var num comp var num mult if let " );
+  }
+
+  SECTION( "function applications" ) {
+    CHECK( interp_with_hooks("(_fun (x) x + 1)(2)", &hooks)->to_string() == "3" );
+    CHECK( hooks.events == "fun num [var num add ] call " );
+  }
+
+  SECTION( "balanced when evaluation throws" ) {
+    CHECK_THROWS( interp_with_hooks("(_fun (x) x + _true)(2)", &hooks) );
+    CHECK( hooks.nodes.empty() );
+    CHECK( hooks.functions.empty() );
+    CHECK( hooks.events == "fun num [var bool add ] call " );
+  }
+}
+#endif
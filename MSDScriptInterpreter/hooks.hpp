@@ -0,0 +1,124 @@
+//
+//  hooks.hpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 5/6/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef hooks_hpp
+#define hooks_hpp
+
+class Expr;
+
+enum NodeKind {
+  NUM_NODE,
+  ADD_NODE,
+  MULT_NODE,
+  VAR_NODE,
+  LET_NODE,
+  BOOL_NODE,
+  IF_NODE,
+  COMP_NODE,
+  FUN_NODE,
+  CALL_NODE,
+  NODE_KINDS
+};
+
+// "num", "add", ...
+const char *node_kind_name(NodeKind kind);
+
+/*
+ * Observes an evaluation: profilers and tracers implement this and
+ * install it in `eval_hooks`. Enters and leaves always pair up, even
+ * when evaluation throws.
+ * */
+class EvalHooks {
+public:
+  // Hooks that only watch functions pass false, sparing every node
+  // the calls
+  EvalHooks(bool node_events = true) : node_events(node_events) {}
+  virtual ~EvalHooks() {}
+
+  const bool node_events;
+
+  // Around each `interp` of a node
+  virtual void enter_node(NodeKind kind) = 0;
+  virtual void leave_node(NodeKind kind) = 0;
+
+  // Around each application of a function, which is identified by its
+  // body (the `body` of the `FunExpr` it came from)
+  virtual void enter_function(Expr *body) = 0;
+  virtual void leave_function(Expr *body) = 0;
+};
+
+// Counts the nodes evaluated
+class NodeCounter : public EvalHooks {
+public:
+  unsigned long nodes = 0;
+
+  void enter_node(NodeKind kind) { nodes++; }
+  void leave_node(NodeKind kind) {}
+  void enter_function(Expr *body) {}
+  void leave_function(Expr *body) {}
+};
+
+// The hooks evaluation on this thread reports to, if any
+extern thread_local EvalHooks *eval_hooks;
+
+// Building with `MSD_NO_HOOKS` removes the hook calls, so nothing
+// installed in `eval_hooks` hears of an evaluation
+#ifdef MSD_NO_HOOKS
+static const bool hooks_enabled = false;
+#else
+static const bool hooks_enabled = true;
+#endif
+
+// Reports one node's `interp` to this thread's hooks. Building with
+// `MSD_NO_HOOKS` removes even the null checks.
+class NodeScope {
+public:
+  NodeScope(NodeKind kind) : kind(kind) {
+#ifndef MSD_NO_HOOKS
+    hooks = eval_hooks;
+    if (hooks != nullptr && !hooks->node_events)
+      hooks = nullptr;
+    if (hooks != nullptr)
+      hooks->enter_node(kind);
+#endif
+  }
+  ~NodeScope() {
+#ifndef MSD_NO_HOOKS
+    if (hooks != nullptr)
+      hooks->leave_node(kind);
+#endif
+  }
+
+private:
+  EvalHooks *hooks;
+  NodeKind kind;
+};
+
+// Reports one function application to this thread's hooks
+class FunctionScope {
+public:
+  FunctionScope(Expr *body) : body(body) {
+#ifndef MSD_NO_HOOKS
+    hooks = eval_hooks;
+    if (hooks != nullptr)
+      hooks->enter_function(body);
+#endif
+  }
+  ~FunctionScope() {
+#ifndef MSD_NO_HOOKS
+    if (hooks != nullptr)
+      hooks->leave_function(body);
+#endif
+  }
+
+private:
+  EvalHooks *hooks;
+  Expr *body;
+};
+
+#endif /* hooks_hpp */
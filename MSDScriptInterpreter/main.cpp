@@ -12,35 +12,265 @@
 #include "env.hpp"
 #include "parse.hpp"
 #include "value.hpp"
+#include "batch.hpp"
+#include "thread_pool.hpp"
+#include "parallel.hpp"
+#include "server.hpp"
+#include "budget.hpp"
+#include "cache.hpp"
+#include "serialize.hpp"
+#include "profile.hpp"
+#include "sampler.hpp"
+#include "perf_counters.hpp"
+#include "trace.hpp"
+#include "flat.hpp"
 
 #define CATCH_CONFIG_RUNNER
 #include "catch.hpp"
 
+static void write_trace(TraceRecorder &trace, const char *path) {
+    std::ofstream trace_file(path);
+    trace.write_json(trace_file);
+    if (!trace_file)
+        throw std::runtime_error((std::string)"can't write " + path);
+}
+
 int main(int argc, char **argv) {
     try {
         bool optimize_mode = false;
-        PTR(Expr) e;
-        if ((argc > 1) && !strcmp(argv[1], "--opt")){
-            optimize_mode = true;
-            argc--;
-            argv--;
+        bool batch_mode = false;
+        bool parallel_mode = false;
+        bool usage_mode = false;
+        bool compile_mode = false;
+        bool flat_mode = false;
+        bool alloc_stats_mode = false;
+        bool profile_mode = false;
+        const char *sample_path = nullptr;
+        long sample_interval_us = 1000;
+        bool perf_counters_mode = false;
+        bool perf_nodes_mode = false;
+        const char *trace_path = nullptr;
+        long trace_min_us = 100;
+        BatchFraming framing = LINE_FRAMING;
+        // worker threads for --jobs, --parallel and --serve: 0 uses
+        // every core, and -1 (not given) runs batches on the main thread
+        int jobs = -1;
+        const char *serve_path = nullptr;
+        int argi = 1;
+        for (; (argi < argc) && !strncmp(argv[argi], "--", 2); argi++) {
+            if (!strcmp(argv[argi], "--opt"))
+                optimize_mode = true;
+            else if (!strcmp(argv[argi], "--parallel"))
+                parallel_mode = true;
+            else if (!strcmp(argv[argi], "--batch"))
+                batch_mode = true;
+            else if (!strcmp(argv[argi], "--batch-framed")) {
+                batch_mode = true;
+                framing = LENGTH_FRAMING;
+            } else if (!strcmp(argv[argi], "--jobs") && (argi + 1 < argc)) {
+                batch_mode = true;
+                jobs = atoi(argv[++argi]);
+            } else if (!strcmp(argv[argi], "--serve") && (argi + 1 < argc)) {
+                serve_path = argv[++argi];
+            } else if (!strcmp(argv[argi], "--fuel") && (argi + 1 < argc)) {
+                if (!budget_enabled)
+                    throw std::runtime_error("--fuel needs a build without MSD_NO_BUDGET");
+                default_limits.max_steps = atol(argv[++argi]);
+            } else if (!strcmp(argv[argi], "--timeout-ms") && (argi + 1 < argc)) {
+                if (!budget_enabled)
+                    throw std::runtime_error("--timeout-ms needs a build without MSD_NO_BUDGET");
+                default_limits.max_millis = atol(argv[++argi]);
+            } else if (!strcmp(argv[argi], "--max-bytes") && (argi + 1 < argc)) {
+                default_limits.max_bytes = strtoul(argv[++argi], nullptr, 10);
+            } else if (!strcmp(argv[argi], "--cache-size") && (argi + 1 < argc)) {
+                program_cache.set_capacity(strtoul(argv[++argi], nullptr, 10));
+            } else if (!strcmp(argv[argi], "--cache-bytes") && (argi + 1 < argc)) {
+                program_cache.set_max_bytes(strtoul(argv[++argi], nullptr, 10));
+            } else if (!strcmp(argv[argi], "--compile")) {
+                compile_mode = true;
+            } else if (!strcmp(argv[argi], "--flat")) {
+                flat_mode = true;
+            } else if (!strcmp(argv[argi], "--usage")) {
+                usage_mode = true;
+            } else if (!strcmp(argv[argi], "--perf-counters")) {
+                perf_counters_mode = true;
+            } else if (!strcmp(argv[argi], "--perf-nodes")) {
+                if (!hooks_enabled)
+                    throw std::runtime_error("--perf-nodes needs a build without MSD_NO_HOOKS");
+                perf_counters_mode = true;
+                perf_nodes_mode = true;
+            } else if (!strcmp(argv[argi], "--profile")) {
+                if (!hooks_enabled)
+                    throw std::runtime_error("--profile needs a build without MSD_NO_HOOKS");
+                profile_mode = true;
+            } else if (!strcmp(argv[argi], "--sample") && (argi + 1 < argc)) {
+                if (!hooks_enabled)
+                    throw std::runtime_error("--sample needs a build without MSD_NO_HOOKS");
+                sample_path = argv[++argi];
+            } else if (!strcmp(argv[argi], "--sample-us") && (argi + 1 < argc)) {
+                sample_interval_us = std::max(atol(argv[++argi]), 1L);
+            } else if (!strcmp(argv[argi], "--trace") && (argi + 1 < argc)) {
+                if (!hooks_enabled)
+                    throw std::runtime_error("--trace needs a build without MSD_NO_HOOKS");
+                trace_path = argv[++argi];
+            } else if (!strcmp(argv[argi], "--trace-min-us") && (argi + 1 < argc)) {
+                trace_min_us = std::max(atol(argv[++argi]), 0L);
+            } else if (!strcmp(argv[argi], "--alloc-stats")) {
+                if (!alloc_stats_enabled)
+                    throw std::runtime_error("--alloc-stats needs a build with MSD_ALLOC_STATS defined");
+                alloc_stats_mode = true;
+            } else
+                throw std::runtime_error((std::string)"unknown option " + argv[argi]);
+        }
+        if (profile_mode && sample_path != nullptr)
+            throw std::runtime_error("--profile and --sample can't be used together");
+        if (trace_path != nullptr && (profile_mode || sample_path != nullptr))
+            throw std::runtime_error("--trace can't be used with --profile or --sample");
+        if (parallel_mode && (profile_mode || sample_path != nullptr || trace_path != nullptr))
+            throw std::runtime_error("--parallel can't be used with --profile, --sample or --trace");
+        if (serve_path != nullptr) {
+            ThreadPool pool(std::max(jobs, 0));
+            Server server(serve_path, pool, optimize_mode);
+            server.run();
+            return 0;
         }
-        if (argc > 1) {
-            std::ifstream prog_in(argv[1]);
+        
+        // phases are traced from every thread; calls on this one only
+        TraceRecorder trace(trace_min_us);
+        if (trace_path != nullptr)
+            active_trace = &trace;
+        
+        std::ifstream prog_file;
+        if (argi < argc)
+            prog_file.open(argv[argi]);
+        std::istream &prog_in = (argi < argc) ? prog_file : std::cin;
+        
+        if (batch_mode) {
+            // every result goes through one buffered stream, flushed at the end
+            std::ios::sync_with_stdio(false);
+            if (jobs < 0 || jobs == 1) {
+                run_batch(prog_in, std::cout, framing, optimize_mode);
+            } else {
+                ThreadPool pool((unsigned)jobs);
+                run_parallel_batch(prog_in, std::cout, framing, optimize_mode, pool);
+            }
+            if (alloc_stats_mode)
+                print_alloc_stats(std::cerr);
+            if (trace_path != nullptr)
+                write_trace(trace, trace_path);
+            return 0;
+        }
+        
+        // with --perf-counters, each phase is counted on its own
+        std::unique_ptr<PerfCounters> perf;
+        if (perf_counters_mode)
+            perf.reset(new PerfCounters());
+        
+        // a compiled program file is mapped in rather than parsed, and
+        // with --flat (or from a flat file) the program is evaluated
+        // in flat form
+        PTR(Expr) e;
+        PTR(FlatAst) flat;
+        if (perf)
+            perf->start();
+        if (argi < argc && is_flat_file(argv[argi]))
+            flat = load_flat(argv[argi]);
+        else if (argi < argc && is_compiled_file(argv[argi]))
+            e = load_compiled(argv[argi]);
+        else
             e = parse(prog_in);
-        } else {
-            e = parse(std::cin);
+        if (flat_mode && flat == nullptr)
+            flat = FlatAst::from_expr(e);
+        if (perf)
+            print_perf_counts(std::cerr, "parse", perf->stop(), 0);
+        if (flat != nullptr && (optimize_mode || parallel_mode || profile_mode || sample_path != nullptr))
+            throw std::runtime_error("a flat program can't be used with --opt, --parallel, --profile or --sample");
+        if (compile_mode) {
+            std::cout << (flat != nullptr ? flat->serialize() : serialize_expr(e));
+            return 0;
         }
         try {
             if(optimize_mode){
-                std::cout << e->optimize()->to_string() << std::endl;
+                AllocPhaseScope phase(ALLOC_OPTIMIZE);
+                TraceSpan span("optimize");
+                if (perf)
+                    perf->start();
+                PTR(Expr) optimized = e->optimize();
+                if (perf)
+                    print_perf_counts(std::cerr, "optimize", perf->stop(), 0);
+                optimized->print(std::cout);
+                std::cout << std::endl;
+            } else if (parallel_mode) {
+                ThreadPool pool(std::max(jobs, 0));
+                EvalUsage usage;
+                interp_parallel(e, NEW(EmptyEnv)(), pool, default_limits, usage_mode ? &usage : nullptr)
+                    ->print(std::cout);
+                std::cout << std::endl;
+                if (usage_mode)
+                    std::cerr << "steps: " << usage.steps << ", peak bytes: " << usage.peak_bytes << std::endl;
             } else {
-                std::cout << e->interp(NEW(EmptyEnv)())->to_string() << std::endl;
+                Profiler profiler;
+                StackSampler sampler;
+                if (profile_mode) {
+                    profiler.name_functions(e);
+                    eval_hooks = &profiler;
+                } else if (sample_path != nullptr) {
+                    eval_hooks = &sampler;
+                    sampler.start(sample_interval_us);
+                } else if (trace_path != nullptr && flat == nullptr) {
+                    trace.name_functions(e);
+                    eval_hooks = &trace;
+                }
+                EvalUsage usage;
+                if (perf)
+                    perf->start();
+                PTR(Val) result;
+                if (flat != nullptr)
+                    result = interp_limited(flat, NEW(EmptyEnv)(), default_limits, usage_mode ? &usage : nullptr);
+                else
+                    result = interp_limited(e, NEW(EmptyEnv)(), default_limits, usage_mode ? &usage : nullptr);
+                PerfCounts interp_counts = perf ? perf->stop() : PerfCounts();
+                sampler.stop();
+                eval_hooks = nullptr;
+                if (perf) {
+                    // counting nodes would disturb the counters, so with
+                    // --perf-nodes the count comes from a second
+                    // evaluation, under the same limits
+                    NodeCounter counter;
+                    if (perf_nodes_mode) {
+                        eval_hooks = &counter;
+                        if (flat != nullptr)
+                            interp_limited(flat, NEW(EmptyEnv)(), default_limits, nullptr);
+                        else
+                            interp_limited(e, NEW(EmptyEnv)(), default_limits, nullptr);
+                        eval_hooks = nullptr;
+                    }
+                    print_perf_counts(std::cerr, "interp", interp_counts, counter.nodes);
+                }
+                result->print(std::cout);
+                std::cout << std::endl;
+                if (profile_mode)
+                    profiler.report(std::cerr);
+                if (sample_path != nullptr) {
+                    std::ofstream sample_file(sample_path);
+                    sampler.write_folded(sample_file, function_labels(e));
+                    if (!sample_file)
+                        throw std::runtime_error((std::string)"can't write " + sample_path);
+                }
+                if (usage_mode)
+                    std::cerr << "steps: " << usage.steps << ", peak bytes: " << usage.peak_bytes << std::endl;
             }
         }catch (std::runtime_error err) {
+            eval_hooks = nullptr;
             std::cerr << err.what() << std::endl;
+            if (trace_path != nullptr)
+                write_trace(trace, trace_path);
             return 2;
         }
+        if (alloc_stats_mode)
+            print_alloc_stats(std::cerr);
+        if (trace_path != nullptr)
+            write_trace(trace, trace_path);
         return 0;
     } catch (std::runtime_error err) {
         std::cerr << err.what() << std::endl;
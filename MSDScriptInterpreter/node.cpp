@@ -0,0 +1,544 @@
+//
+//  node.cpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 5/14/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "node.hpp"
+#include "catch.hpp"
+#include "expr.hpp"
+#include "env.hpp"
+#include "parse.hpp"
+#include "budget.hpp"
+#include "reclaim.hpp"
+
+Node::Node(NodeKind kind) {
+  this->kind = kind;
+}
+
+Node::~Node() {
+  destroy_iteratively(child[0]);
+  destroy_iteratively(child[1]);
+  destroy_iteratively(child[2]);
+}
+
+// A `NUM` or `BOOL` node for `val`
+static PTR(Node) literal(NodeKind kind, const PTR(Val) &val) {
+  PTR(Node) node = NEW(Node)(kind);
+  node->val = val;
+  return node;
+}
+
+PTR(Node) Node::num(int rep) {
+  return literal(NUM_NODE, NumVal::make(rep));
+}
+
+PTR(Node) Node::boolean(bool rep) {
+  return literal(BOOL_NODE, BoolVal::make(rep));
+}
+
+PTR(Node) Node::var(Symbol name) {
+  PTR(Node) node = NEW(Node)(VAR_NODE);
+  node->name = name;
+  return node;
+}
+
+// A node of `kind` with up to three children
+static PTR(Node) make_node(NodeKind kind, Symbol name, PTR(Node) a, PTR(Node) b = nullptr,
+                           PTR(Node) c = nullptr) {
+  PTR(Node) node = NEW(Node)(kind);
+  node->name = name;
+  node->child[0] = std::move(a);
+  node->child[1] = std::move(b);
+  node->child[2] = std::move(c);
+  return node;
+}
+
+PTR(Node) Node::add(PTR(Node) lhs, PTR(Node) rhs) {
+  return make_node(ADD_NODE, Symbol(), std::move(lhs), std::move(rhs));
+}
+
+PTR(Node) Node::mult(PTR(Node) lhs, PTR(Node) rhs) {
+  return make_node(MULT_NODE, Symbol(), std::move(lhs), std::move(rhs));
+}
+
+PTR(Node) Node::comp(PTR(Node) lhs, PTR(Node) rhs) {
+  return make_node(COMP_NODE, Symbol(), std::move(lhs), std::move(rhs));
+}
+
+PTR(Node) Node::let(Symbol name, PTR(Node) rhs, PTR(Node) body) {
+  return make_node(LET_NODE, name, std::move(rhs), std::move(body));
+}
+
+PTR(Node) Node::if_then(PTR(Node) test_part, PTR(Node) then_part, PTR(Node) else_part) {
+  return make_node(IF_NODE, Symbol(), std::move(test_part), std::move(then_part), std::move(else_part));
+}
+
+PTR(Node) Node::fun(Symbol formal_arg, PTR(Node) body) {
+  return make_node(FUN_NODE, formal_arg, std::move(body));
+}
+
+PTR(Node) Node::call(PTR(Node) to_be_called, PTR(Node) actual_arg) {
+  return make_node(CALL_NODE, Symbol(), std::move(to_be_called), std::move(actual_arg));
+}
+
+PTR(Node) Node::from_val(const PTR(Val) &val) {
+  // casting the plain pointer spares a reference count update
+  if (dynamic_cast<NumVal *>(val.get()) != nullptr)
+    return literal(NUM_NODE, val);
+  if (dynamic_cast<BoolVal *>(val.get()) != nullptr)
+    return literal(BOOL_NODE, val);
+  NodeFunVal *fun = dynamic_cast<NodeFunVal *>(val.get());
+  if (fun != nullptr)
+    return Node::fun(fun->formal_arg, fun->body);
+  return to_node(val->to_expr());
+}
+
+bool Node::equals(const PTR(Node) &other) {
+  if (other == nullptr || other->kind != kind)
+    return false;
+  switch (kind) {
+    case NUM_NODE:
+    case BOOL_NODE:
+      return val->equals(other->val);
+    case VAR_NODE:
+      return name == other->name;
+    case ADD_NODE:
+    case MULT_NODE:
+    case COMP_NODE:
+    case CALL_NODE:
+      return child[0]->equals(other->child[0]) && child[1]->equals(other->child[1]);
+    case LET_NODE:
+      return name == other->name && child[0]->equals(other->child[0]) && child[1]->equals(other->child[1]);
+    case IF_NODE:
+      return (child[0]->equals(other->child[0]) && child[1]->equals(other->child[1])
+              && child[2]->equals(other->child[2]));
+    case FUN_NODE:
+      return name == other->name && child[0]->equals(other->child[0]);
+    default:
+      throw std::runtime_error("bad node kind");
+  }
+}
+
+PTR(Val) Node::interp(const PTR(Env) &env) {
+  NodeScope scope(kind);
+  switch (kind) {
+    case NUM_NODE:
+    case BOOL_NODE:
+      return val;
+    case VAR_NODE:
+      return env->lookup(name);
+    case ADD_NODE: {
+      PTR(Val) lhs_val = child[0]->interp(env);
+      return lhs_val->add_to(child[1]->interp(env));
+    }
+    case MULT_NODE: {
+      PTR(Val) lhs_val = child[0]->interp(env);
+      return lhs_val->mult_with(child[1]->interp(env));
+    }
+    case COMP_NODE: {
+      PTR(Val) lhs_val = child[0]->interp(env);
+      return BoolVal::make(lhs_val->equals(child[1]->interp(env)));
+    }
+    case LET_NODE: {
+      PTR(Val) rhs_val = child[0]->interp(env);
+      return child[1]->interp(NEW(ExtendedEnv)(name, std::move(rhs_val), env));
+    }
+    case IF_NODE:
+      if (child[0]->interp(env)->is_true())
+        return child[1]->interp(env);
+      else
+        return child[2]->interp(env);
+    case FUN_NODE:
+      return NEW(NodeFunVal)(name, child[0], env);
+    case CALL_NODE: {
+      charge_step();
+      PTR(Val) callee = child[0]->interp(env);
+      return callee->call(child[1]->interp(env));
+    }
+    default:
+      throw std::runtime_error("bad node kind");
+  }
+}
+
+PTR(Node) Node::subst(Symbol var, const PTR(Val) &new_val) {
+  switch (kind) {
+    case NUM_NODE:
+    case BOOL_NODE:
+      return literal(kind, val);
+    case VAR_NODE:
+      if (name == var)
+        return from_val(new_val);
+      else
+        return Node::var(name);
+    case LET_NODE:
+      if (name == var)
+        return let(name, child[0]->subst(var, new_val), child[1]->subst(var, new_val));
+      else
+        return let(name, child[0]->subst(var, new_val), child[1]);
+    case FUN_NODE:
+      if (name == var)
+        return fun(name, child[0]);
+      else
+        return fun(name, child[0]->subst(var, new_val));
+    case IF_NODE:
+      return if_then(child[0]->subst(var, new_val), child[1]->subst(var, new_val),
+                     child[2]->subst(var, new_val));
+    case ADD_NODE:
+    case MULT_NODE:
+    case COMP_NODE:
+    case CALL_NODE:
+      return make_node(kind, name, child[0]->subst(var, new_val), child[1]->subst(var, new_val));
+    default:
+      throw std::runtime_error("bad node kind");
+  }
+}
+
+PTR(Node) Node::optimize() {
+  switch (kind) {
+    case NUM_NODE:
+    case BOOL_NODE:
+      return literal(kind, val);
+    case VAR_NODE:
+      return Node::var(name);
+    case ADD_NODE:
+    case MULT_NODE: {
+      PTR(Node) olhs = child[0]->optimize();
+      PTR(Node) orhs = child[1]->optimize();
+      if (!olhs->containsVarExpr() && !orhs->containsVarExpr()) {
+        PTR(Val) lhs_val = olhs->interp(NEW(EmptyEnv)());
+        PTR(Val) rhs_val = orhs->interp(NEW(EmptyEnv)());
+        return from_val(kind == ADD_NODE ? lhs_val->add_to(rhs_val) : lhs_val->mult_with(rhs_val));
+      }
+      // `MultExpr` optimizes its operands a second time
+      if (kind == MULT_NODE)
+        return mult(olhs->optimize(), orhs->optimize());
+      return add(olhs, orhs);
+    }
+    case COMP_NODE:
+      if (child[0]->containsVarExpr() || child[1]->containsVarExpr())
+        return comp(child[0]->optimize(), child[1]->optimize());
+      else
+        return boolean(child[0]->interp(NEW(EmptyEnv)())->equals(child[1]->interp(NEW(EmptyEnv)())));
+    case LET_NODE: {
+      PTR(Node) orhs = child[0]->optimize();
+      if (orhs->containsVarExpr())
+        return let(name, orhs, child[1]->optimize());
+      else
+        return child[1]->subst(name, orhs->interp(NEW(EmptyEnv)()))->optimize();
+    }
+    case IF_NODE:
+      if (!child[0]->containsVarExpr()) {
+        if (child[0]->interp(NEW(EmptyEnv)())->is_true())
+          return child[1]->optimize();
+        else
+          return child[2]->optimize();
+      }
+      return if_then(child[0]->optimize(), child[1]->optimize(), child[2]->optimize());
+    case FUN_NODE:
+      return fun(name, child[0]->optimize());
+    case CALL_NODE:
+      return call(child[0]->optimize(), child[1]->optimize());
+    default:
+      throw std::runtime_error("bad node kind");
+  }
+}
+
+bool Node::containsVarExpr() {
+  switch (kind) {
+    case NUM_NODE:
+    case BOOL_NODE:
+      return false;
+    case VAR_NODE:
+    case LET_NODE:
+    case FUN_NODE:
+    case CALL_NODE:
+      return true;
+    case ADD_NODE:
+    case MULT_NODE:
+    case COMP_NODE:
+      return child[0]->containsVarExpr() || child[1]->containsVarExpr();
+    case IF_NODE:
+      return child[0]->containsVarExpr() || child[1]->containsVarExpr() || child[2]->containsVarExpr();
+    default:
+      throw std::runtime_error("bad node kind");
+  }
+}
+
+// A piece of `Node::print` output still to be written: a node, or
+// literal text when `node` is null
+struct NodePrintItem {
+  Node *node;
+  const char *text;
+};
+
+void Node::print(std::ostream &out) {
+  std::vector<NodePrintItem> pending;
+  pending.push_back(NodePrintItem{this, nullptr});
+  while (!pending.empty()) {
+    NodePrintItem item = pending.back();
+    pending.pop_back();
+    if (item.node == nullptr) {
+      out << item.text;
+      continue;
+    }
+    Node *node = item.node;
+    // the rest of the node is pushed last piece first
+    const char *infix = nullptr;
+    switch (node->kind) {
+      case NUM_NODE:
+      case BOOL_NODE:
+        node->val->print(out);
+        break;
+      case VAR_NODE:
+        out << node->name;
+        break;
+      case ADD_NODE:
+        infix = " + ";
+        break;
+      case MULT_NODE:
+        infix = " * ";
+        break;
+      case COMP_NODE:
+        infix = " == ";
+        break;
+      case LET_NODE:
+        out << "(_let " << node->name << " = ";
+        pending.push_back(NodePrintItem{nullptr, ")"});
+        pending.push_back(NodePrintItem{&*node->child[1], nullptr});
+        pending.push_back(NodePrintItem{nullptr, " _in "});
+        pending.push_back(NodePrintItem{&*node->child[0], nullptr});
+        break;
+      case IF_NODE:
+        out << "(_if ";
+        pending.push_back(NodePrintItem{nullptr, ")"});
+        pending.push_back(NodePrintItem{&*node->child[2], nullptr});
+        pending.push_back(NodePrintItem{nullptr, " _else "});
+        pending.push_back(NodePrintItem{&*node->child[1], nullptr});
+        pending.push_back(NodePrintItem{nullptr, " _then "});
+        pending.push_back(NodePrintItem{&*node->child[0], nullptr});
+        break;
+      case FUN_NODE:
+        out << "(_fun (" << node->name << ") ";
+        pending.push_back(NodePrintItem{nullptr, ")"});
+        pending.push_back(NodePrintItem{&*node->child[0], nullptr});
+        break;
+      case CALL_NODE:
+        pending.push_back(NodePrintItem{nullptr, ")"});
+        pending.push_back(NodePrintItem{&*node->child[1], nullptr});
+        pending.push_back(NodePrintItem{nullptr, " ("});
+        pending.push_back(NodePrintItem{&*node->child[0], nullptr});
+        break;
+      default:
+        throw std::runtime_error("bad node kind");
+    }
+    if (infix != nullptr) {
+      out << "(";
+      pending.push_back(NodePrintItem{nullptr, ")"});
+      pending.push_back(NodePrintItem{&*node->child[1], nullptr});
+      pending.push_back(NodePrintItem{nullptr, infix});
+      pending.push_back(NodePrintItem{&*node->child[0], nullptr});
+    }
+  }
+}
+
+std::string Node::to_string() {
+  std::ostringstream out;
+  print(out);
+  return out.str();
+}
+
+PTR(Node) to_node(const PTR(Expr) &e) {
+  if (PTR(NumExpr) n = CAST(NumExpr)(e))
+    return Node::from_val(n->val);
+  if (PTR(BoolExpr) b = CAST(BoolExpr)(e))
+    return Node::boolean(b->rep);
+  if (PTR(VarExpr) v = CAST(VarExpr)(e))
+    return Node::var(v->name);
+  if (PTR(AddExpr) a = CAST(AddExpr)(e))
+    return Node::add(to_node(a->lhs), to_node(a->rhs));
+  if (PTR(MultExpr) m = CAST(MultExpr)(e))
+    return Node::mult(to_node(m->lhs), to_node(m->rhs));
+  if (PTR(CompExpr) c = CAST(CompExpr)(e))
+    return Node::comp(to_node(c->lhs), to_node(c->rhs));
+  if (PTR(LetExpr) l = CAST(LetExpr)(e))
+    return Node::let(l->name, to_node(l->rhs), to_node(l->body));
+  if (PTR(IfExpr) i = CAST(IfExpr)(e))
+    return Node::if_then(to_node(i->test_part), to_node(i->then_part), to_node(i->else_part));
+  if (PTR(FunExpr) f = CAST(FunExpr)(e))
+    return Node::fun(f->formal_arg, to_node(f->body));
+  if (PTR(CallExpr) c = CAST(CallExpr)(e))
+    return Node::call(to_node(c->to_be_called), to_node(c->actual_arg));
+  throw std::runtime_error("unknown expression");
+}
+
+PTR(Expr) to_expr(const PTR(Node) &node) {
+  switch (node->kind) {
+    case NUM_NODE:
+      return node->val->to_expr();
+    case BOOL_NODE:
+      return NEW(BoolExpr)(node->val->is_true());
+    case VAR_NODE:
+      return NEW(VarExpr)(node->name);
+    case ADD_NODE:
+      return NEW(AddExpr)(to_expr(node->child[0]), to_expr(node->child[1]));
+    case MULT_NODE:
+      return NEW(MultExpr)(to_expr(node->child[0]), to_expr(node->child[1]));
+    case COMP_NODE:
+      return NEW(CompExpr)(to_expr(node->child[0]), to_expr(node->child[1]));
+    case LET_NODE:
+      return NEW(LetExpr)(node->name, to_expr(node->child[0]), to_expr(node->child[1]));
+    case IF_NODE:
+      return NEW(IfExpr)(to_expr(node->child[0]), to_expr(node->child[1]), to_expr(node->child[2]));
+    case FUN_NODE:
+      return NEW(FunExpr)(node->name, to_expr(node->child[0]));
+    case CALL_NODE:
+      return NEW(CallExpr)(to_expr(node->child[0]), to_expr(node->child[1]));
+    default:
+      throw std::runtime_error("bad node kind");
+  }
+}
+
+NodeFunVal::NodeFunVal(Symbol formal_arg, PTR(Node) body, PTR(Env) env) {
+  this->formal_arg = formal_arg;
+  this->body = std::move(body);
+  this->env = std::move(env);
+}
+
+NodeFunVal::~NodeFunVal() {
+  destroy_iteratively(body);
+  destroy_iteratively(env);
+}
+
+bool NodeFunVal::equals(const PTR(Val) &other_val) {
+  PTR(NodeFunVal) other_fun_val = CAST(NodeFunVal)(other_val);
+  if (other_fun_val == nullptr)
+    return false;
+  else
+    return formal_arg == other_fun_val->formal_arg && body->equals(other_fun_val->body);
+}
+
+PTR(Val) NodeFunVal::add_to(const PTR(Val) &other_val) {
+  throw std::runtime_error("no adding functions");
+}
+
+PTR(Val) NodeFunVal::mult_with(const PTR(Val) &other_val) {
+  throw std::runtime_error("no multiplying functions");
+}
+
+PTR(Expr) NodeFunVal::to_expr() {
+  return NEW(FunExpr)(formal_arg, ::to_expr(body));
+}
+
+void NodeFunVal::print(std::ostream &out) {
+  out << "(_fun (" << formal_arg << ") ";
+  body->print(out);
+  out << ")";
+}
+
+bool NodeFunVal::is_true() {
+  throw std::runtime_error("can't make funval a bool");
+}
+
+PTR(Val) NodeFunVal::call(PTR(Val) actual_arg) {
+  return body->interp(NEW(ExtendedEnv)(formal_arg, std::move(actual_arg), env));
+}
+
+static PTR(Expr) parse_str(const std::string &source) {
+  std::istringstream in(source);
+  return parse(in);
+}
+
+TEST_CASE( "closed AST" ) {
+  const char *programs[] = {
+    "1 + 2 * 3",
+    "_let x = 5 _in x * x + -1",
+    "_if 1 == 2 _then _false _else _true",
+    "_let x = y _in x + 2",
+    "_if x == 1 _then 2 * 3 _else x",
+    "(_let x = 1 _in x + 1) * (_if _true _then 2 _else y)",
+    "(_let x = y _in x + 1) * (_if x == 1 _then 2 _else y)",
+    "_let f = _fun (x) x + 1 _in f(41)",
+    "_fun (x) _fun (y) x * y",
+    "_let fib = _fun (fib) _fun (x)"
+    "  _if x == 0 _then 1"
+    "  _else _if x == 1 _then 1"
+    "  _else fib(fib)(x + -1) + fib(fib)(x + -2)"
+    " _in fib(fib)(15)",
+    "2147483647 + 1",
+  };
+
+  SECTION( "passes match the Expr ones" ) {
+    for (const char *source : programs) {
+      INFO( source );
+      PTR(Expr) e = parse_str(source);
+      PTR(Node) node = to_node(e);
+      CHECK( node->to_string() == e->to_string() );
+      CHECK( to_expr(node)->equals(e) );
+      CHECK( node->equals(to_node(e)) );
+      CHECK( node->containsVarExpr() == e->containsVarExpr() );
+      CHECK( node->optimize()->to_string() == e->optimize()->to_string() );
+      CHECK( node->subst("x", NumVal::make(3))->to_string() == e->subst("x", NumVal::make(3))->to_string() );
+
+      std::string expected, actual;
+      try {
+        expected = e->interp(NEW(EmptyEnv)())->to_string();
+      } catch (std::runtime_error &err) {
+        expected = err.what();
+      }
+      try {
+        actual = node->interp(NEW(EmptyEnv)())->to_string();
+      } catch (std::runtime_error &err) {
+        actual = err.what();
+      }
+      CHECK( actual == expected );
+    }
+  }
+
+  SECTION( "equals compares kinds and fields" ) {
+    CHECK( Node::num(1)->equals(Node::num(1)) );
+    CHECK( ! Node::num(1)->equals(Node::num(2)) );
+    CHECK( ! Node::num(1)->equals(Node::boolean(true)) );
+    CHECK( ! Node::var("x")->equals(Node::var("y")) );
+    CHECK( ! Node::add(Node::num(1), Node::num(2))->equals(Node::mult(Node::num(1), Node::num(2))) );
+    CHECK( ! Node::let("x", Node::num(1), Node::var("x"))->equals(Node::let("y", Node::num(1), Node::var("x"))) );
+  }
+
+  SECTION( "closures" ) {
+    PTR(Node) node = to_node(parse_str("_let y = 2 _in _fun (x) x * y"));
+    PTR(Val) f = node->interp(NEW(EmptyEnv)());
+    CHECK( f->to_string() == "(_fun (x) (x * y))" );
+    CHECK( f->call(NumVal::make(21))->equals(NumVal::make(42)) );
+    CHECK( f->equals(Node::fun("x", Node::mult(Node::var("x"), Node::var("y")))->interp(NEW(EmptyEnv)())) );
+    CHECK( f->to_expr()->equals(parse_str("_fun (x) x * y")) );
+    CHECK( Node::from_val(f)->equals(Node::fun("x", Node::mult(Node::var("x"), Node::var("y")))) );
+    CHECK_THROWS_WITH( f->add_to(NumVal::make(1)), "no adding functions" );
+  }
+
+  SECTION( "the same nodes are evaluated" ) {
+    PTR(Expr) e = parse_str(programs[9]);
+    NodeCounter expr_count, node_count;
+    eval_hooks = &expr_count;
+    e->interp(NEW(EmptyEnv)());
+    eval_hooks = &node_count;
+    to_node(e)->interp(NEW(EmptyEnv)());
+    eval_hooks = nullptr;
+    CHECK( node_count.nodes == expr_count.nodes );
+  }
+
+  SECTION( "deep trees print and free iteratively" ) {
+    PTR(Node) node = Node::num(0);
+    for (int i = 0; i < 1000000; i++)
+      node = Node::add(node, Node::var("x"));
+    std::ostringstream out;
+    node->print(out);
+    CHECK( out.str().size() == 1000000 * 6 + 1 );
+    node = nullptr;
+  }
+}
@@ -0,0 +1,98 @@
+//
+//  node.hpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 5/14/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef node_hpp
+#define node_hpp
+
+#include <ostream>
+#include <string>
+#include "pointer.hpp"
+#include "symbol.hpp"
+#include "hooks.hpp"
+#include "value.hpp"
+
+class Expr;
+class Env;
+
+/*
+ * The closed form of the AST: since the language has a fixed set of
+ * expressions, every node is one `Node` tagged with its kind, and each
+ * pass is a single function that switches on the kind instead of a
+ * virtual method per class. The fields a node uses depend on its kind:
+ *
+ *   NUM, BOOL        val (the literal's value)
+ *   VAR              name
+ *   ADD, MULT, COMP  child[0] + child[1]
+ *   LET              _let name = child[0] _in child[1]
+ *   IF               _if child[0] _then child[1] _else child[2]
+ *   FUN              _fun (name) child[0]
+ *   CALL             child[0](child[1])
+ *
+ * Passes behave exactly like their `Expr` counterparts, so a tree can
+ * be converted either way without changing what it means.
+ * */
+class Node {
+public:
+  NodeKind kind;
+  Symbol name;
+  PTR(Val) val;
+  PTR(Node) child[3];
+
+  Node(NodeKind kind);
+  ~Node();
+
+  static PTR(Node) num(int rep);
+  static PTR(Node) boolean(bool rep);
+  static PTR(Node) var(Symbol name);
+  static PTR(Node) add(PTR(Node) lhs, PTR(Node) rhs);
+  static PTR(Node) mult(PTR(Node) lhs, PTR(Node) rhs);
+  static PTR(Node) comp(PTR(Node) lhs, PTR(Node) rhs);
+  static PTR(Node) let(Symbol name, PTR(Node) rhs, PTR(Node) body);
+  static PTR(Node) if_then(PTR(Node) test_part, PTR(Node) then_part, PTR(Node) else_part);
+  static PTR(Node) fun(Symbol formal_arg, PTR(Node) body);
+  static PTR(Node) call(PTR(Node) to_be_called, PTR(Node) actual_arg);
+  // The literal for a value, as `Val::to_expr`
+  static PTR(Node) from_val(const PTR(Val) &val);
+
+  bool equals(const PTR(Node) &other);
+  // Reports node kinds to `eval_hooks`, but not function applications,
+  // which hooks identify by `Expr` bodies
+  PTR(Val) interp(const PTR(Env) &env);
+  PTR(Node) subst(Symbol var, const PTR(Val) &new_val);
+  PTR(Node) optimize();
+  bool containsVarExpr();
+
+  // Prints as `Expr::print` does, with an explicit stack
+  void print(std::ostream &out);
+  std::string to_string();
+};
+
+// Conversions between the two forms of the AST
+PTR(Node) to_node(const PTR(Expr) &e);
+PTR(Expr) to_expr(const PTR(Node) &node);
+
+// A closure over a closed-form body
+class NodeFunVal : public Val {
+public:
+  Symbol formal_arg;
+  PTR(Node) body;
+  PTR(Env) env;
+
+  NodeFunVal(Symbol formal_arg, PTR(Node) body, PTR(Env) env);
+  ~NodeFunVal();
+  bool equals(const PTR(Val) &val);
+
+  PTR(Val) add_to(const PTR(Val) &other_val);
+  PTR(Val) mult_with(const PTR(Val) &other_val);
+  PTR(Expr) to_expr();
+  void print(std::ostream &out);
+  bool is_true();
+  PTR(Val) call(PTR(Val) actual_arg);
+};
+
+#endif /* node_hpp */
@@ -0,0 +1,178 @@
+//
+//  parallel.cpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/10/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include <exception>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include "parallel.hpp"
+#include "thread_pool.hpp"
+#include "catch.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include "env.hpp"
+#include "parse.hpp"
+#include "trace.hpp"
+
+unsigned parallel_min_weight = Expr::CALL_WEIGHT;
+unsigned parallel_max_depth = 12;
+std::atomic<unsigned long> parallel_fork_count(0);
+
+thread_local ThreadPool *parallel_pool = nullptr;
+// How many forks deep the current thread's evaluation is
+static thread_local unsigned fork_depth = 0;
+
+// Runs `body` with the parallel state set to `pool` and `depth`,
+// restoring the previous state afterwards, even on an exception
+template <typename F>
+static void with_parallel_state(ThreadPool *pool, unsigned depth, F body) {
+  ThreadPool *saved_pool = parallel_pool;
+  unsigned saved_depth = fork_depth;
+  parallel_pool = pool;
+  fork_depth = depth;
+  try {
+    body();
+  } catch (...) {
+    parallel_pool = saved_pool;
+    fork_depth = saved_depth;
+    throw;
+  }
+  parallel_pool = saved_pool;
+  fork_depth = saved_depth;
+}
+
+PTR(Val) interp_parallel(PTR(Expr) e, PTR(Env) env, ThreadPool &pool,
+                         const EvalLimits &limits, EvalUsage *usage) {
+  return run_limited(limits, usage, [&] {
+    PTR(Val) result;
+    with_parallel_state(&pool, 0, [&] { result = e->interp(env); });
+    return result;
+  });
+}
+
+void interp_operands_parallel(const PTR(Expr) &lhs, const PTR(Expr) &rhs, const PTR(Env) &env,
+                              PTR(Val) &lhs_val, PTR(Val) &rhs_val) {
+  ThreadPool *pool = parallel_pool;
+  if (fork_depth >= parallel_max_depth
+      || lhs->weight < parallel_min_weight
+      || rhs->weight < parallel_min_weight) {
+    lhs_val = lhs->interp(env);
+    rhs_val = rhs->interp(env);
+    return;
+  }
+  
+  parallel_fork_count++;
+  unsigned depth = fork_depth + 1;
+  std::atomic<bool> rhs_done(false);
+  std::exception_ptr rhs_error;
+  // the forked operand's steps and allocations count against the same
+  // evaluation
+  EvalBudget *budget = current_budget;
+  MemoryAccount *account = current_account;
+  AllocPhase alloc_phase = current_alloc_phase;
+  pool->submit([&, pool, depth, budget, account, alloc_phase] {
+    AllocPhaseScope phase(alloc_phase);
+    TraceSpan span("interp");
+    std::unique_ptr<EvalBudget> fork_budget(budget != nullptr ? new EvalBudget(*budget) : nullptr);
+    EvalBudget *saved_budget = current_budget;
+    MemoryAccount *saved_account = current_account;
+    current_budget = fork_budget.get();
+    current_account = account;
+    try {
+      with_parallel_state(pool, depth, [&] { rhs_val = rhs->interp(env); });
+    } catch (...) {
+      rhs_error = std::current_exception();
+    }
+    current_budget = saved_budget;
+    current_account = saved_account;
+    fork_budget.reset();
+    rhs_done.store(true, std::memory_order_release);
+  });
+  
+  std::exception_ptr lhs_error;
+  try {
+    with_parallel_state(pool, depth, [&] { lhs_val = lhs->interp(env); });
+  } catch (...) {
+    lhs_error = std::current_exception();
+  }
+  
+  // The task refers to this frame, so wait for it even after an
+  // error, running other tasks meanwhile (usually the forked one)
+  while (!rhs_done.load(std::memory_order_acquire)) {
+    if (!pool->run_one())
+      std::this_thread::yield();
+  }
+  
+  // report the same error as sequential left-to-right evaluation
+  if (lhs_error)
+    std::rethrow_exception(lhs_error);
+  if (rhs_error)
+    std::rethrow_exception(rhs_error);
+}
+
+/* for tests */
+static PTR(Expr) parse_str(std::string s) {
+  std::istringstream in(s);
+  return parse(in);
+}
+
+TEST_CASE( "parallel interp" ) {
+  ThreadPool pool(4);
+  std::string fib = "_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1 "
+                    "_else fib(fib)(x + -1) + fib(fib)(x + -2) _in fib(fib)(18)";
+  
+  SECTION( "same results as sequential" ) {
+    unsigned long forks = parallel_fork_count;
+    CHECK( interp_parallel(parse_str(fib), NEW(EmptyEnv)(), pool)->to_string() == "4181" );
+    CHECK( parallel_fork_count > forks );
+    CHECK( ! in_parallel_interp() );
+    
+    PTR(Expr) fact = parse_str("_let f = _fun (f) _fun (x) _if x == 1 _then 1 _else x * f(f)(x + -1) _in f(f)(20) == f(f)(20)");
+    CHECK( interp_parallel(fact, NEW(EmptyEnv)(), pool)->to_string() == "_true" );
+  }
+  
+  SECTION( "cheap operands stay sequential" ) {
+    unsigned long forks = parallel_fork_count;
+    CHECK( interp_parallel(parse_str("(1 + 2) * (3 + 4) == 21"), NEW(EmptyEnv)(), pool)->to_string() == "_true" );
+    CHECK( interp_parallel(parse_str("_let f = _fun (x) x _in f(1) + 2"), NEW(EmptyEnv)(), pool)->to_string() == "3" );
+    CHECK( parallel_fork_count == forks );
+  }
+  
+  SECTION( "errors" ) {
+    PTR(Expr) left_bad = parse_str("_let f = _fun (x) x _in f(y) + f(_true)");
+    CHECK_THROWS_WITH( interp_parallel(left_bad, NEW(EmptyEnv)(), pool), "free variable: y" );
+    PTR(Expr) both_bad = parse_str("_let f = _fun (x) x _in f(y) + f(z)");
+    CHECK_THROWS_WITH( interp_parallel(both_bad, NEW(EmptyEnv)(), pool), "free variable: y" );
+    PTR(Expr) right_bad = parse_str("_let f = _fun (x) x _in f(1) + f(_true)");
+    CHECK_THROWS_WITH( interp_parallel(right_bad, NEW(EmptyEnv)(), pool), "not a number" );
+    CHECK( ! in_parallel_interp() );
+  }
+
+#ifndef MSD_NO_BUDGET
+  SECTION( "limits" ) {
+    // forked operands charge the same budget, so the steps match a
+    // sequential evaluation's
+    EvalLimits unlimited = {0, 0, 0};
+    EvalUsage sequential, parallel;
+    interp_limited(parse_str(fib), NEW(EmptyEnv)(), unlimited, &sequential);
+    unsigned long forks = parallel_fork_count;
+    CHECK( interp_parallel(parse_str(fib), NEW(EmptyEnv)(), pool, unlimited, &parallel)->to_string() == "4181" );
+    CHECK( parallel_fork_count > forks );
+    CHECK( parallel.steps == sequential.steps );
+    CHECK( parallel.peak_bytes > 0 );
+
+    EvalLimits fuel = {sequential.steps / 2, 0, 0};
+    CHECK_THROWS_WITH( interp_parallel(parse_str(fib), NEW(EmptyEnv)(), pool, fuel), "out of fuel" );
+    EvalLimits memory = {0, 0, 1024};
+    CHECK_THROWS_WITH( interp_parallel(parse_str(fib), NEW(EmptyEnv)(), pool, memory), "memory limit exceeded" );
+    CHECK_THROWS_WITH( interp_parallel(parse_str("_let f = _fun (x) x(x) _in f(f) + f(f)"), NEW(EmptyEnv)(), pool),
+                      "recursion too deep" );
+    CHECK( current_budget == nullptr );
+  }
+#endif
+}
@@ -0,0 +1,61 @@
+//
+//  parallel.hpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/10/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef parallel_hpp
+#define parallel_hpp
+
+#include <atomic>
+#include "pointer.hpp"
+#include "expr.hpp"
+#include "budget.hpp"
+
+class Val;
+class Env;
+class ThreadPool;
+
+// Operands are forked only when both weigh at least this much
+// (see `Expr::weight`), and only this many forks deep
+extern unsigned parallel_min_weight;
+extern unsigned parallel_max_depth;
+
+// Number of operand pairs evaluated as forked tasks so far
+extern std::atomic<unsigned long> parallel_fork_count;
+
+// Evaluates `e` with the operands of `+`, `*` and `==` forked onto
+// `pool` when they are heavy enough. MSDScript has no side effects,
+// so the operands are independent. Forked operands share the
+// evaluation's `limits`, which are checked as by `interp_limited`;
+// fuel may be overrun by a few thousand steps per thread.
+PTR(Val) interp_parallel(PTR(Expr) e, PTR(Env) env, ThreadPool &pool,
+                         const EvalLimits &limits = EvalLimits(), EvalUsage *usage = nullptr);
+
+// Set while the current thread is inside `interp_parallel`, where
+// the tree may be evaluated by several threads at once
+extern thread_local ThreadPool *parallel_pool;
+
+inline bool in_parallel_interp() {
+  return parallel_pool != nullptr;
+}
+
+// Forks `rhs` as a task if both operands are heavy enough
+void interp_operands_parallel(const PTR(Expr) &lhs, const PTR(Expr) &rhs, const PTR(Env) &env,
+                              PTR(Val) &lhs_val, PTR(Val) &rhs_val);
+
+// Evaluates both operands of a binary expression, left then right,
+// or concurrently inside `interp_parallel`
+inline void interp_operands(const PTR(Expr) &lhs, const PTR(Expr) &rhs, const PTR(Env) &env,
+                            PTR(Val) &lhs_val, PTR(Val) &rhs_val) {
+  if (in_parallel_interp()) {
+    interp_operands_parallel(lhs, rhs, env, lhs_val, rhs_val);
+  } else {
+    lhs_val = lhs->interp(env);
+    rhs_val = rhs->interp(env);
+  }
+}
+
+#endif /* parallel_hpp */
@@ -11,6 +11,8 @@
 #include "expr.hpp"
 #include "value.hpp"
 #include "env.hpp"
+#include "bigint.hpp"
+#include "trace.hpp"
 
 #include <iostream>
 #include <sstream>
@@ -36,6 +38,8 @@ static PTR(Expr) parse_fun(std::istream &in);
 // and returns the parsed representation of that expression.
 // Throws `runtime_error` for parse errors.
 PTR(Expr) parse(std::istream &in) {
+  AllocPhaseScope phase(ALLOC_PARSE);
+  TraceSpan span("parse");
   PTR(Expr) e = parse_expr(in);
   
   char c = peek_after_spaces(in);
@@ -152,15 +156,24 @@ static PTR(Expr) parse_inner(std::istream &in) {
   return e;
 }
 
-// Parses a number, assuming that `in` starts with a digit.
+// Parses a number, assuming that `in` starts with a digit or `-`.
+// Literals too big for an `int` become `BigInt` numbers.
 static PTR(Expr) parse_number(std::istream &in) {
-  char c = peek_after_spaces(in);
-  if (c == '-')
-    c = in.get();
-  int num = 0;
-  in >> num;
-  if (c == '-')
-    num *= -1;
+  std::string digits;
+  if (peek_after_spaces(in) == '-') {
+    digits += in.get();
+    if (!isdigit(peek_after_spaces(in)))
+      throw std::runtime_error("expected a digit after -");
+  }
+  while (isdigit(in.peek()))
+    digits += in.get();
+  
+  // Nine digits always fit in an `int`
+  if (digits.size() - (digits[0] == '-') <= 9)
+    return NEW(NumExpr)(std::stoi(digits));
+  BigInt num = BigInt::from_string(digits);
+  if (num.fits_int())
+    return NEW(NumExpr)(num.to_int());
   return NEW(NumExpr)(num);
 }
 
@@ -298,6 +311,7 @@ TEST_CASE( "Object tests" ) {
   CHECK ( parse_str_error(" _fun (x) (x + 1) (2 ") == "expected a ) paren" );
   CHECK ( parse_str_error(" _if _true ") == "expected a _then keyword" );
   CHECK ( parse_str_error(" _if _true _then 8 ") == "expected an _else keyword" );
+  CHECK ( parse_str_error(" - x ") == "expected a digit after -" );
   
   CHECK( parse_str("10")->equals(NEW(NumExpr)(10)) );
   CHECK( parse_str("-10")->equals(NEW(NumExpr)(-10)) );
@@ -425,6 +439,19 @@ TEST_CASE( "Object tests" ) {
   
   CHECK( parse_str("f(10)(1)")->equals(NEW(CallExpr)(NEW(CallExpr)(NEW(VarExpr)("f"), NEW(NumExpr)(10)), NEW(NumExpr)(1))) );
   
+  CHECK( parse_str("- 10")->equals(NEW(NumExpr)(-10)) );
+  CHECK( parse_str("2147483647")->equals(NEW(NumExpr)(2147483647)) );
+  CHECK( parse_str("-2147483648")->equals(NEW(NumExpr)(-2147483647 - 1)) );
+  CHECK( parse_str("000000000012")->equals(NEW(NumExpr)(12)) );
+  CHECK( parse_str("2147483648")->equals(NEW(NumExpr)(BigInt::from_string("2147483648"))) );
+  CHECK( parse_str("-99999999999999999999")->to_string() == "-99999999999999999999" );
+  CHECK( parse_str("99999999999999999999 + 1")->interp(NEW(EmptyEnv)())->to_string()
+        == "100000000000000000000" );
+  CHECK( parse_str("99999999999999999999 * 99999999999999999999 + -1")->optimize()->to_string()
+        == "9999999999999999999800000000000000000000" );
+  CHECK( parse_str("_let x = 2000000000 _in x + x == 4000000000")->interp(NEW(EmptyEnv)())->to_string()
+        == "_true" );
+  
   CHECK( parse_str("(_true)")->equals(NEW(BoolExpr)(true)) );
   CHECK( parse_str("(_false)")->equals(NEW(BoolExpr)(false)) );
   CHECK( (parse_str("(_true+1)")->equals(NEW(AddExpr)(NEW(BoolExpr)(true), NEW(NumExpr)(1)))) );
@@ -0,0 +1,133 @@
+//
+//  perf_counters.cpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 5/11/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include "perf_counters.hpp"
+#include "catch.hpp"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int open_counter(uint64_t config, int group_fd) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.disabled = (group_fd == -1);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+PerfCounters::PerfCounters() {
+  static const uint64_t configs[COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES
+  };
+  for (int i = 0; i < COUNTERS; i++) {
+    fds[i] = open_counter(configs[i], (i == 0) ? -1 : fds[0]);
+    if (fds[i] < 0) {
+      std::string reason = strerror(errno);
+      for (int j = 0; j < i; j++)
+        close(fds[j]);
+      throw std::runtime_error("performance counters unavailable: " + reason);
+    }
+  }
+}
+
+PerfCounters::~PerfCounters() {
+  for (int i = 0; i < COUNTERS; i++)
+    close(fds[i]);
+}
+
+void PerfCounters::start() {
+  ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+PerfCounts PerfCounters::stop() {
+  ioctl(fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  // PERF_FORMAT_GROUP: the number of counters, then each value
+  uint64_t values[1 + COUNTERS] = {};
+  if (read(fds[0], values, sizeof(values)) != (ssize_t)sizeof(values))
+    throw std::runtime_error("can't read performance counters");
+  return PerfCounts{values[1], values[2], values[3], values[4]};
+}
+
+#else
+
+PerfCounters::PerfCounters() {
+  throw std::runtime_error("performance counters need Linux");
+}
+
+PerfCounters::~PerfCounters() {
+}
+
+void PerfCounters::start() {
+}
+
+PerfCounts PerfCounters::stop() {
+  return PerfCounts{0, 0, 0, 0};
+}
+
+#endif
+
+void print_perf_counts(std::ostream &out, const char *phase, const PerfCounts &counts,
+                       unsigned long nodes) {
+  std::ios::fmtflags flags = out.flags();
+  out << std::fixed << std::setprecision(2);
+  out << std::left << std::setw(10) << phase << std::right
+      << "cycles " << counts.cycles << ", instructions " << counts.instructions
+      << ", IPC " << (counts.cycles ? (double)counts.instructions / counts.cycles : 0.0)
+      << ", cache misses " << counts.cache_misses << ", branch misses " << counts.branch_misses;
+  if (nodes != 0) {
+    out << "; per node: cycles " << (double)counts.cycles / nodes
+        << ", cache misses " << (double)counts.cache_misses / nodes
+        << ", branch misses " << (double)counts.branch_misses / nodes;
+  }
+  out << std::endl;
+  out.flags(flags);
+}
+
+TEST_CASE( "PerfCounters" ) {
+  SECTION( "counting" ) {
+    // counters are often unavailable, in containers and VMs, so an
+    // explanation is as good as a count
+    try {
+      PerfCounters counters;
+      counters.start();
+      volatile unsigned long sum = 0;
+      for (int i = 0; i < 100000; i++)
+        sum = sum + i;
+      PerfCounts counts = counters.stop();
+      CHECK( counts.instructions >= 100000 );
+      CHECK( counts.cycles > 0 );
+    } catch (std::runtime_error &err) {
+      CHECK( std::string(err.what()).find("performance counters") == 0 );
+    }
+  }
+
+  SECTION( "report" ) {
+    std::ostringstream out;
+    print_perf_counts(out, "interp", PerfCounts{2000, 3000, 10, 20}, 100);
+    CHECK( out.str() == "interp    cycles 2000, instructions 3000, IPC 1.50, cache misses 10, branch misses 20;"
+                        " per node: cycles 20.00, cache misses 0.10, branch misses 0.20\n" );
+  }
+}
@@ -0,0 +1,47 @@
+//
+//  perf_counters.hpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 5/11/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef perf_counters_hpp
+#define perf_counters_hpp
+
+#include <cstdint>
+#include <ostream>
+
+struct PerfCounts {
+  uint64_t cycles;
+  uint64_t instructions;
+  uint64_t cache_misses;
+  uint64_t branch_misses;
+};
+
+/*
+ * Hardware counters for this thread, in user mode, read with Linux's
+ * `perf_event_open`. The four are scheduled as one group, so their
+ * counts cover the same stretch of execution.
+ * */
+class PerfCounters {
+public:
+  // Throws `runtime_error` where counters can't be opened: on other
+  // systems, in VMs without a PMU, or when perf_event_paranoid forbids
+  PerfCounters();
+  ~PerfCounters();
+
+  void start();
+  PerfCounts stop();
+
+private:
+  static const int COUNTERS = 4;
+  int fds[COUNTERS];
+};
+
+// One line for `phase`: the counts, instructions per cycle, and when
+// `nodes` isn't 0, counts per node evaluated
+void print_perf_counts(std::ostream &out, const char *phase, const PerfCounts &counts,
+                       unsigned long nodes);
+
+#endif /* perf_counters_hpp */
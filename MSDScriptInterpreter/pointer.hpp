@@ -17,9 +17,20 @@
 
 #else
 
-#define NEW(T) std::make_shared<T>
+#include "alloc.hpp"
+
+// allocations are charged to the current `MemoryAccount`, if any
+#define NEW(T) make_accounted<T>
+
+// `MSD_COUNT_REFS` counts reference count updates (see counted_ptr.hpp)
+#ifdef MSD_COUNT_REFS
+#include "counted_ptr.hpp"
+#define PTR(T) CountedPtr<T>
+#define CAST(T) counted_cast<T>
+#else
 #define PTR(T) std::shared_ptr<T>
 #define CAST(T) std::dynamic_pointer_cast<T>
+#endif
 
 #endif
 
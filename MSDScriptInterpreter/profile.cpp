@@ -0,0 +1,195 @@
+//
+//  profile.cpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 5/6/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+#include <utility>
+#include "profile.hpp"
+#include "catch.hpp"
+#include "expr.hpp"
+#include "env.hpp"
+#include "parse.hpp"
+#include "value.hpp"
+
+static long long now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Profiler::Profiler() {
+}
+
+void Profiler::enter(std::vector<Frame> &frames, Stats *stats) {
+  stats->calls++;
+  stats->active++;
+  frames.push_back(Frame{stats, now_ns(), 0});
+}
+
+void Profiler::leave(std::vector<Frame> &frames) {
+  Frame frame = frames.back();
+  frames.pop_back();
+  long long elapsed = now_ns() - frame.start_ns;
+  frame.stats->exclusive_ns += elapsed - frame.child_ns;
+  if (--frame.stats->active == 0)
+    frame.stats->inclusive_ns += elapsed;
+  if (!frames.empty())
+    frames.back().child_ns += elapsed;
+}
+
+void Profiler::enter_node(NodeKind kind) {
+  enter(nodes, &node_stats[kind]);
+}
+
+void Profiler::leave_node(NodeKind kind) {
+  leave(nodes);
+}
+
+void Profiler::enter_function(Expr *body) {
+  enter(functions, &function_stats[body]);
+}
+
+void Profiler::leave_function(Expr *body) {
+  leave(functions);
+}
+
+std::unordered_map<Expr *, std::string> function_labels(const PTR(Expr) &program) {
+  std::unordered_map<Expr *, std::string> labels;
+  // iterative, like printing, so deep programs can be profiled
+  struct Item {
+    Expr *e;
+    std::string prefix;
+    // the name a `_let` binds `e` to, if it's the `_let`'s value
+    std::string bound_name;
+  };
+  std::vector<Item> pending;
+  pending.push_back(Item{&*program, "", ""});
+  while (!pending.empty()) {
+    Item item = std::move(pending.back());
+    pending.pop_back();
+    Expr *e = item.e;
+    if (LetExpr *let = dynamic_cast<LetExpr *>(e)) {
+      pending.push_back(Item{&*let->body, item.prefix, ""});
+      pending.push_back(Item{&*let->rhs, item.prefix, item.prefix + let->name.str()});
+    } else if (FunExpr *fun = dynamic_cast<FunExpr *>(e)) {
+      std::string label = item.bound_name;
+      if (label.empty())
+        label = item.prefix + "_fun (" + fun->formal_arg.str() + ")";
+      labels[&*fun->body] = label;
+      pending.push_back(Item{&*fun->body, label + "/", ""});
+    } else if (AddExpr *add = dynamic_cast<AddExpr *>(e)) {
+      pending.push_back(Item{&*add->lhs, item.prefix, ""});
+      pending.push_back(Item{&*add->rhs, item.prefix, ""});
+    } else if (MultExpr *mult = dynamic_cast<MultExpr *>(e)) {
+      pending.push_back(Item{&*mult->lhs, item.prefix, ""});
+      pending.push_back(Item{&*mult->rhs, item.prefix, ""});
+    } else if (CompExpr *comp = dynamic_cast<CompExpr *>(e)) {
+      pending.push_back(Item{&*comp->lhs, item.prefix, ""});
+      pending.push_back(Item{&*comp->rhs, item.prefix, ""});
+    } else if (IfExpr *if_expr = dynamic_cast<IfExpr *>(e)) {
+      pending.push_back(Item{&*if_expr->test_part, item.prefix, ""});
+      pending.push_back(Item{&*if_expr->then_part, item.prefix, ""});
+      pending.push_back(Item{&*if_expr->else_part, item.prefix, ""});
+    } else if (CallExpr *call = dynamic_cast<CallExpr *>(e)) {
+      pending.push_back(Item{&*call->to_be_called, item.prefix, ""});
+      pending.push_back(Item{&*call->actual_arg, item.prefix, ""});
+    }
+  }
+  return labels;
+}
+
+void Profiler::name_functions(const PTR(Expr) &program) {
+  function_names = function_labels(program);
+}
+
+struct ReportRow {
+  std::string name;
+  const Profiler::Stats *stats;
+};
+
+static void print_rows(std::ostream &out, const char *heading, std::vector<ReportRow> rows) {
+  std::sort(rows.begin(), rows.end(), [](const ReportRow &a, const ReportRow &b) {
+    return a.stats->exclusive_ns > b.stats->exclusive_ns;
+  });
+  size_t width = 16;
+  for (const ReportRow &row : rows)
+    width = std::max(width, row.name.size() + 2);
+  out << std::left << std::setw((int)width) << heading << std::right << std::setw(12) << "calls"
+      << std::setw(16) << "inclusive ms" << std::setw(16) << "exclusive ms" << std::endl;
+  for (const ReportRow &row : rows) {
+    out << std::left << std::setw((int)width) << row.name << std::right << std::setw(12) << row.stats->calls
+        << std::setw(16) << row.stats->inclusive_ns / 1e6 << std::setw(16) << row.stats->exclusive_ns / 1e6
+        << std::endl;
+  }
+}
+
+void Profiler::report(std::ostream &out) {
+  std::ios::fmtflags flags = out.flags();
+  out << std::fixed << std::setprecision(3);
+
+  std::vector<ReportRow> rows;
+  for (int kind = 0; kind < NODE_KINDS; kind++) {
+    if (node_stats[kind].calls > 0)
+      rows.push_back(ReportRow{node_kind_name((NodeKind)kind), &node_stats[kind]});
+  }
+  print_rows(out, "node kind", rows);
+
+  rows.clear();
+  for (const auto &entry : function_stats) {
+    auto name = function_names.find(entry.first);
+    rows.push_back(ReportRow{name != function_names.end() ? name->second : "(unnamed function)",
+                             &entry.second});
+  }
+  if (!rows.empty()) {
+    out << std::endl;
+    print_rows(out, "function", rows);
+  }
+  out.flags(flags);
+}
+
+#ifndef MSD_NO_HOOKS
+TEST_CASE( "Profiler" ) {
+  std::istringstream in("_let fib = _fun (fib) _fun (x)"
+                        "  _if x == 0 _then 1"
+                        "  _else _if x == 1 _then 1"
+                        "  _else fib(fib)(x + -1) + fib(fib)(x + -2)"
+                        " _in _let twice = _fun (y) y * 2"
+                        " _in twice(fib(fib)(10))");
+  PTR(Expr) e = parse(in);
+  Profiler profiler;
+  profiler.name_functions(e);
+  eval_hooks = &profiler;
+  PTR(Val) result = e->interp(NEW(EmptyEnv)());
+  eval_hooks = nullptr;
+  CHECK( result->to_string() == "178" );
+
+  // fib(10) makes 177 calls of the inner function, each through a call
+  // of the outer one, plus the call of `twice`
+  CHECK( profiler.node_stats[CALL_NODE].calls == 177 * 2 + 1 );
+  CHECK( profiler.node_stats[LET_NODE].calls == 2 );
+  CHECK( profiler.function_stats.size() == 3 );
+  CHECK( profiler.function_stats[&*CAST(FunExpr)(CAST(LetExpr)(e)->rhs)->body].calls == 177 );
+
+  // exclusive times add up to the whole evaluation
+  long long exclusive = 0;
+  for (int kind = 0; kind < NODE_KINDS; kind++)
+    exclusive += profiler.node_stats[kind].exclusive_ns;
+  CHECK( exclusive == profiler.node_stats[LET_NODE].inclusive_ns );
+  for (int kind = 0; kind < NODE_KINDS; kind++)
+    CHECK( profiler.node_stats[kind].inclusive_ns <= exclusive );
+
+  std::ostringstream report;
+  profiler.report(report);
+  CHECK( report.str().find("\ncall ") != std::string::npos );
+  CHECK( report.str().find("\nfib/_fun (x) ") != std::string::npos );
+  CHECK( report.str().find("\nfib ") != std::string::npos );
+  CHECK( report.str().find("\ntwice ") != std::string::npos );
+  CHECK( report.str().find("unnamed") == std::string::npos );
+}
+#endif
@@ -0,0 +1,73 @@
+//
+//  profile.hpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 5/6/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef profile_hpp
+#define profile_hpp
+
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "hooks.hpp"
+#include "pointer.hpp"
+
+// Labels for the functions in `program`, by their bodies: the name a
+// `_let` binds them to, or else their argument, prefixed with the
+// label of the function they're in (as in `fib/_fun (x)`)
+std::unordered_map<Expr *, std::string> function_labels(const PTR(Expr) &program);
+
+/*
+ * Counts evaluations of each node kind and each function, with their
+ * inclusive time (including everything they evaluate) and exclusive
+ * time (their own work only). A recursive function's inclusive time
+ * counts only its outermost application, so it is never more than
+ * the total.
+ * */
+class Profiler : public EvalHooks {
+public:
+  Profiler();
+
+  void enter_node(NodeKind kind);
+  void leave_node(NodeKind kind);
+  void enter_function(Expr *body);
+  void leave_function(Expr *body);
+
+  // Labels the functions in `program` for the report (see
+  // `function_labels`)
+  void name_functions(const PTR(Expr) &program);
+
+  // Writes node kinds and then functions, most exclusive time first
+  void report(std::ostream &out);
+
+  struct Stats {
+    unsigned long calls = 0;
+    long long inclusive_ns = 0;
+    long long exclusive_ns = 0;
+    // applications in progress, so only the outermost adds inclusive time
+    unsigned active = 0;
+  };
+
+  Stats node_stats[NODE_KINDS];
+  std::unordered_map<Expr *, Stats> function_stats;
+
+private:
+  struct Frame {
+    Stats *stats;
+    long long start_ns;
+    long long child_ns;
+  };
+
+  std::vector<Frame> nodes;
+  std::vector<Frame> functions;
+  std::unordered_map<Expr *, std::string> function_names;
+
+  void enter(std::vector<Frame> &frames, Stats *stats);
+  void leave(std::vector<Frame> &frames);
+};
+
+#endif /* profile_hpp */
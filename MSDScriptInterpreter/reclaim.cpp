@@ -0,0 +1,91 @@
+//
+//  reclaim.cpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/29/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include <vector>
+#include "reclaim.hpp"
+#include "catch.hpp"
+#include "expr.hpp"
+#include "env.hpp"
+#include "value.hpp"
+
+typedef std::vector<std::shared_ptr<void>> Worklist;
+
+// Plain pointers, so they stay usable while thread-local and static
+// objects are destroyed (a static `ProgramCache` frees trees at exit)
+static thread_local Worklist *worklist = nullptr;
+static thread_local bool draining = false;
+
+struct WorklistOwner {
+  ~WorklistOwner() {
+    delete worklist;
+    worklist = nullptr;
+  }
+};
+static thread_local WorklistOwner worklist_owner;
+
+void defer_destroy(std::shared_ptr<void> p) {
+  if (worklist == nullptr) {
+    (void)&worklist_owner;
+    worklist = new Worklist;
+  }
+  try {
+    worklist->push_back(std::move(p));
+  } catch (...) {
+    // out of memory: fall back to destroying it here
+    p.reset();
+    return;
+  }
+  if (draining)
+    return;
+
+  draining = true;
+  while (!worklist->empty()) {
+    std::shared_ptr<void> next = std::move(worklist->back());
+    worklist->pop_back();
+    next.reset();
+  }
+  draining = false;
+}
+
+TEST_CASE( "iterative destruction" ) {
+  // each of these would overflow the stack if freed recursively
+  const int DEPTH = 1000000;
+
+  SECTION( "deep expression" ) {
+    PTR(Expr) e = NEW(NumExpr)(0);
+    for (int i = 0; i < DEPTH; i++)
+      e = NEW(AddExpr)(e, NEW(VarExpr)("x"));
+    e = nullptr;
+    CHECK( e == nullptr );
+  }
+
+  SECTION( "long environment" ) {
+    PTR(Env) env = NEW(EmptyEnv)();
+    for (int i = 0; i < DEPTH; i++)
+      env = NEW(ExtendedEnv)("x", NumVal::make(i % 10), env);
+    CHECK( env->lookup("x")->equals(NumVal::make(9)) );
+    env = nullptr;
+  }
+
+  SECTION( "closures capturing closures" ) {
+    PTR(Env) env = NEW(EmptyEnv)();
+    PTR(Expr) body = NEW(VarExpr)("f");
+    for (int i = 0; i < DEPTH; i++)
+      env = NEW(ExtendedEnv)("f", NEW(FunVal)("y", body, env), NEW(EmptyEnv)());
+    body = nullptr;
+    env = nullptr;
+  }
+
+  SECTION( "shared children survive" ) {
+    PTR(Expr) shared = NEW(VarExpr)("y");
+    PTR(Expr) e = NEW(AddExpr)(shared, NEW(NumExpr)(1));
+    e = nullptr;
+    CHECK( shared->to_string() == "y" );
+    CHECK( shared.use_count() == 1 );
+  }
+}
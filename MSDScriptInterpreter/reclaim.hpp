@@ -0,0 +1,29 @@
+//
+//  reclaim.hpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/29/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef reclaim_hpp
+#define reclaim_hpp
+
+#include <memory>
+#include <utility>
+#include "pointer.hpp"
+
+// Destroys `p` now, or, if this thread is already destroying
+// something, after the current object is done
+void defer_destroy(std::shared_ptr<void> p);
+
+// For destructors: hands `p` to the thread's worklist when dropping it
+// would destroy its object, so that freeing a deep tree or a long
+// environment chain takes constant stack depth instead of recursing
+template <class T>
+inline void destroy_iteratively(PTR(T) &p) {
+  if (p.use_count() == 1)
+    defer_destroy(std::move(p));
+}
+
+#endif /* reclaim_hpp */
@@ -0,0 +1,199 @@
+//
+//  sampler.cpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 5/8/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include <cerrno>
+#include <sstream>
+#include <stdexcept>
+#include <sys/time.h>
+#include "sampler.hpp"
+#include "catch.hpp"
+#include "expr.hpp"
+#include "env.hpp"
+#include "parse.hpp"
+#include "profile.hpp"
+#include "value.hpp"
+
+static std::atomic<StackSampler *> active_sampler(nullptr);
+
+StackSampler::StackSampler(size_t capacity)
+: EvalHooks(false), ring(std::max(capacity, (size_t)2)), written(0), read(0), dropped_count(0), depth(0) {
+  this->running = false;
+}
+
+StackSampler::~StackSampler() {
+  stop();
+}
+
+void StackSampler::start(long interval_us) {
+  StackSampler *expected = nullptr;
+  if (!active_sampler.compare_exchange_strong(expected, this))
+    throw std::runtime_error("another sampler is running");
+  thread = pthread_self();
+  running = true;
+  
+  struct sigaction action;
+  action.sa_handler = on_signal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGPROF, &action, &saved_action);
+  
+  struct itimerval timer;
+  timer.it_interval.tv_sec = interval_us / 1000000;
+  timer.it_interval.tv_usec = interval_us % 1000000;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
+void StackSampler::stop() {
+  if (!running)
+    return;
+  struct itimerval timer = {};
+  setitimer(ITIMER_PROF, &timer, nullptr);
+  sigaction(SIGPROF, &saved_action, nullptr);
+  active_sampler.store(nullptr);
+  running = false;
+  drain();
+}
+
+void StackSampler::on_signal(int signal) {
+  int saved_errno = errno;
+  StackSampler *sampler = active_sampler.load();
+  // the timer signals whichever thread is running; only the sampled
+  // thread's stack is meaningful
+  if (sampler != nullptr && pthread_equal(pthread_self(), sampler->thread))
+    sampler->record_sample();
+  errno = saved_errno;
+}
+
+void StackSampler::enter_function(Expr *body) {
+  int d = depth.load(std::memory_order_relaxed);
+  if (d < MAX_SAMPLE_DEPTH)
+    stack[d] = body;
+  // the signal runs on this thread, so only the compiler can reorder
+  std::atomic_signal_fence(std::memory_order_release);
+  depth.store(d + 1, std::memory_order_relaxed);
+  
+  if (written.load(std::memory_order_relaxed) - read.load(std::memory_order_relaxed) > ring.size() / 2)
+    drain();
+}
+
+void StackSampler::leave_function(Expr *body) {
+  depth.store(depth.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+}
+
+void StackSampler::record_sample() {
+  size_t w = written.load(std::memory_order_relaxed);
+  if (w - read.load(std::memory_order_acquire) >= ring.size()) {
+    dropped_count.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  Sample &sample = ring[w % ring.size()];
+  int d = depth.load(std::memory_order_relaxed);
+  std::atomic_signal_fence(std::memory_order_acquire);
+  sample.depth = std::min(d, (int)MAX_SAMPLE_DEPTH);
+  for (int i = 0; i < sample.depth; i++)
+    sample.frames[i] = stack[i];
+  written.store(w + 1, std::memory_order_release);
+}
+
+void StackSampler::drain() {
+  size_t end = written.load(std::memory_order_acquire);
+  size_t r = read.load(std::memory_order_relaxed);
+  for (; r != end; r++) {
+    const Sample &sample = ring[r % ring.size()];
+    counts[std::vector<Expr *>(sample.frames, sample.frames + sample.depth)]++;
+  }
+  read.store(r, std::memory_order_release);
+}
+
+unsigned long StackSampler::samples() {
+  drain();
+  unsigned long total = 0;
+  for (const auto &entry : counts)
+    total += entry.second;
+  return total;
+}
+
+unsigned long StackSampler::dropped() {
+  return dropped_count.load();
+}
+
+void StackSampler::write_folded(std::ostream &out, const std::unordered_map<Expr *, std::string> &labels) {
+  drain();
+  for (const auto &entry : counts) {
+    out << "program";
+    for (Expr *body : entry.first) {
+      auto label = labels.find(body);
+      out << ";" << (label != labels.end() ? label->second : "(unnamed function)");
+    }
+    out << " " << entry.second << "\n";
+  }
+  out.flush();
+}
+
+#ifndef MSD_NO_HOOKS
+TEST_CASE( "StackSampler" ) {
+  std::istringstream in("_let fib = _fun (fib) _fun (x)"
+                        "  _if x == 0 _then 1"
+                        "  _else _if x == 1 _then 1"
+                        "  _else fib(fib)(x + -1) + fib(fib)(x + -2)"
+                        " _in fib(fib)(3)");
+  PTR(Expr) e = parse(in);
+  std::unordered_map<Expr *, std::string> labels = function_labels(e);
+
+  SECTION( "folded stacks" ) {
+    // samples by hand at the innermost frames
+    class SampleInnermost : public StackSampler {
+    public:
+      int level = 0;
+      void enter_function(Expr *body) {
+        StackSampler::enter_function(body);
+        level++;
+      }
+      void leave_function(Expr *body) {
+        if (level == 3)
+          record_sample();
+        level--;
+        StackSampler::leave_function(body);
+      }
+    };
+    SampleInnermost sampler;
+    eval_hooks = &sampler;
+    CHECK( e->interp(NEW(EmptyEnv)())->to_string() == "3" );
+    eval_hooks = nullptr;
+    
+    std::ostringstream out;
+    sampler.write_folded(out, labels);
+    // fib(3) applies `fib(fib)` and its result in turn, three deep
+    CHECK( out.str().find("program;fib/_fun (x);fib/_fun (x);fib 2\n") != std::string::npos );
+    CHECK( out.str().find("program;fib/_fun (x);fib/_fun (x);fib/_fun (x) 2\n") != std::string::npos );
+    CHECK( sampler.samples() == 4 );
+  }
+
+  SECTION( "timer" ) {
+    std::istringstream in2("_let fib = _fun (fib) _fun (x)"
+                           "  _if x == 0 _then 1"
+                           "  _else _if x == 1 _then 1"
+                           "  _else fib(fib)(x + -1) + fib(fib)(x + -2)"
+                           " _in fib(fib)(22)");
+    PTR(Expr) e2 = parse(in2);
+    StackSampler sampler;
+    eval_hooks = &sampler;
+    sampler.start(200);
+    CHECK_THROWS_WITH( StackSampler().start(200), "another sampler is running" );
+    e2->interp(NEW(EmptyEnv)());
+    sampler.stop();
+    eval_hooks = nullptr;
+    CHECK( sampler.samples() > 0 );
+    
+    std::ostringstream out;
+    sampler.write_folded(out, function_labels(e2));
+    CHECK( out.str().find("program;fib/_fun (x);fib/_fun (x);") != std::string::npos );
+  }
+}
+#endif
@@ -0,0 +1,84 @@
+//
+//  sampler.hpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 5/8/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef sampler_hpp
+#define sampler_hpp
+
+#include <atomic>
+#include <map>
+#include <ostream>
+#include <pthread.h>
+#include <signal.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "hooks.hpp"
+
+/*
+ * A sampling profiler. It keeps the stack of functions being applied
+ * on the thread that starts it, and a `SIGPROF` timer copies that
+ * stack into a preallocated ring buffer, so the signal handler never
+ * allocates. The buffer is emptied into counts per distinct stack
+ * from ordinary code: on function entry once it is half full, and
+ * when sampling stops. One sampler can run at a time.
+ * */
+class StackSampler : public EvalHooks {
+public:
+  // deeper stacks keep their outermost frames
+  static const int MAX_SAMPLE_DEPTH = 128;
+
+  StackSampler(size_t capacity = 2048);
+  ~StackSampler();
+
+  // Samples every `interval_us` microseconds of CPU time
+  void start(long interval_us);
+  void stop();
+
+  void enter_node(NodeKind kind) {}
+  void leave_node(NodeKind kind) {}
+  void enter_function(Expr *body);
+  void leave_function(Expr *body);
+
+  // Copies the current stack into the buffer; what the signal does
+  void record_sample();
+
+  // Writes one line per distinct stack, outermost function first, as
+  // `frame;frame;frame count`: the folded format flame graph tools
+  // read. `labels` names functions by their bodies.
+  void write_folded(std::ostream &out, const std::unordered_map<Expr *, std::string> &labels);
+
+  unsigned long samples();
+  // samples lost because the buffer was full
+  unsigned long dropped();
+
+private:
+  struct Sample {
+    int depth;
+    Expr *frames[MAX_SAMPLE_DEPTH];
+  };
+
+  std::vector<Sample> ring;
+  // samples ever written, and ever read back out
+  std::atomic<size_t> written;
+  std::atomic<size_t> read;
+  std::atomic<unsigned long> dropped_count;
+
+  Expr *stack[MAX_SAMPLE_DEPTH];
+  std::atomic<int> depth;
+
+  pthread_t thread;
+  bool running;
+  struct sigaction saved_action;
+
+  std::map<std::vector<Expr *>, unsigned long> counts;
+
+  void drain();
+  static void on_signal(int signal);
+};
+
+#endif /* sampler_hpp */
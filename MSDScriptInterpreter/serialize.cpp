@@ -0,0 +1,442 @@
+//
+//  serialize.cpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/22/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "serialize.hpp"
+#include "expr.hpp"
+#include "bigint.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+#include "trace.hpp"
+
+void append_varint(std::string &out, uint64_t n) {
+  while (n >= 0x80) {
+    out += (char)(n | 0x80);
+    n >>= 7;
+  }
+  out += (char)n;
+}
+
+void append_int(std::string &out, long long n) {
+  append_varint(out, ((uint64_t)n << 1) ^ (uint64_t)(n >> 63));
+}
+
+void append_big(std::string &out, const BigInt &big) {
+  append_varint(out, big.negative);
+  append_varint(out, big.mag.size());
+  for (uint32_t limb : big.mag)
+    append_varint(out, limb);
+}
+
+ByteReader::ByteReader(const char *data, size_t size) {
+  this->pos = (const unsigned char *)data;
+  this->end = pos + size;
+}
+
+void ByteReader::bad() {
+  throw std::runtime_error("bad compiled program");
+}
+
+uint64_t ByteReader::read_varint() {
+  uint64_t n = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (pos == end)
+      bad();
+    unsigned char byte = *pos++;
+    n |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return n;
+  }
+  bad();
+  return 0;
+}
+
+long long ByteReader::read_int() {
+  uint64_t n = read_varint();
+  return (long long)(n >> 1) ^ -(long long)(n & 1);
+}
+
+BigInt ByteReader::read_big() {
+  uint64_t negative = read_varint();
+  uint64_t limbs = read_varint();
+  // every limb takes at least a byte
+  if (negative > 1 || limbs > (uint64_t)(end - pos))
+    bad();
+  BigInt big;
+  for (uint64_t i = 0; i < limbs; i++) {
+    uint64_t limb = read_varint();
+    if (limb > UINT32_MAX)
+      bad();
+    big.mag.push_back((uint32_t)limb);
+  }
+  // no high zero limbs, and so no negative zero
+  if (limbs == 0 ? negative != 0 : big.mag.back() == 0)
+    bad();
+  big.negative = negative != 0;
+  return big;
+}
+
+const unsigned char *ByteReader::read_bytes(uint64_t n) {
+  if (n > (uint64_t)(end - pos))
+    bad();
+  const unsigned char *bytes = pos;
+  pos += n;
+  return bytes;
+}
+
+bool ByteReader::at_end() {
+  return pos == end;
+}
+
+void ExprWriter::write_tag(ExprTag tag) {
+  tree += (char)tag;
+}
+
+void ExprWriter::write_varint(uint64_t n) {
+  append_varint(tree, n);
+}
+
+void ExprWriter::write_int(long long n) {
+  append_int(tree, n);
+}
+
+void ExprWriter::write_big(const BigInt &big) {
+  append_big(tree, big);
+}
+
+void ExprWriter::write_name(Symbol name) {
+  auto found = name_index.find(name);
+  if (found != name_index.end()) {
+    append_varint(tree, found->second);
+    return;
+  }
+  uint64_t index = names.size();
+  names.push_back(name);
+  name_index[name] = index;
+  append_varint(tree, index);
+}
+
+std::string ExprWriter::finish() {
+  std::string out(COMPILED_MAGIC, sizeof(COMPILED_MAGIC));
+  out += (char)COMPILED_VERSION;
+  append_varint(out, names.size());
+  for (Symbol name : names) {
+    append_varint(out, name.str().size());
+    out += name.str();
+  }
+  return out + tree;
+}
+
+std::string serialize_expr(PTR(Expr) e) {
+  ExprWriter out;
+  e->serialize(out);
+  return out.finish();
+}
+
+/*
+ * Reads a compiled program in place, without copying it first
+ * */
+class ExprReader : public ByteReader {
+public:
+  ExprReader(const char *data, size_t size) : ByteReader(data, size) {
+  }
+
+  PTR(Expr) read_program() {
+    if (end - pos < (long)sizeof(COMPILED_MAGIC) + 1
+        || memcmp(pos, COMPILED_MAGIC, sizeof(COMPILED_MAGIC)) != 0)
+      throw std::runtime_error("not a compiled program");
+    pos += sizeof(COMPILED_MAGIC);
+    if (*pos++ != COMPILED_VERSION)
+      throw std::runtime_error("unsupported compiled program version");
+
+    uint64_t count = read_varint();
+    for (uint64_t i = 0; i < count; i++) {
+      uint64_t length = read_varint();
+      names.push_back(Symbol(std::string((const char *)read_bytes(length), length)));
+    }
+
+    PTR(Expr) e = read_expr();
+    if (!at_end())
+      bad();
+    return e;
+  }
+
+private:
+  // interned once here, so each node only copies a symbol
+  std::vector<Symbol> names;
+
+  Symbol read_name() {
+    uint64_t index = read_varint();
+    if (index >= names.size())
+      bad();
+    return names[index];
+  }
+
+  // A node whose operands are still being read
+  struct Pending {
+    unsigned char tag;
+    Symbol name;
+    // the size of `done` once every operand is read
+    size_t complete_at;
+  };
+
+  // Reads the tree with an explicit stack, so a deeply nested program
+  // can't overflow the native one
+  PTR(Expr) read_expr() {
+    std::vector<Pending> pending;
+    std::vector<PTR(Expr)> done;
+    pending.reserve(64);
+    done.reserve(64);
+    do {
+      if (pos == end)
+        bad();
+      unsigned char tag = *pos++;
+      switch (tag) {
+        case NUM_TAG: {
+          long long n = read_int();
+          if (n < INT_MIN || n > INT_MAX)
+            bad();
+          done.push_back(NEW(NumExpr)((int)n));
+          break;
+        }
+        case BIG_NUM_TAG:
+          done.push_back(NEW(NumExpr)(read_big()));
+          break;
+        case VAR_TAG:
+          done.push_back(NEW(VarExpr)(read_name()));
+          break;
+        case TRUE_TAG:
+          done.push_back(NEW(BoolExpr)(true));
+          break;
+        case FALSE_TAG:
+          done.push_back(NEW(BoolExpr)(false));
+          break;
+        case ADD_TAG:
+        case MULT_TAG:
+        case COMP_TAG:
+        case CALL_TAG:
+          pending.push_back(Pending { tag, Symbol(), done.size() + 2 });
+          break;
+        case IF_TAG:
+          pending.push_back(Pending { tag, Symbol(), done.size() + 3 });
+          break;
+        case LET_TAG:
+          pending.push_back(Pending { tag, read_name(), done.size() + 2 });
+          break;
+        case FUN_TAG:
+          pending.push_back(Pending { tag, read_name(), done.size() + 1 });
+          break;
+        default:
+          bad();
+      }
+
+      // builds each node whose operands are now all read
+      while (!pending.empty() && done.size() == pending.back().complete_at) {
+        Pending node = pending.back();
+        pending.pop_back();
+        done.push_back(build(node, done));
+      }
+    } while (!pending.empty());
+    return done.back();
+  }
+
+  // Takes `node`'s operands off the end of `done`
+  static PTR(Expr) build(const Pending &node, std::vector<PTR(Expr)> &done) {
+    size_t first = done.size() - (node.tag == IF_TAG ? 3 : node.tag == FUN_TAG ? 1 : 2);
+    PTR(Expr) *operand = &done[first];
+    PTR(Expr) e;
+    switch (node.tag) {
+      case ADD_TAG:
+        e = NEW(AddExpr)(std::move(operand[0]), std::move(operand[1]));
+        break;
+      case MULT_TAG:
+        e = NEW(MultExpr)(std::move(operand[0]), std::move(operand[1]));
+        break;
+      case COMP_TAG:
+        e = NEW(CompExpr)(std::move(operand[0]), std::move(operand[1]));
+        break;
+      case CALL_TAG:
+        e = NEW(CallExpr)(std::move(operand[0]), std::move(operand[1]));
+        break;
+      case IF_TAG:
+        e = NEW(IfExpr)(std::move(operand[0]), std::move(operand[1]), std::move(operand[2]));
+        break;
+      case LET_TAG:
+        e = NEW(LetExpr)(node.name, std::move(operand[0]), std::move(operand[1]));
+        break;
+      default:
+        e = NEW(FunExpr)(node.name, std::move(operand[0]));
+        break;
+    }
+    done.resize(first);
+    return e;
+  }
+};
+
+PTR(Expr) deserialize_expr(const char *data, size_t size) {
+  AllocPhaseScope phase(ALLOC_PARSE);
+  TraceSpan span("load");
+  return ExprReader(data, size).read_program();
+}
+
+bool file_has_magic(const std::string &path, const char *magic) {
+  char start[4];
+  FILE *f = fopen(path.c_str(), "rb");
+  if (f == nullptr)
+    return false;
+  bool found = fread(start, 1, sizeof(start), f) == sizeof(start)
+    && memcmp(start, magic, sizeof(start)) == 0;
+  fclose(f);
+  return found;
+}
+
+bool is_compiled_file(const std::string &path) {
+  return file_has_magic(path, COMPILED_MAGIC);
+}
+
+PTR(Expr) load_compiled(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("cannot open " + path);
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    throw std::runtime_error("not a compiled program");
+  }
+  void *data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    throw std::runtime_error("cannot map " + path);
+
+  try {
+    PTR(Expr) e = deserialize_expr((const char *)data, (size_t)st.st_size);
+    munmap(data, (size_t)st.st_size);
+    return e;
+  } catch (...) {
+    munmap(data, (size_t)st.st_size);
+    throw;
+  }
+}
+
+/* for tests */
+static PTR(Expr) parse_str(std::string s) {
+  std::istringstream in(s);
+  return parse(in);
+}
+
+static PTR(Expr) round_trip(PTR(Expr) e) {
+  std::string bytes = serialize_expr(e);
+  return deserialize_expr(bytes.data(), bytes.size());
+}
+
+TEST_CASE( "serialize" ) {
+  SECTION( "round trip" ) {
+    const char *programs[] = {
+      "0",
+      "-2147483648",
+      "2147483647 + -7",
+      "123456789012345678901234567890 * -98765432109876543210",
+      "_let x = 5 _in x * (x + 1)",
+      "_if 1 == 2 _then _true _else _false",
+      "_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1"
+      " _else fib(fib)(x + -2) + fib(fib)(x + -1) _in fib(fib)(10)"
+    };
+    for (const char *program : programs) {
+      PTR(Expr) e = parse_str(program);
+      PTR(Expr) loaded = round_trip(e);
+      CHECK( loaded->equals(e) );
+      CHECK( loaded->to_string() == e->to_string() );
+      CHECK( loaded->weight == e->weight );
+    }
+  }
+
+  SECTION( "compact" ) {
+    // repeated names are stored once; small numbers take one byte
+    std::string bytes = serialize_expr(parse_str("_let counter = 1 _in counter + counter + counter"));
+    CHECK( bytes.size() == 5 + 1 + 1 + 7 + 12 );
+    CHECK( serialize_expr(parse_str("-1")).size() == 5 + 1 + 2 );
+  }
+
+  SECTION( "rejects bad data" ) {
+    std::string bytes = serialize_expr(parse_str("_let x = 1 _in x + 2"));
+    CHECK_THROWS_WITH( deserialize_expr(bytes.data(), bytes.size() - 1), "bad compiled program" );
+    CHECK_THROWS_WITH( deserialize_expr((bytes + "x").data(), bytes.size() + 1), "bad compiled program" );
+    CHECK_THROWS_WITH( deserialize_expr("1 + 2", 5), "not a compiled program" );
+    std::string bad_tag = bytes;
+    bad_tag[bad_tag.size() - 1] = 99;
+    bad_tag[bad_tag.size() - 2] = 99;
+    CHECK_THROWS( deserialize_expr(bad_tag.data(), bad_tag.size()) );
+
+    // big numbers out of normal form: a limb over 32 bits, a high
+    // zero limb, and negative zero
+    std::string header = std::string(COMPILED_MAGIC, sizeof(COMPILED_MAGIC)) + (char)COMPILED_VERSION + '\0';
+    std::string bad_bigs[] = {
+      std::string("\x00\x01\x80\x80\x80\x80\x10", 7),
+      std::string("\x00\x02\x01\x00", 4),
+      std::string("\x01\x00", 2)
+    };
+    for (const std::string &big : bad_bigs) {
+      std::string bad_big = header + (char)BIG_NUM_TAG + big;
+      CHECK_THROWS_WITH( deserialize_expr(bad_big.data(), bad_big.size()), "bad compiled program" );
+    }
+  }
+
+  SECTION( "deep trees" ) {
+    // read without recursion: one ADD nested in the next
+    const int depth = 1000000;
+    std::string header = std::string(COMPILED_MAGIC, sizeof(COMPILED_MAGIC)) + (char)COMPILED_VERSION + '\0';
+    std::string deep = header + std::string(depth, (char)ADD_TAG);
+    for (int i = 0; i <= depth; i++)
+      deep += std::string(1, (char)NUM_TAG) + '\2';
+    PTR(Expr) e = deserialize_expr(deep.data(), deep.size());
+    CHECK( e->to_string().size() == 1 + 6 * depth );
+    CHECK_THROWS_WITH( deserialize_expr(deep.data(), deep.size() - 2), "bad compiled program" );
+  }
+
+  SECTION( "load from a file" ) {
+    char path[] = "/tmp/msdscript-compiled-XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE( fd >= 0 );
+    std::string bytes = serialize_expr(parse_str("_let f = _fun (x) x * 2 _in f(21)"));
+    CHECK( write(fd, bytes.data(), bytes.size()) == (ssize_t)bytes.size() );
+    close(fd);
+    CHECK( is_compiled_file(path) );
+    CHECK( load_compiled(path)->to_string() == "(_let f = (_fun (x) (x * 2)) _in f (21))" );
+    unlink(path);
+    CHECK( ! is_compiled_file(path) );
+  }
+}
+
+TEST_CASE( "load compiled vs parse", "[.][bench]" ) {
+  std::string source = "0";
+  for (int i = 0; i < 5000; i++) {
+    std::string name = "v" + std::string(1, (char)('a' + i % 26));
+    source = "_let " + name + " = " + std::to_string(i) + " _in (" + source + ") + " + name;
+  }
+  std::string bytes = serialize_expr(parse_str(source));
+
+  auto start = std::chrono::steady_clock::now();
+  parse_str(source);
+  auto parsed = std::chrono::steady_clock::now();
+  deserialize_expr(bytes.data(), bytes.size());
+  auto loaded = std::chrono::steady_clock::now();
+  double parse_ms = std::chrono::duration<double, std::milli>(parsed - start).count();
+  double load_ms = std::chrono::duration<double, std::milli>(loaded - parsed).count();
+  WARN( "source " << source.size() << " bytes, compiled " << bytes.size() << " bytes; parse: "
+       << parse_ms << " ms, load: " << load_ms << " ms" );
+}
@@ -0,0 +1,115 @@
+//
+//  serialize.hpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/22/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef serialize_hpp
+#define serialize_hpp
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "pointer.hpp"
+#include "symbol.hpp"
+
+class Expr;
+class BigInt;
+
+/*
+ * Compiled program format:
+ *
+ *   "MSDB" version
+ *   name count, then each name as a length and its bytes
+ *   the tree in prefix order: a tag byte per node, followed by its
+ *   operands. Numbers are zigzag varints, numbers too big for an
+ *   `int` are a sign and their limbs (see `append_big`), and names
+ *   are indexes into the name table.
+ *
+ * Counts, lengths and indexes are unsigned LEB128 varints.
+ * */
+static const char COMPILED_MAGIC[4] = {'M', 'S', 'D', 'B'};
+static const uint8_t COMPILED_VERSION = 1;
+
+enum ExprTag {
+  NUM_TAG = 1,
+  BIG_NUM_TAG,
+  ADD_TAG,
+  MULT_TAG,
+  VAR_TAG,
+  LET_TAG,
+  TRUE_TAG,
+  FALSE_TAG,
+  IF_TAG,
+  COMP_TAG,
+  FUN_TAG,
+  CALL_TAG
+};
+
+// Appends `n` as an unsigned LEB128 varint
+void append_varint(std::string &out, uint64_t n);
+// Appends `n` zigzag encoded, so small negative numbers stay short
+void append_int(std::string &out, long long n);
+// Appends `big` as 1 if negative (else 0), its limb count, and each
+// limb, least significant first
+void append_big(std::string &out, const BigInt &big);
+
+// Reads the pieces of a compiled program in place. Throws
+// `runtime_error` ("bad compiled program") for data that ends early
+// or is malformed.
+class ByteReader {
+public:
+  ByteReader(const char *data, size_t size);
+
+  uint64_t read_varint();
+  long long read_int();
+  // Also rejects a number not in `BigInt`'s normal form, whose
+  // arithmetic and comparisons would go wrong
+  BigInt read_big();
+  // The next `n` bytes, which stay where they are
+  const unsigned char *read_bytes(uint64_t n);
+  bool at_end();
+
+  static void bad();
+
+protected:
+  const unsigned char *pos;
+  const unsigned char *end;
+};
+
+// Collects the encoding of a tree; see `Expr::serialize`
+class ExprWriter {
+public:
+  void write_tag(ExprTag tag);
+  void write_varint(uint64_t n);
+  void write_int(long long n);
+  void write_big(const BigInt &big);
+  void write_name(Symbol name);
+
+  // The complete compiled program: header, name table and tree
+  std::string finish();
+
+private:
+  std::string tree;
+  std::vector<Symbol> names;
+  std::unordered_map<Symbol, uint64_t> name_index;
+};
+
+std::string serialize_expr(PTR(Expr) e);
+
+// Throws `runtime_error` for data that isn't a complete compiled program
+PTR(Expr) deserialize_expr(const char *data, size_t size);
+
+// Whether the file at `path` starts with the four bytes `magic`
+bool file_has_magic(const std::string &path, const char *magic);
+
+// Whether the file at `path` starts like a compiled program
+bool is_compiled_file(const std::string &path);
+
+// Maps the file at `path` into memory and deserializes it
+PTR(Expr) load_compiled(const std::string &path);
+
+#endif /* serialize_hpp */
@@ -0,0 +1,513 @@
+//
+//  server.cpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/13/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include <stdexcept>
+#include "server.hpp"
+#include "catch.hpp"
+
+#ifdef __linux__
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "batch.hpp"
+#include "thread_pool.hpp"
+
+// epoll tags for the two non-client descriptors; client connection
+// ids start after them
+static const uint64_t LISTEN_ID = 0;
+static const uint64_t WAKE_ID = 1;
+
+// What one connection may have waiting, so a client that sends faster
+// than it reads can't grow the server's memory without bound: past
+// either limit, its requests are left unread until it catches up
+static const size_t MAX_BUFFERED_OUTPUT = 1024 * 1024;
+static const uint64_t MAX_PENDING_REQUESTS = 1024;
+// Unparsed input held for one connection: room for the longest frame
+static const size_t MAX_BUFFERED_INPUT = MAX_PROGRAM_LENGTH + 32;
+
+static std::string errno_message(const std::string &what) {
+  return what + ": " + strerror(errno);
+}
+
+static void set_nonblocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+static std::string frame(const std::string &text) {
+  return std::to_string(text.size()) + "\n" + text + "\n";
+}
+
+Server::Server(const std::string &socket_path, ThreadPool &pool, bool optimize_mode)
+  : socket_path(socket_path), pool(pool) {
+  this->optimize_mode = optimize_mode;
+  this->stopping = false;
+  this->in_flight = 0;
+  this->next_conn_id = WAKE_ID + 1;
+
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path))
+    throw std::runtime_error("socket path too long");
+  strcpy(addr.sun_path, socket_path.c_str());
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0)
+    throw std::runtime_error(errno_message("socket"));
+  unlink(socket_path.c_str());
+  if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0
+      || listen(listen_fd, SOMAXCONN) < 0) {
+    std::string message = errno_message(socket_path);
+    close(listen_fd);
+    throw std::runtime_error(message);
+  }
+  set_nonblocking(listen_fd);
+
+  epoll_fd = epoll_create1(0);
+  wake_fd = eventfd(0, EFD_NONBLOCK);
+  spare_fd = open("/dev/null", O_RDONLY);
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.u64 = LISTEN_ID;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+  ev.data.u64 = WAKE_ID;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+}
+
+Server::~Server() {
+  // queued evaluations still refer to this server
+  while (in_flight > 0) {
+    if (!pool.run_one())
+      std::this_thread::yield();
+  }
+  for (auto &entry : connections)
+    close(entry.second.fd);
+  close(listen_fd);
+  close(epoll_fd);
+  close(wake_fd);
+  if (spare_fd >= 0)
+    close(spare_fd);
+  unlink(socket_path.c_str());
+}
+
+void Server::run() {
+  const int max_events = 256;
+  epoll_event events[max_events];
+  while (!stopping) {
+    int n = epoll_wait(epoll_fd, events, max_events, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      throw std::runtime_error(errno_message("epoll_wait"));
+    }
+    for (int i = 0; i < n; i++) {
+      uint64_t id = events[i].data.u64;
+      if (id == LISTEN_ID) {
+        accept_clients();
+      } else if (id == WAKE_ID) {
+        uint64_t count;
+        while (read(wake_fd, &count, sizeof(count)) > 0)
+          ;
+        finish_requests();
+      } else {
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+          read_client(id);
+        if (events[i].events & EPOLLOUT)
+          write_client(id);
+      }
+    }
+  }
+}
+
+void Server::stop() {
+  stopping = true;
+  uint64_t one = 1;
+  (void)write(wake_fd, &one, sizeof(one));
+}
+
+void Server::accept_clients() {
+  while (1) {
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0 && (errno == EMFILE || errno == ENFILE) && spare_fd >= 0) {
+      // The waiting client keeps the listening socket readable, so
+      // rather than spin, accept it with the reserve descriptor and
+      // hang up on it
+      close(spare_fd);
+      fd = accept(listen_fd, nullptr, nullptr);
+      if (fd >= 0)
+        close(fd);
+      spare_fd = open("/dev/null", O_RDONLY);
+      if (fd < 0)
+        return;
+      continue;
+    }
+    if (fd < 0)
+      return;
+    set_nonblocking(fd);
+    uint64_t conn_id = next_conn_id++;
+    Connection &conn = connections[conn_id];
+    conn.fd = fd;
+    conn.read_closed = false;
+    conn.watched = true;
+    conn.next_request = 0;
+    conn.next_response = 0;
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = conn_id;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  }
+}
+
+void Server::read_client(uint64_t conn_id) {
+  auto found = connections.find(conn_id);
+  if (found == connections.end())
+    return;
+  Connection &conn = found->second;
+
+  char buf[65536];
+  while (!conn.read_closed && !backlogged(conn) && conn.in.size() < MAX_BUFFERED_INPUT) {
+    ssize_t n = read(conn.fd, buf, sizeof(buf));
+    if (n > 0) {
+      conn.in.append(buf, n);
+      take_requests(conn, conn_id);
+    } else if (n == 0) {
+      // the client may still be waiting for the replies
+      conn.read_closed = true;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else if (errno != EINTR) {
+      close_client(conn_id);
+      return;
+    }
+  }
+
+  finish_requests();
+  write_client(conn_id);
+}
+
+bool Server::backlogged(const Connection &conn) {
+  return conn.out.size() >= MAX_BUFFERED_OUTPUT
+      || conn.next_request - conn.next_response >= MAX_PENDING_REQUESTS;
+}
+
+// Hands the complete frames in `conn.in` to the pool, until the
+// connection is backlogged
+void Server::take_requests(Connection &conn, uint64_t conn_id) {
+  size_t pos = 0;
+  while (!backlogged(conn)) {
+    pos = conn.in.find_first_not_of(" \t\r\n", pos);
+    if (pos == std::string::npos) {
+      pos = conn.in.size();
+      break;
+    }
+    size_t newline = conn.in.find('\n', pos);
+    if (newline == std::string::npos && conn.in.size() - pos <= 20)
+      break;
+    size_t length = 0;
+    bool good_length = newline != std::string::npos && newline > pos && newline - pos <= 20;
+    for (size_t i = pos; good_length && i < newline; i++) {
+      good_length = isdigit(conn.in[i]);
+      length = length * 10 + (conn.in[i] - '0');
+    }
+    if (!good_length || length > MAX_PROGRAM_LENGTH) {
+      // the rest of the stream can't be framed, so stop reading it
+      complete(conn_id, conn.next_request++, "error: expected a program length");
+      conn.read_closed = true;
+      pos = conn.in.size();
+      break;
+    }
+    if (conn.in.size() - (newline + 1) < length)
+      break;
+
+    std::string source = conn.in.substr(newline + 1, length);
+    uint64_t request = conn.next_request++;
+    bool optimize_mode = this->optimize_mode;
+    in_flight++;
+    pool.submit([this, conn_id, request, source, optimize_mode] {
+      complete(conn_id, request, run_program_line(source, optimize_mode));
+      in_flight--;
+    });
+    pos = newline + 1 + length;
+  }
+  conn.in.erase(0, pos);
+}
+
+// Queues a result for the epoll loop; callable from any thread
+void Server::complete(uint64_t conn_id, uint64_t request, std::string result) {
+  {
+    std::lock_guard<std::mutex> guard(completions_lock);
+    completions.push_back(Completion { conn_id, request, std::move(result) });
+  }
+  uint64_t one = 1;
+  (void)write(wake_fd, &one, sizeof(one));
+}
+
+// Moves evaluated results into their connections' output, in
+// request order
+void Server::finish_requests() {
+  std::vector<Completion> done;
+  {
+    std::lock_guard<std::mutex> guard(completions_lock);
+    done.swap(completions);
+  }
+  for (Completion &c : done) {
+    auto found = connections.find(c.conn_id);
+    if (found != connections.end())
+      found->second.finished[c.request] = std::move(c.result);
+  }
+
+  std::vector<uint64_t> ready;
+  for (auto &entry : connections) {
+    Connection &conn = entry.second;
+    bool added = false;
+    while (conn.finished.count(conn.next_response) > 0) {
+      conn.out += frame(conn.finished[conn.next_response]);
+      conn.finished.erase(conn.next_response++);
+      added = true;
+    }
+    if (added)
+      ready.push_back(entry.first);
+  }
+  for (uint64_t conn_id : ready)
+    write_client(conn_id);
+}
+
+void Server::write_client(uint64_t conn_id) {
+  auto found = connections.find(conn_id);
+  if (found == connections.end())
+    return;
+  Connection &conn = found->second;
+
+  while (!conn.out.empty()) {
+    ssize_t n = send(conn.fd, conn.out.data(), conn.out.size(), MSG_NOSIGNAL);
+    if (n > 0) {
+      conn.out.erase(0, n);
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else if (errno != EINTR) {
+      close_client(conn_id);
+      return;
+    }
+  }
+
+  // frames left unread while the connection was backlogged
+  if (!conn.in.empty())
+    take_requests(conn, conn_id);
+
+  if (conn.read_closed && conn.out.empty() && conn.next_response == conn.next_request)
+    close_client(conn_id);
+  else
+    watch_client(conn, conn_id);
+}
+
+void Server::watch_client(Connection &conn, uint64_t conn_id) {
+  bool reading = !conn.read_closed && !backlogged(conn) && conn.in.size() < MAX_BUFFERED_INPUT;
+  epoll_event ev;
+  ev.events = (reading ? EPOLLIN : 0) | (conn.out.empty() ? 0 : EPOLLOUT);
+  ev.data.u64 = conn_id;
+  // A connection waiting only on the pool leaves epoll, which would
+  // otherwise keep reporting a hangup from a client that has closed
+  // its side
+  if (ev.events == 0) {
+    if (conn.watched)
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn.fd, nullptr);
+    conn.watched = false;
+  } else {
+    epoll_ctl(epoll_fd, conn.watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, conn.fd, &ev);
+    conn.watched = true;
+  }
+}
+
+void Server::close_client(uint64_t conn_id) {
+  auto found = connections.find(conn_id);
+  if (found == connections.end())
+    return;
+  if (found->second.watched)
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, found->second.fd, nullptr);
+  close(found->second.fd);
+  connections.erase(found);
+}
+
+/* for tests */
+static int connect_to(const std::string &path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path.c_str());
+  if (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* for tests */
+static void send_str(int fd, const std::string &s) {
+  (void)write(fd, s.data(), s.size());
+}
+
+/* for tests: reads until the server closes the connection */
+static std::string read_all(int fd) {
+  std::string result;
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    result.append(buf, n);
+  return result;
+}
+
+/* for tests */
+static double thread_cpu_ms(std::thread &thread) {
+  clockid_t clock;
+  pthread_getcpuclockid(thread.native_handle(), &clock);
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+TEST_CASE( "Server" ) {
+  std::string path = "/tmp/msdscript-test-" + std::to_string(getpid()) + ".sock";
+  ThreadPool pool(2);
+  Server server(path, pool, false);
+  std::thread loop([&server] { server.run(); });
+
+  SECTION( "evaluates framed programs in order" ) {
+    int fd = connect_to(path);
+    REQUIRE( fd >= 0 );
+    send_str(fd, "5\n1 + 2\n1\nx");
+    send_str(fd, "\n20\n_let x");
+    send_str(fd, " = 7 _in x * x\n");
+    // replies come back in request order, even though fib is slower
+    std::string fib = "_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1 "
+                      "_else fib(fib)(x + -1) + fib(fib)(x + -2) _in fib(fib)(15)";
+    send_str(fd, std::to_string(fib.size()) + "\n" + fib + "5\n_true");
+    shutdown(fd, SHUT_WR);
+    CHECK( read_all(fd) == "1\n3\n23\nerror: free variable: x\n2\n49\n3\n987\n5\n_true\n" );
+    close(fd);
+  }
+
+  SECTION( "bad frame" ) {
+    int fd = connect_to(path);
+    REQUIRE( fd >= 0 );
+    send_str(fd, "2\n10\nnot a length\n5\n1 + 1");
+    CHECK( read_all(fd) == "2\n10\n32\nerror: expected a program length\n" );
+    close(fd);
+  }
+
+  SECTION( "many connections" ) {
+    std::vector<int> fds;
+    for (int i = 0; i < 50; i++) {
+      fds.push_back(connect_to(path));
+      REQUIRE( fds.back() >= 0 );
+    }
+    for (int i = 0; i < 50; i++) {
+      std::string program = std::to_string(i) + " * 2";
+      send_str(fds[i], std::to_string(program.size()) + "\n" + program);
+      shutdown(fds[i], SHUT_WR);
+    }
+    for (int i = 0; i < 50; i++) {
+      std::string result = std::to_string(i * 2);
+      CHECK( read_all(fds[i]) == std::to_string(result.size()) + "\n" + result + "\n" );
+      close(fds[i]);
+    }
+  }
+
+  SECTION( "a closed client doesn't keep the loop busy" ) {
+    // a client gone while its request runs leaves a hangup pending on
+    // its connection until the result is ready
+    std::string fib = "_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1 "
+                      "_else fib(fib)(x + -1) + fib(fib)(x + -2) _in fib(fib)(26)";
+    int fd = connect_to(path);
+    REQUIRE( fd >= 0 );
+    send_str(fd, std::to_string(fib.size()) + "\n" + fib);
+    shutdown(fd, SHUT_RDWR);
+    close(fd);
+    double before = thread_cpu_ms(loop);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    CHECK( thread_cpu_ms(loop) - before < 20 );
+  }
+
+  SECTION( "a client that doesn't read is throttled" ) {
+    // more replies than the server buffers for one connection
+    std::string requests, expected;
+    for (int i = 0; i < 200000; i++) {
+      requests += "5\n_true";
+      expected += "5\n_true\n";
+    }
+    int fd = connect_to(path);
+    REQUIRE( fd >= 0 );
+    std::thread writer([fd, &requests] {
+      send_str(fd, requests);
+      shutdown(fd, SHUT_WR);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    CHECK( read_all(fd) == expected );
+    writer.join();
+    close(fd);
+  }
+
+  SECTION( "out of descriptors" ) {
+    // room for the client's socket, but not for the server's end
+    int next_fd = open("/dev/null", O_RDONLY);
+    close(next_fd);
+    rlimit saved, low;
+    getrlimit(RLIMIT_NOFILE, &saved);
+    low = saved;
+    low.rlim_cur = next_fd + 1;
+    setrlimit(RLIMIT_NOFILE, &low);
+    double before = thread_cpu_ms(loop);
+    int fd = connect_to(path);
+    // the server hangs up rather than spin on the waiting client
+    std::string reply = fd >= 0 ? read_all(fd) : "no connection";
+    if (fd >= 0)
+      close(fd);
+    setrlimit(RLIMIT_NOFILE, &saved);
+    CHECK( reply == "" );
+    CHECK( thread_cpu_ms(loop) - before < 20 );
+
+    fd = connect_to(path);
+    REQUIRE( fd >= 0 );
+    send_str(fd, "5\n6 * 7");
+    shutdown(fd, SHUT_WR);
+    CHECK( read_all(fd) == "2\n42\n" );
+    close(fd);
+  }
+
+  server.stop();
+  loop.join();
+}
+
+#else
+
+Server::Server(const std::string &socket_path, ThreadPool &pool, bool optimize_mode)
+  : socket_path(socket_path), pool(pool) {
+  throw std::runtime_error("--serve needs Linux (epoll)");
+}
+
+Server::~Server() {
+}
+
+void Server::run() {
+}
+
+void Server::stop() {
+}
+
+#endif
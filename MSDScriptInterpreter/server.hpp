@@ -0,0 +1,98 @@
+//
+//  server.hpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/13/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef server_hpp
+#define server_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class ThreadPool;
+
+/*
+ * Long-running evaluator listening on a Unix domain socket. Clients
+ * send programs framed like `--batch-framed` input (a byte length,
+ * a newline, then the program), and get back one frame per program,
+ * in order, holding the result or "error: <message>". A single epoll
+ * loop does all socket I/O, so idle connections cost no threads;
+ * evaluation happens on the pool. A client that sends requests faster
+ * than it reads the replies has its input left unread until it
+ * catches up. Interned names are never freed, so once the programs
+ * served have brought `max_symbol_bytes` of distinct names, programs
+ * with new names get "error: too many distinct names". Linux only.
+ * */
+class Server {
+public:
+  // Binds and listens on `socket_path`, replacing a stale socket
+  // file. Throws `runtime_error` on failure.
+  Server(const std::string &socket_path, ThreadPool &pool, bool optimize_mode);
+  ~Server();
+  
+  // Serves clients until `stop` is called
+  void run();
+  // Makes `run` return; callable from any thread
+  void stop();
+  
+private:
+  struct Connection {
+    int fd;
+    std::string in;
+    std::string out;
+    // set once the client has shut down its sending side
+    bool read_closed;
+    // whether `fd` is registered with epoll; it isn't while the
+    // connection waits on nothing but the pool
+    bool watched;
+    // responses are written in request order
+    uint64_t next_request;
+    uint64_t next_response;
+    std::map<uint64_t, std::string> finished;
+  };
+  
+  struct Completion {
+    uint64_t conn_id;
+    uint64_t request;
+    std::string result;
+  };
+  
+  std::string socket_path;
+  ThreadPool &pool;
+  bool optimize_mode;
+  int listen_fd;
+  int epoll_fd;
+  // held in reserve for accepting, and dropping, a client once the
+  // process is out of descriptors
+  int spare_fd;
+  // written by workers (and `stop`) to wake the epoll loop
+  int wake_fd;
+  std::atomic<bool> stopping;
+  // evaluations still queued or running on the pool
+  std::atomic<long> in_flight;
+  
+  uint64_t next_conn_id;
+  std::map<uint64_t, Connection> connections;
+  
+  std::mutex completions_lock;
+  std::vector<Completion> completions;
+  
+  void accept_clients();
+  void read_client(uint64_t conn_id);
+  bool backlogged(const Connection &conn);
+  void take_requests(Connection &conn, uint64_t conn_id);
+  void complete(uint64_t conn_id, uint64_t request, std::string result);
+  void write_client(uint64_t conn_id);
+  void close_client(uint64_t conn_id);
+  void finish_requests();
+  void watch_client(Connection &conn, uint64_t conn_id);
+};
+
+#endif /* server_hpp */
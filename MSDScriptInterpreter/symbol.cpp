@@ -0,0 +1,121 @@
+//
+//  symbol.cpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/24/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "symbol.hpp"
+#include "catch.hpp"
+
+// Never freed, so symbols stay valid even while static objects are
+// being destroyed
+static std::mutex &intern_lock() {
+  static std::mutex *lock = new std::mutex;
+  return *lock;
+}
+
+// Node-based, so an element's address never changes
+static std::unordered_set<std::string> &interned() {
+  static std::unordered_set<std::string> *names = new std::unordered_set<std::string>;
+  return *names;
+}
+
+size_t max_symbol_bytes = 64 * 1024 * 1024;
+// with `intern_lock` held
+static size_t interned_bytes = 0;
+
+// Charged for a name: its text plus the string and table node holding it
+static size_t name_bytes(const std::string &name) {
+  return name.size() + sizeof(std::string) + 2 * sizeof(void *);
+}
+
+Symbol::Symbol() {
+  static const std::string *empty = Symbol("").text;
+  this->text = empty;
+}
+
+Symbol::Symbol(const std::string &name) {
+  std::lock_guard<std::mutex> guard(intern_lock());
+  auto found = interned().find(name);
+  if (found == interned().end()) {
+    if (interned_bytes + name_bytes(name) > max_symbol_bytes)
+      throw std::runtime_error("too many distinct names");
+    interned_bytes += name_bytes(name);
+    found = interned().insert(name).first;
+  }
+  this->text = &*found;
+}
+
+Symbol::Symbol(const char *name)
+: Symbol(std::string(name)) {
+}
+
+size_t Symbol::count() {
+  std::lock_guard<std::mutex> guard(intern_lock());
+  return interned().size();
+}
+
+size_t Symbol::bytes() {
+  std::lock_guard<std::mutex> guard(intern_lock());
+  return interned_bytes;
+}
+
+std::string operator+(const std::string &lhs, const Symbol &rhs) {
+  return lhs + rhs.str();
+}
+
+std::string operator+(const Symbol &lhs, const std::string &rhs) {
+  return lhs.str() + rhs;
+}
+
+std::ostream &operator<<(std::ostream &out, const Symbol &symbol) {
+  return out << symbol.str();
+}
+
+TEST_CASE( "Symbol" ) {
+  Symbol x("x");
+  CHECK( x == Symbol(std::string("x")) );
+  CHECK( x != Symbol("y") );
+  CHECK( &x.str() == &Symbol("x").str() );
+  CHECK( "(" + x + ")" == "(x)" );
+  CHECK( Symbol() == Symbol("") );
+
+  SECTION( "interning from many threads" ) {
+    std::vector<std::thread> threads;
+    std::vector<const std::string *> seen(8);
+    for (int i = 0; i < 8; i++) {
+      threads.push_back(std::thread([&seen, i] {
+        for (int n = 0; n < 200; n++)
+          Symbol("sym" + std::to_string(n));
+        seen[i] = &Symbol("sym7").str();
+      }));
+    }
+    for (std::thread &thread : threads)
+      thread.join();
+    for (const std::string *s : seen)
+      CHECK( s == seen[0] );
+  }
+
+  SECTION( "the table is bounded" ) {
+    size_t saved = max_symbol_bytes;
+    max_symbol_bytes = Symbol::bytes() + 200;
+    size_t before = Symbol::count();
+    // names already interned are always found
+    CHECK( Symbol("x") == x );
+    auto intern_many = [] {
+      for (int n = 0; n < 100; n++)
+        Symbol("limit" + std::to_string(n));
+    };
+    CHECK_THROWS_WITH( intern_many(), "too many distinct names" );
+    CHECK( Symbol::count() > before );
+    CHECK( Symbol::bytes() <= max_symbol_bytes );
+    max_symbol_bytes = saved;
+  }
+}
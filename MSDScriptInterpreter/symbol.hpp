@@ -0,0 +1,73 @@
+//
+//  symbol.hpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/24/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef symbol_hpp
+#define symbol_hpp
+
+#include <functional>
+#include <ostream>
+#include <string>
+
+/*
+ * An interned identifier. Every spelling is stored once, for the life
+ * of the process, so two symbols are the same name exactly when they
+ * point at the same string, and comparing them compares one word.
+ * Interning is thread-safe; reading a symbol needs no lock.
+ *
+ * Names are never freed, so the table only grows. Interning a new name
+ * once the table holds `max_symbol_bytes` throws `runtime_error`, which
+ * makes a long-running process (`--serve`) reject programs that bring
+ * new names rather than grow without bound.
+ * */
+class Symbol {
+public:
+  // The empty name
+  Symbol();
+  // Implicit, so a name can be written as a string literal
+  Symbol(const std::string &name);
+  Symbol(const char *name);
+
+  const std::string &str() const {
+    return *text;
+  }
+
+  bool operator==(const Symbol &other) const {
+    return text == other.text;
+  }
+
+  bool operator!=(const Symbol &other) const {
+    return text != other.text;
+  }
+
+  // Number of distinct names interned so far
+  static size_t count();
+  // Space they take, counted against `max_symbol_bytes`
+  static size_t bytes();
+
+private:
+  const std::string *text;
+
+  friend struct std::hash<Symbol>;
+};
+
+extern size_t max_symbol_bytes;
+
+std::string operator+(const std::string &lhs, const Symbol &rhs);
+std::string operator+(const Symbol &lhs, const std::string &rhs);
+std::ostream &operator<<(std::ostream &out, const Symbol &symbol);
+
+namespace std {
+  template <>
+  struct hash<Symbol> {
+    size_t operator()(const Symbol &symbol) const {
+      return std::hash<const std::string *>()(symbol.text);
+    }
+  };
+}
+
+#endif /* symbol_hpp */
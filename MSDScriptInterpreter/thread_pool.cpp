@@ -0,0 +1,172 @@
+//
+//  thread_pool.cpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/8/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <set>
+#include "thread_pool.hpp"
+#include "catch.hpp"
+
+// The pool and worker index of the current thread, if it is a worker
+static thread_local ThreadPool *current_pool = nullptr;
+static thread_local unsigned current_worker = 0;
+
+ThreadPool::ThreadPool(unsigned num_threads) {
+  if (num_threads == 0)
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  this->next_worker = 0;
+  this->pending = 0;
+  this->stopping = false;
+  for (unsigned i = 0; i < num_threads; i++)
+    workers.push_back(std::unique_ptr<Worker>(new Worker()));
+  for (unsigned i = 0; i < num_threads; i++)
+    threads.push_back(std::thread(&ThreadPool::worker_loop, this, i));
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> guard(idle_lock);
+    stopping = true;
+  }
+  idle_cond.notify_all();
+  for (std::thread &t : threads)
+    t.join();
+}
+
+void ThreadPool::submit(Task task) {
+  unsigned target;
+  if (current_pool == this)
+    target = current_worker;
+  else
+    target = next_worker++ % workers.size();
+  {
+    std::lock_guard<std::mutex> guard(workers[target]->lock);
+    workers[target]->tasks.push_back(std::move(task));
+  }
+  pending++;
+  // taking the lock orders this wakeup after a sleeper's last check
+  { std::lock_guard<std::mutex> guard(idle_lock); }
+  idle_cond.notify_one();
+}
+
+unsigned ThreadPool::size() {
+  return (unsigned)workers.size();
+}
+
+bool ThreadPool::run_one() {
+  Task task;
+  bool found;
+  if (current_pool == this)
+    found = try_pop(current_worker, task);
+  else
+    found = try_steal(0, task);
+  if (found)
+    task();
+  return found;
+}
+
+bool ThreadPool::try_pop(unsigned self, Task &task) {
+  {
+    Worker &own = *workers[self];
+    std::lock_guard<std::mutex> guard(own.lock);
+    if (!own.tasks.empty()) {
+      task = std::move(own.tasks.back());
+      own.tasks.pop_back();
+      pending--;
+      return true;
+    }
+  }
+  return try_steal(self + 1, task);
+}
+
+// Takes the oldest task of the first non-empty worker, starting
+// with worker `start`
+bool ThreadPool::try_steal(unsigned start, Task &task) {
+  for (size_t i = 0; i < workers.size(); i++) {
+    Worker &victim = *workers[(start + i) % workers.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      pending--;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::worker_loop(unsigned self) {
+  current_pool = this;
+  current_worker = self;
+  Task task;
+  while (1) {
+    if (try_pop(self, task)) {
+      task();
+      task = nullptr;
+      continue;
+    }
+    std::unique_lock<std::mutex> guard(idle_lock);
+    if (stopping && pending == 0)
+      return;
+    idle_cond.wait(guard, [this] { return stopping || pending > 0; });
+  }
+}
+
+TEST_CASE( "ThreadPool" ) {
+  SECTION( "runs every task" ) {
+    std::atomic<int> count(0);
+    {
+      ThreadPool pool(4);
+      CHECK( pool.size() == 4 );
+      for (int i = 0; i < 1000; i++)
+        pool.submit([&count] { count++; });
+    }
+    CHECK( count == 1000 );
+  }
+  
+  SECTION( "idle workers steal" ) {
+    std::mutex lock;
+    std::set<std::thread::id> ran_on;
+    std::atomic<int> count(0);
+    {
+      ThreadPool pool(4);
+      // all of these land on a single worker's deque
+      pool.submit([&] {
+        for (int i = 0; i < 40; i++) {
+          pool.submit([&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            std::lock_guard<std::mutex> guard(lock);
+            ran_on.insert(std::this_thread::get_id());
+            count++;
+          });
+        }
+      });
+    }
+    CHECK( count == 40 );
+    CHECK( ran_on.size() > 1 );
+  }
+  
+  SECTION( "run_one" ) {
+    ThreadPool pool(1);
+    std::atomic<bool> started(false), release(false);
+    std::atomic<int> count(0);
+    // keep the only worker busy, so the queued task is left for us
+    pool.submit([&started, &release] {
+      started = true;
+      while (!release)
+        std::this_thread::yield();
+    });
+    while (!started)
+      std::this_thread::yield();
+    pool.submit([&count] { count++; });
+    CHECK( pool.run_one() );
+    CHECK( count == 1 );
+    CHECK( ! pool.run_one() );
+    release = true;
+  }
+}
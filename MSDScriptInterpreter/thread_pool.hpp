@@ -0,0 +1,67 @@
+//
+//  thread_pool.hpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 4/8/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef thread_pool_hpp
+#define thread_pool_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Fixed set of worker threads, each with its own task deque. A worker
+ * takes its newest task first and, when its deque is empty, steals the
+ * oldest task from another worker, so one long task never holds up
+ * the tasks queued behind it.
+ * */
+class ThreadPool {
+public:
+  typedef std::function<void()> Task;
+  
+  // 0 threads means one per hardware thread
+  ThreadPool(unsigned num_threads);
+  // Finishes every queued task, then joins the workers
+  ~ThreadPool();
+  
+  // Queues `task`, which must not throw. A task submitted from a
+  // worker goes on that worker's own deque.
+  void submit(Task task);
+  unsigned size();
+  
+  // Runs one queued task on the calling thread, returning false if
+  // there was none. Lets a thread that waits on another task help
+  // instead of blocking a worker.
+  bool run_one();
+  
+private:
+  struct Worker {
+    std::mutex lock;
+    std::deque<Task> tasks;
+  };
+  
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::thread> threads;
+  std::atomic<unsigned> next_worker;
+  
+  // `pending` counts queued tasks, so idle workers can sleep
+  std::mutex idle_lock;
+  std::condition_variable idle_cond;
+  std::atomic<long> pending;
+  bool stopping;
+  
+  bool try_pop(unsigned self, Task &task);
+  bool try_steal(unsigned self, Task &task);
+  void worker_loop(unsigned self);
+};
+
+#endif /* thread_pool_hpp */
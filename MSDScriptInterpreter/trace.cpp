@@ -0,0 +1,200 @@
+//
+//  trace.cpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 5/13/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+#include "trace.hpp"
+#include "catch.hpp"
+#include "expr.hpp"
+#include "env.hpp"
+#include "parse.hpp"
+#include "profile.hpp"
+#include "value.hpp"
+
+TraceRecorder *active_trace = nullptr;
+
+long long trace_clock_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Small thread numbers for the trace, in the order threads first
+// record something
+static std::atomic<int> next_trace_thread(1);
+static thread_local int trace_thread = 0;
+
+static int this_trace_thread() {
+  if (trace_thread == 0)
+    trace_thread = next_trace_thread++;
+  return trace_thread;
+}
+
+// When the functions being applied on this thread started
+static thread_local std::vector<long long> call_starts;
+
+TraceRecorder::TraceRecorder(long long min_call_us)
+  : EvalHooks(false), origin_ns(trace_clock_ns()), min_call_ns(min_call_us * 1000) {
+}
+
+void TraceRecorder::record(const char *category, const std::string &name,
+                           long long start_ns, long long end_ns) {
+  Span span = {category, name, start_ns - origin_ns, end_ns - start_ns, this_trace_thread()};
+  std::lock_guard<std::mutex> guard(lock);
+  spans.push_back(span);
+}
+
+void TraceRecorder::enter_function(Expr *body) {
+  call_starts.push_back(trace_clock_ns());
+}
+
+void TraceRecorder::leave_function(Expr *body) {
+  long long start_ns = call_starts.back();
+  call_starts.pop_back();
+  long long end_ns = trace_clock_ns();
+  if (end_ns - start_ns < min_call_ns)
+    return;
+  auto name = function_names.find(body);
+  record("function", name != function_names.end() ? name->second : "(unnamed function)",
+         start_ns, end_ns);
+}
+
+void TraceRecorder::name_functions(const PTR(Expr) &program) {
+  function_names = function_labels(program);
+}
+
+size_t TraceRecorder::span_count() {
+  std::lock_guard<std::mutex> guard(lock);
+  return spans.size();
+}
+
+static void write_json_string(std::ostream &out, const std::string &s) {
+  out << '"';
+  for (char c : s) {
+    if (c == '"' || c == '\\')
+      out << '\\' << c;
+    else if ((unsigned char)c < 0x20)
+      out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c
+          << std::dec << std::setfill(' ');
+    else
+      out << c;
+  }
+  out << '"';
+}
+
+void TraceRecorder::write_json(std::ostream &out) {
+  std::lock_guard<std::mutex> guard(lock);
+  std::ios::fmtflags flags = out.flags();
+  // times are in microseconds, to the nanosecond
+  out << std::fixed << std::setprecision(3);
+  out << "{\"traceEvents\": [";
+  int pid = getpid();
+  for (size_t i = 0; i < spans.size(); i++) {
+    const Span &span = spans[i];
+    out << (i == 0 ? "\n" : ",\n") << "  {\"name\": ";
+    write_json_string(out, span.name);
+    out << ", \"cat\": \"" << span.category << "\", \"ph\": \"X\""
+        << ", \"ts\": " << span.start_ns / 1000.0 << ", \"dur\": " << span.duration_ns / 1000.0
+        << ", \"pid\": " << pid << ", \"tid\": " << span.thread << "}";
+  }
+  out << "\n], \"displayTimeUnit\": \"ms\"}" << std::endl;
+  out.flags(flags);
+}
+
+#ifndef MSD_NO_HOOKS
+// The `tid` of each line of `json` that mentions `name`
+static std::vector<std::string> span_threads(const std::string &json, const std::string &name) {
+  std::vector<std::string> threads;
+  std::istringstream lines(json);
+  std::string line;
+  while (std::getline(lines, line)) {
+    if (line.find("\"name\": \"" + name + "\"") == std::string::npos)
+      continue;
+    size_t tid = line.find("\"tid\": ");
+    threads.push_back(line.substr(tid + 7, line.find('}', tid) - tid - 7));
+  }
+  return threads;
+}
+
+TEST_CASE( "TraceRecorder" ) {
+  std::istringstream in("_let fib = _fun (fib) _fun (x)"
+                        "  _if x == 0 _then 1"
+                        "  _else _if x == 1 _then 1"
+                        "  _else fib(fib)(x + -1) + fib(fib)(x + -2)"
+                        " _in _let twice = _fun (y) y * 2"
+                        " _in twice(fib(fib)(10))");
+  PTR(Expr) e = parse(in);
+
+  SECTION( "phases and every call" ) {
+    TraceRecorder trace;
+    trace.name_functions(e);
+    active_trace = &trace;
+    eval_hooks = &trace;
+    {
+      TraceSpan span("interp");
+      CHECK( e->interp(NEW(EmptyEnv)())->to_string() == "178" );
+    }
+    eval_hooks = nullptr;
+    active_trace = nullptr;
+    // 177 applications of `fib` and of the function it returns, and
+    // one of `twice`
+    CHECK( trace.span_count() == 177 * 2 + 1 + 1 );
+
+    std::ostringstream json;
+    trace.write_json(json);
+    CHECK( json.str().find("{\"traceEvents\": [\n  {\"name\": \"") == 0 );
+    CHECK( json.str().find("\n], \"displayTimeUnit\": \"ms\"}\n") != std::string::npos );
+    CHECK( span_threads(json.str(), "fib/_fun (x)").size() == 177 );
+    CHECK( span_threads(json.str(), "fib").size() == 177 );
+    CHECK( span_threads(json.str(), "twice").size() == 1 );
+    CHECK( span_threads(json.str(), "interp").size() == 1 );
+    CHECK( json.str().find("\"cat\": \"phase\", \"ph\": \"X\"") != std::string::npos );
+    CHECK( json.str().find("\"cat\": \"function\", \"ph\": \"X\"") != std::string::npos );
+    // the whole evaluation finishes last
+    CHECK( json.str().rfind("\"name\": \"interp\"") > json.str().rfind("\"name\": \"twice\"") );
+  }
+
+  SECTION( "short calls are left out" ) {
+    TraceRecorder trace(60 * 1000 * 1000);
+    eval_hooks = &trace;
+    e->interp(NEW(EmptyEnv)());
+    eval_hooks = nullptr;
+    CHECK( trace.span_count() == 0 );
+  }
+
+  SECTION( "phases from library calls and other threads" ) {
+    TraceRecorder trace;
+    active_trace = &trace;
+    std::thread other([] {
+      std::istringstream in("1 + 2");
+      parse(in);
+    });
+    other.join();
+    std::istringstream in("3 * 4");
+    parse(in);
+    active_trace = nullptr;
+
+    std::ostringstream json;
+    trace.write_json(json);
+    std::vector<std::string> threads = span_threads(json.str(), "parse");
+    REQUIRE( threads.size() == 2 );
+    CHECK( threads[0] != threads[1] );
+  }
+
+  SECTION( "names are escaped" ) {
+    TraceRecorder trace;
+    trace.record("phase", "a \"b\"\\\n", 0, 0);
+    std::ostringstream json;
+    trace.write_json(json);
+    CHECK( json.str().find("{\"name\": \"a \\\"b\\\"\\\\\\u000a\"") != std::string::npos );
+  }
+}
+#endif
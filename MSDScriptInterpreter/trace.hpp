@@ -0,0 +1,92 @@
+//
+//  trace.hpp
+//  MSDScriptInterpreter
+//
+//  Created by Warner Nielsen on 5/13/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef trace_hpp
+#define trace_hpp
+
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "hooks.hpp"
+#include "pointer.hpp"
+
+/*
+ * Records timed spans for the Chrome trace event format, which
+ * chrome://tracing and Perfetto load. Phases (parse, optimize,
+ * interp) are recorded from any thread while the recorder is
+ * `active_trace`. Function applications are recorded on threads where
+ * it is also installed as `eval_hooks`, and only those that take at
+ * least the threshold, so a long run keeps a readable trace. Every
+ * span is tagged with the thread it ran on.
+ * */
+class TraceRecorder : public EvalHooks {
+public:
+  TraceRecorder(long long min_call_us = 0);
+
+  // Records a span of category `category` (such as "phase") that ran
+  // on this thread; times are from `trace_clock_ns`
+  void record(const char *category, const std::string &name, long long start_ns, long long end_ns);
+
+  void enter_node(NodeKind kind) {}
+  void leave_node(NodeKind kind) {}
+  void enter_function(Expr *body);
+  void leave_function(Expr *body);
+
+  // Labels the functions in `program` in the trace (see
+  // `function_labels`)
+  void name_functions(const PTR(Expr) &program);
+
+  // Writes every span as a JSON trace, in the order they finished
+  void write_json(std::ostream &out);
+
+  size_t span_count();
+
+private:
+  struct Span {
+    const char *category;
+    std::string name;
+    long long start_ns;
+    long long duration_ns;
+    int thread;
+  };
+
+  long long origin_ns;
+  long long min_call_ns;
+  std::mutex lock;
+  std::vector<Span> spans;
+  std::unordered_map<Expr *, std::string> function_names;
+};
+
+// A steady clock in nanoseconds
+long long trace_clock_ns();
+
+// The recorder phases report to, if any. Set it before starting the
+// threads it should hear from.
+extern TraceRecorder *active_trace;
+
+// Records the scope as a phase span in `active_trace`
+class TraceSpan {
+public:
+  TraceSpan(const char *name) : name(name), recorder(active_trace), start_ns(0) {
+    if (recorder != nullptr)
+      start_ns = trace_clock_ns();
+  }
+  ~TraceSpan() {
+    if (recorder != nullptr)
+      recorder->record("phase", name, start_ns, trace_clock_ns());
+  }
+
+private:
+  const char *name;
+  TraceRecorder *recorder;
+  long long start_ns;
+};
+
+#endif /* trace_hpp */
@@ -7,45 +7,111 @@
 //
 
 #include <stdexcept>
+#include <chrono>
+#include <sstream>
+#include <utility>
 #include "value.hpp"
 #include "expr.hpp"
 #include "env.hpp"
+#include "bigint.hpp"
+#include "reclaim.hpp"
+#include "hooks.hpp"
 #include "catch.hpp"
 
+std::string Val::to_string() {
+  std::ostringstream out;
+  print(out);
+  return out.str();
+}
+
 NumVal::NumVal(int rep) {
   this->rep = rep;
+  this->big = nullptr;
+}
+
+// Keeps values that fit in an `int` unboxed, so `big` is set only
+// for values that really need it
+NumVal::NumVal(const BigInt &big) {
+  if (big.fits_int()) {
+    this->rep = big.to_int();
+    this->big = nullptr;
+  } else {
+    this->rep = 0;
+    this->big = NEW(BigInt)(big);
+  }
+}
+
+// Points at `val` without owning it: there is no control block, so
+// copies never touch a reference count, and `val` is never freed
+static PTR(Val) immortal(Val *val) {
+  return std::shared_ptr<Val>(std::shared_ptr<Val>(), val);
+}
+
+static const int SMALL_NUM_MIN = -128;
+static const int SMALL_NUM_MAX = 1023;
+
+static PTR(Val) *make_small_nums() {
+  PTR(Val) *table = new PTR(Val)[SMALL_NUM_MAX - SMALL_NUM_MIN + 1];
+  for (int n = SMALL_NUM_MIN; n <= SMALL_NUM_MAX; n++)
+    table[n - SMALL_NUM_MIN] = immortal(new NumVal(n));
+  return table;
+}
+
+PTR(Val) NumVal::make(int rep) {
+  static PTR(Val) *small_nums = make_small_nums();
+  if (rep >= SMALL_NUM_MIN && rep <= SMALL_NUM_MAX)
+    return small_nums[rep - SMALL_NUM_MIN];
+  return NEW(NumVal)(rep);
 }
 
-bool NumVal::equals(PTR(Val) other_val) {
+bool NumVal::equals(const PTR(Val) &other_val) {
   PTR(NumVal) other_num_val = CAST(NumVal)(other_val);
   if (other_num_val == nullptr)
     return false;
-  else
+  else if (big == nullptr && other_num_val->big == nullptr)
     return rep == other_num_val->rep;
+  else
+    return to_big().equals(other_num_val->to_big());
 }
 
-PTR(Val) NumVal::add_to(PTR(Val) other_val) {
+// The overflow builtins compile to the plain add/multiply plus a
+// branch on the overflow flag, so the small case stays fast; only
+// a result that overflows moves to `BigInt`
+PTR(Val) NumVal::add_to(const PTR(Val) &other_val) {
   PTR(NumVal) other_num_val = CAST(NumVal)(other_val);
   if (other_num_val == nullptr)
     throw std::runtime_error("not a number");
-  else
-    return NEW(NumVal)(rep + other_num_val->rep);
+  if (big == nullptr && other_num_val->big == nullptr) {
+    int result;
+    if (!__builtin_add_overflow(rep, other_num_val->rep, &result))
+      return NumVal::make(result);
+  }
+  return NEW(NumVal)(to_big().add(other_num_val->to_big()));
 }
 
-PTR(Val) NumVal::mult_with(PTR(Val) other_val) {
+PTR(Val) NumVal::mult_with(const PTR(Val) &other_val) {
   PTR(NumVal) other_num_val = CAST(NumVal)(other_val);
   if (other_num_val == nullptr)
     throw std::runtime_error("not a number");
-  else
-    return NEW(NumVal)(rep * other_num_val->rep);
+  if (big == nullptr && other_num_val->big == nullptr) {
+    int result;
+    if (!__builtin_mul_overflow(rep, other_num_val->rep, &result))
+      return NumVal::make(result);
+  }
+  return NEW(NumVal)(to_big().mult(other_num_val->to_big()));
 }
 
 PTR(Expr)NumVal::to_expr() {
+  if (big != nullptr)
+    return NEW(NumExpr)(*big);
   return NEW(NumExpr)(rep);
 }
 
-std::string NumVal::to_string() {
-  return (std::to_string)(rep);
+void NumVal::print(std::ostream &out) {
+  if (big != nullptr)
+    out << big->to_string();
+  else
+    out << rep;
 }
 
 bool NumVal::is_true() {
@@ -56,11 +122,23 @@ PTR(Val) NumVal::call(PTR(Val) actual_arg) {
   throw std::runtime_error("can't use call on numval");
 }
 
+BigInt NumVal::to_big() {
+  if (big != nullptr)
+    return *big;
+  return BigInt(rep);
+}
+
 BoolVal::BoolVal(bool rep) {
   this->rep = rep;
 }
 
-bool BoolVal::equals(PTR(Val) other_val) {
+PTR(Val) BoolVal::make(bool rep) {
+  static PTR(Val) true_val = immortal(new BoolVal(true));
+  static PTR(Val) false_val = immortal(new BoolVal(false));
+  return rep ? true_val : false_val;
+}
+
+bool BoolVal::equals(const PTR(Val) &other_val) {
   PTR(BoolVal) other_bool_val = CAST(BoolVal)(other_val);
   if (other_bool_val == nullptr)
     return false;
@@ -68,11 +146,11 @@ bool BoolVal::equals(PTR(Val) other_val) {
     return rep == other_bool_val->rep;
 }
 
-PTR(Val) BoolVal::add_to(PTR(Val) other_val) {
+PTR(Val) BoolVal::add_to(const PTR(Val) &other_val) {
   throw std::runtime_error("no adding booleans");
 }
 
-PTR(Val) BoolVal::mult_with(PTR(Val) other_val) {
+PTR(Val) BoolVal::mult_with(const PTR(Val) &other_val) {
   throw std::runtime_error("no multiplying booleans");
 }
 
@@ -80,11 +158,11 @@ PTR(Expr)BoolVal::to_expr() {
   return NEW(BoolExpr)(rep);
 }
 
-std::string BoolVal::to_string() {
+void BoolVal::print(std::ostream &out) {
   if (rep)
-    return "_true";
+    out << "_true";
   else
-    return "_false";
+    out << "_false";
 }
 
 bool BoolVal::is_true() {
@@ -95,13 +173,18 @@ PTR(Val) BoolVal::call(PTR(Val) actual_arg) {
   throw std::runtime_error("can't use call on boolval");
 }
 
-FunVal::FunVal(std::string formal_arg, PTR(Expr)body, PTR(Env) env) {
+FunVal::FunVal(Symbol formal_arg, PTR(Expr)body, PTR(Env) env) {
   this->formal_arg = formal_arg;
-  this->body = body;
-  this->env = env;
+  this->body = std::move(body);
+  this->env = std::move(env);
+}
+
+FunVal::~FunVal() {
+  destroy_iteratively(body);
+  destroy_iteratively(env);
 }
 
-bool FunVal::equals(PTR(Val) other_val) {
+bool FunVal::equals(const PTR(Val) &other_val) {
   PTR(FunVal) other_fun_val = CAST(FunVal)(other_val);
   if (other_fun_val == nullptr)
     return false;
@@ -109,11 +192,11 @@ bool FunVal::equals(PTR(Val) other_val) {
     return formal_arg == other_fun_val->formal_arg && body->equals(other_fun_val->body);
 }
 
-PTR(Val) FunVal::add_to(PTR(Val) other_val) {
+PTR(Val) FunVal::add_to(const PTR(Val) &other_val) {
   throw std::runtime_error("no adding functions");
 }
 
-PTR(Val) FunVal::mult_with(PTR(Val) other_val) {
+PTR(Val) FunVal::mult_with(const PTR(Val) &other_val) {
   throw std::runtime_error("no multiplying functions");
 }
 
@@ -121,8 +204,10 @@ PTR(Expr)FunVal::to_expr() {
   return NEW(FunExpr)(formal_arg, body);
 }
 
-std::string FunVal::to_string() {
-  return "(_fun (" + formal_arg + ") " + body->to_string() + ")";
+void FunVal::print(std::ostream &out) {
+  out << "(_fun (" << formal_arg << ") ";
+  body->print(out);
+  out << ")";
 }
 
 bool FunVal::is_true() {
@@ -130,7 +215,8 @@ bool FunVal::is_true() {
 }
 
 PTR(Val) FunVal::call(PTR(Val) actual_arg) {
-  return body->interp(NEW(ExtendedEnv)(formal_arg, actual_arg, env));
+  FunctionScope function(body.get());
+  return body->interp(NEW(ExtendedEnv)(formal_arg, std::move(actual_arg), env));
 }
 
 TEST_CASE( "values equals" ) {
@@ -165,6 +251,7 @@ TEST_CASE( "add_to" ) {
 TEST_CASE( "mult_with" ) {
   
   CHECK ( (NEW(NumVal)(5))->mult_with(NEW(NumVal)(8))->equals(NEW(NumVal)(40)) );
+  CHECK ( (NEW(NumVal)(-5))->mult_with(NEW(NumVal)(8))->equals(NEW(NumVal)(-40)) );
 
   CHECK_THROWS_WITH ( (NEW(NumVal)(5))->mult_with(NEW(BoolVal)(false)), "not a number" );
   CHECK_THROWS_WITH ( (NEW(BoolVal)(false))->mult_with(NEW(BoolVal)(false)),
@@ -173,6 +260,85 @@ TEST_CASE( "mult_with" ) {
                      "no multiplying functions" );
 }
 
+TEST_CASE( "integer overflow" ) {
+  CHECK ( (NEW(NumVal)(2147483646))->add_to(NEW(NumVal)(1))->equals(NEW(NumVal)(2147483647)) );
+  CHECK ( (NEW(NumVal)(-2147483647))->add_to(NEW(NumVal)(-1))->to_string() == "-2147483648" );
+  CHECK ( (NEW(NumVal)(65536))->mult_with(NEW(NumVal)(-32768))->to_string() == "-2147483648" );
+  
+  CHECK ( (NEW(NumVal)(2147483647))->add_to(NEW(NumVal)(1))->to_string() == "2147483648" );
+  CHECK ( (NEW(NumVal)(-2147483647))->add_to(NEW(NumVal)(-2))->to_string() == "-2147483649" );
+  CHECK ( (NEW(NumVal)(65536))->mult_with(NEW(NumVal)(32768))->to_string() == "2147483648" );
+  CHECK ( (NEW(NumVal)(-65536))->mult_with(NEW(NumVal)(65536))->to_string() == "-4294967296" );
+}
+
+TEST_CASE( "big NumVal" ) {
+  PTR(Val) big = NEW(NumVal)(2147483647)->mult_with(NEW(NumVal)(2147483647));
+  CHECK( big->to_string() == "4611686014132420609" );
+  CHECK( CAST(NumVal)(big)->big != nullptr );
+  CHECK( big->equals(NEW(NumVal)(BigInt::from_string("4611686014132420609"))) );
+  CHECK( ! big->equals(NEW(NumVal)(1)) );
+  CHECK( ! (NEW(NumVal)(1))->equals(big) );
+  CHECK( big->mult_with(big)->to_string() == "21267647892944572736998860269687930881" );
+  
+  // results that fit back in an `int` go back to the unboxed form
+  PTR(Val) small = big->add_to(NEW(NumVal)(BigInt::from_string("-4611686014132420600")));
+  CHECK( small->equals(NEW(NumVal)(9)) );
+  CHECK( CAST(NumVal)(small)->big == nullptr );
+  
+  CHECK( big->to_expr()->equals(NEW(NumExpr)(BigInt::from_string("4611686014132420609"))) );
+  CHECK( big->to_expr()->to_string() == "4611686014132420609" );
+  CHECK_THROWS_WITH( big->add_to(NEW(BoolVal)(true)), "not a number" );
+}
+
+TEST_CASE( "immortal values" ) {
+  CHECK( NumVal::make(-128) == NumVal::make(-128) );
+  CHECK( NumVal::make(1023) == NumVal::make(1023) );
+  CHECK( NumVal::make(7).use_count() == 0 );
+  CHECK( NumVal::make(1024) != NumVal::make(1024) );
+  CHECK( NumVal::make(-129).use_count() == 1 );
+  CHECK( NumVal::make(-129)->equals(NEW(NumVal)(-129)) );
+  CHECK( BoolVal::make(true) == BoolVal::make(true) );
+  CHECK( BoolVal::make(false)->equals(NEW(BoolVal)(false)) );
+  CHECK( BoolVal::make(true).use_count() == 0 );
+
+  // small results come from the table, with nothing to allocate
+  CHECK( NEW(NumVal)(2)->add_to(NEW(NumVal)(3)) == NumVal::make(5) );
+  CHECK( NEW(NumVal)(20)->mult_with(NEW(NumVal)(30)) == NumVal::make(600) );
+  CHECK( NEW(NumVal)(2000)->add_to(NEW(NumVal)(1))->to_string() == "2001" );
+}
+
+/* the previous unchecked `add_to`, kept as the benchmark baseline */
+static PTR(Val) unchecked_add_to(PTR(NumVal) lhs, PTR(Val) other_val) {
+  PTR(NumVal) other_num_val = CAST(NumVal)(other_val);
+  if (other_num_val == nullptr)
+    throw std::runtime_error("not a number");
+  else
+    return NEW(NumVal)(lhs->rep + other_num_val->rep);
+}
+
+// Hidden by the `[.]` tag; run with `"[bench]"` as the test spec
+TEST_CASE( "checked arithmetic overhead", "[.][bench]" ) {
+  const int reps = 5000000;
+  PTR(NumVal) one = NEW(NumVal)(1);
+  
+  auto start = std::chrono::steady_clock::now();
+  PTR(Val) total = NEW(NumVal)(0);
+  for (int i = 0; i < reps; i++)
+    total = unchecked_add_to(CAST(NumVal)(total), one);
+  auto unchecked_time = std::chrono::steady_clock::now() - start;
+  CHECK( total->equals(NEW(NumVal)(reps)) );
+  
+  start = std::chrono::steady_clock::now();
+  total = NEW(NumVal)(0);
+  for (int i = 0; i < reps; i++)
+    total = total->add_to(one);
+  auto checked_time = std::chrono::steady_clock::now() - start;
+  CHECK( total->equals(NEW(NumVal)(reps)) );
+  
+  double ratio = (double)checked_time.count() / unchecked_time.count();
+  WARN( "checked/unchecked add_to time ratio: " << ratio );
+}
+
 TEST_CASE( "value to_expr" ) {
   CHECK( (NEW(NumVal)(5))->to_expr()->equals(NEW(NumExpr)(5)) );
   CHECK( (NEW(BoolVal)(true))->to_expr()->equals(NEW(BoolExpr)(true)) );
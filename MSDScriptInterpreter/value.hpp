@@ -12,36 +12,47 @@
 
 #include <iostream>
 #include "pointer.hpp"
+#include "symbol.hpp"
 
 /* A forward declaration, so `Val` can refer to `Expr`, while
    `Expr` still needs to refer to `Val`. */
 class Expr;
 class Env;
+class BigInt;
 
 class Val {
 public:
-  virtual bool equals(PTR(Val) val) = 0;
-  virtual PTR(Val) add_to(PTR(Val) other_val) = 0;
-  virtual PTR(Val) mult_with(PTR(Val) other_val) = 0;
+  virtual bool equals(const PTR(Val) &val) = 0;
+  virtual PTR(Val) add_to(const PTR(Val) &other_val) = 0;
+  virtual PTR(Val) mult_with(const PTR(Val) &other_val) = 0;
   virtual PTR(Expr) to_expr() = 0;
-  virtual std::string to_string() = 0;
+  virtual void print(std::ostream &out) = 0;
+  std::string to_string();
   virtual bool is_true() = 0;
+  // By value, since the argument is kept in the callee's environment
   virtual PTR(Val) call(PTR(Val) actual_arg) = 0;
 };
 
 class NumVal : public Val {
 public:
   int rep;
+  // Only set (and `rep` unused) when the value doesn't fit in an `int`
+  PTR(BigInt) big;
   
   NumVal(int rep);
-  bool equals(PTR(Val) val);
+  NumVal(const BigInt &big);
+  // A preallocated, immortal value for -128..1023, otherwise a new one
+  static PTR(Val) make(int rep);
+  bool equals(const PTR(Val) &val);
 
-  PTR(Val) add_to(PTR(Val) other_val);
-  PTR(Val) mult_with(PTR(Val) other_val);
+  PTR(Val) add_to(const PTR(Val) &other_val);
+  PTR(Val) mult_with(const PTR(Val) &other_val);
   PTR(Expr) to_expr();
-  std::string to_string();
+  void print(std::ostream &out);
   bool is_true();
   PTR(Val) call(PTR(Val) actual_arg);
+  
+  BigInt to_big();
 };
 
 class BoolVal : public Val {
@@ -49,29 +60,32 @@ public:
   bool rep;
   
   BoolVal(bool rep);
-  bool equals(PTR(Val) val);
+  // The preallocated, immortal `_true` or `_false`
+  static PTR(Val) make(bool rep);
+  bool equals(const PTR(Val) &val);
 
-  PTR(Val) add_to(PTR(Val) other_val);
-  PTR(Val) mult_with(PTR(Val) other_val);
+  PTR(Val) add_to(const PTR(Val) &other_val);
+  PTR(Val) mult_with(const PTR(Val) &other_val);
   PTR(Expr) to_expr();
-  std::string to_string();
+  void print(std::ostream &out);
   bool is_true();
   PTR(Val) call(PTR(Val) actual_arg);
 };
 
 class FunVal : public Val {
 public:
-  std::string formal_arg;
+  Symbol formal_arg;
   PTR(Expr) body;
   PTR(Env) env;
   
-  FunVal(std::string formal_arg, PTR(Expr) body, PTR(Env) env);
-  bool equals(PTR(Val) val);
+  FunVal(Symbol formal_arg, PTR(Expr) body, PTR(Env) env);
+  ~FunVal();
+  bool equals(const PTR(Val) &val);
 
-  PTR(Val) add_to(PTR(Val) other_val);
-  PTR(Val) mult_with(PTR(Val) other_val);
+  PTR(Val) add_to(const PTR(Val) &other_val);
+  PTR(Val) mult_with(const PTR(Val) &other_val);
   PTR(Expr) to_expr();
-  std::string to_string();
+  void print(std::ostream &out);
   bool is_true();
   PTR(Val) call(PTR(Val) actual_arg);
 };
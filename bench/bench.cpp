@@ -0,0 +1,284 @@
+//
+//  bench.cpp
+//  bench
+//
+//  Created by Warner Nielsen on 5/1/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include "pointer.hpp"
+#include "expr.hpp"
+#include "env.hpp"
+#include "parse.hpp"
+#include "value.hpp"
+#include "node.hpp"
+#include "flat.hpp"
+#include "corpus.hpp"
+#include "generate.hpp"
+#include "stats.hpp"
+
+#define CATCH_CONFIG_RUNNER
+#include "catch.hpp"
+
+// The representation of the program a workload runs on
+enum AstForm {
+  // `Expr` classes, with virtual methods
+  TREE_FORM,
+  // tagged `Node`s, with switch dispatch
+  CLOSED_FORM,
+  // a `FlatAst`: nodes in one array, linked by index
+  FLAT_FORM,
+  AST_FORMS
+};
+
+static const char *form_name(AstForm form) {
+  switch (form) {
+    case TREE_FORM:
+      return "tree";
+    case CLOSED_FORM:
+      return "closed";
+    case FLAT_FORM:
+      return "flat";
+    default:
+      return "?";
+  }
+}
+
+struct BenchOptions {
+  int warmup = 3;
+  int reps = 20;
+  const char *filter = nullptr;
+  bool json = false;
+  std::vector<AstForm> forms = {TREE_FORM};
+};
+
+// Parses a `--ast` argument: a form's name, or "all"
+static std::vector<AstForm> parse_forms(const std::string &arg) {
+  std::vector<AstForm> forms;
+  for (int form = 0; form < AST_FORMS; form++) {
+    if (arg == "all" || arg == form_name((AstForm)form))
+      forms.push_back((AstForm)form);
+  }
+  if (forms.empty())
+    throw std::runtime_error("unknown AST form " + arg);
+  return forms;
+}
+
+// Writes `count` generated programs to `dir`, one per seed starting
+// at the options' seed
+static void write_programs(const std::string &dir, int count, GenOptions gen) {
+  for (int i = 0; i < count; i++, gen.seed++) {
+    std::string path = dir + "/program-" + std::to_string(gen.seed) + ".msd";
+    std::ofstream out(path);
+    out << generate_program(gen) << std::endl;
+    if (!out)
+      throw std::runtime_error("can't write " + path);
+    std::cout << path << std::endl;
+  }
+}
+
+// Generated programs of doubling sizes up to `gen.size`, each timed
+// parsing, optimizing and interpreting, to show how the phases scale
+static std::vector<Workload> scaling_corpus(GenOptions gen) {
+  std::vector<Workload> corpus;
+  int max_size = gen.size;
+  for (int size = 64; size <= max_size; size *= 2) {
+    gen.size = size;
+    std::string source = generate_program(gen);
+    for (BenchPhase phase : {PARSE_PHASE, OPTIMIZE_PHASE, INTERP_PHASE})
+      corpus.push_back({"generated", phase, size, source, ""});
+  }
+  return corpus;
+}
+
+struct BenchResult {
+  const Workload *workload;
+  AstForm form;
+  Summary summary;
+};
+
+static PTR(Expr) parse_source(const std::string &source) {
+  std::istringstream in(source);
+  return parse(in);
+}
+
+// The program a workload runs on, in each form
+struct BenchProgram {
+  PTR(Expr) e;
+  PTR(Node) node;
+  PTR(FlatAst) flat;
+};
+
+// Runs the workload's phase once, returning the elapsed milliseconds
+// and storing what it produced in `output`
+static double run_once(const Workload &w, AstForm form, const BenchProgram &program,
+                       std::string &output) {
+  PTR(Expr) tree;
+  PTR(Node) node;
+  PTR(Val) val;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  switch (w.phase) {
+    case PARSE_PHASE:
+      tree = parse_source(w.source);
+      break;
+    case OPTIMIZE_PHASE:
+      if (form == CLOSED_FORM)
+        node = program.node->optimize();
+      else
+        tree = program.e->optimize();
+      break;
+    case INTERP_PHASE:
+      if (form == CLOSED_FORM)
+        val = program.node->interp(NEW(EmptyEnv)());
+      else if (form == FLAT_FORM)
+        val = program.flat->interp(NEW(EmptyEnv)());
+      else
+        val = program.e->interp(NEW(EmptyEnv)());
+      break;
+  }
+  std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now();
+  
+  // results are printed and freed outside the timed region
+  output = (val != nullptr) ? val->to_string() : "";
+  return std::chrono::duration<double, std::milli>(stop - start).count();
+}
+
+static BenchResult run_workload(const Workload &w, AstForm form, const BenchOptions &options) {
+  // optimize and interp reuse one tree, as a program run repeatedly would
+  BenchProgram program;
+  program.e = parse_source(w.source);
+  if (form == CLOSED_FORM)
+    program.node = to_node(program.e);
+  if (form == FLAT_FORM)
+    program.flat = FlatAst::from_expr(program.e);
+  std::string output;
+  for (int i = 0; i < options.warmup; i++)
+    run_once(w, form, program, output);
+  
+  std::vector<double> samples;
+  for (int i = 0; i < options.reps; i++) {
+    samples.push_back(run_once(w, form, program, output));
+    if (i == 0 && !w.expected.empty() && output != w.expected)
+      throw std::runtime_error(w.name + " produced " + output + ", expected " + w.expected);
+  }
+  return BenchResult{&w, form, summarize(samples)};
+}
+
+static void print_table(std::ostream &out, const std::vector<BenchResult> &results) {
+  out << std::left << std::setw(16) << "benchmark" << std::setw(10) << "phase" << std::setw(8) << "ast" << std::right
+      << std::setw(8) << "size" << std::setw(12) << "median ms" << std::setw(12) << "p99 ms"
+      << std::setw(12) << "stddev ms" << std::endl;
+  out << std::fixed << std::setprecision(3);
+  for (const BenchResult &r : results) {
+    out << std::left << std::setw(16) << r.workload->name << std::setw(10) << phase_name(r.workload->phase)
+        << std::setw(8) << form_name(r.form) << std::right << std::setw(8) << r.workload->size << std::setw(12) << r.summary.median
+        << std::setw(12) << r.summary.p99 << std::setw(12) << r.summary.stddev << std::endl;
+  }
+}
+
+static void print_json(std::ostream &out, const std::vector<BenchResult> &results,
+                       const BenchOptions &options) {
+  out << std::setprecision(6);
+  out << "{\n  \"warmup\": " << options.warmup << ",\n  \"reps\": " << options.reps
+      << ",\n  \"unit\": \"ms\",\n  \"benchmarks\": [";
+  for (size_t i = 0; i < results.size(); i++) {
+    const BenchResult &r = results[i];
+    out << (i == 0 ? "\n" : ",\n")
+        << "    {\"name\": \"" << r.workload->name << "\", \"phase\": \"" << phase_name(r.workload->phase)
+        << "\", \"ast\": \"" << form_name(r.form) << "\", \"size\": " << r.workload->size
+        << ", \"min\": " << r.summary.min << ", \"median\": " << r.summary.median
+        << ", \"p99\": " << r.summary.p99 << ", \"mean\": " << r.summary.mean
+        << ", \"stddev\": " << r.summary.stddev << ", \"max\": " << r.summary.max << "}";
+  }
+  out << "\n  ]\n}" << std::endl;
+}
+
+int main(int argc, char **argv) {
+  try {
+    BenchOptions options;
+    GenOptions gen;
+    bool list_mode = false;
+    bool scale_mode = false;
+    const char *generate_dir = nullptr;
+    int count = 1;
+    for (int argi = 1; argi < argc; argi++) {
+      if (!strcmp(argv[argi], "--warmup") && (argi + 1 < argc))
+        options.warmup = atoi(argv[++argi]);
+      else if (!strcmp(argv[argi], "--reps") && (argi + 1 < argc))
+        options.reps = std::max(atoi(argv[++argi]), 1);
+      else if (!strcmp(argv[argi], "--filter") && (argi + 1 < argc))
+        options.filter = argv[++argi];
+      else if (!strcmp(argv[argi], "--json"))
+        options.json = true;
+      else if (!strcmp(argv[argi], "--ast") && (argi + 1 < argc))
+        options.forms = parse_forms(argv[++argi]);
+      else if (!strcmp(argv[argi], "--list"))
+        list_mode = true;
+      else if (!strcmp(argv[argi], "--generate") && (argi + 1 < argc))
+        generate_dir = argv[++argi];
+      else if (!strcmp(argv[argi], "--count") && (argi + 1 < argc))
+        count = atoi(argv[++argi]);
+      else if (!strcmp(argv[argi], "--scale"))
+        scale_mode = true;
+      else if (!strcmp(argv[argi], "--seed") && (argi + 1 < argc))
+        gen.seed = strtoul(argv[++argi], nullptr, 10);
+      else if (!strcmp(argv[argi], "--size") && (argi + 1 < argc))
+        gen.size = atoi(argv[++argi]);
+      else if (!strcmp(argv[argi], "--depth") && (argi + 1 < argc))
+        gen.max_depth = atoi(argv[++argi]);
+      else if (!strcmp(argv[argi], "--let-density") && (argi + 1 < argc))
+        gen.let_density = atof(argv[++argi]);
+      else if (!strcmp(argv[argi], "--closure-density") && (argi + 1 < argc))
+        gen.closure_density = atof(argv[++argi]);
+      else if (!strcmp(argv[argi], "--recursion") && (argi + 1 < argc))
+        gen.recursion_depth = atoi(argv[++argi]);
+      else
+        throw std::runtime_error((std::string)"unknown option " + argv[argi]);
+    }
+    
+    if (generate_dir != nullptr) {
+      write_programs(generate_dir, count, gen);
+      return 0;
+    }
+    
+    std::vector<Workload> corpus = scale_mode ? scaling_corpus(gen) : standard_corpus();
+    std::vector<BenchResult> results;
+    for (const Workload &w : corpus) {
+      if (options.filter != nullptr && w.name.find(options.filter) == std::string::npos)
+        continue;
+      if (list_mode)
+        std::cout << w.name << " (" << phase_name(w.phase) << ", size " << w.size << ")" << std::endl;
+      else {
+        // parsing always builds the tree form, and the flat form is
+        // only evaluated
+        for (AstForm form : options.forms) {
+          if (w.phase == PARSE_PHASE && form != options.forms.front())
+            continue;
+          if (w.phase == OPTIMIZE_PHASE && form == FLAT_FORM)
+            continue;
+          results.push_back(run_workload(w, w.phase == PARSE_PHASE ? TREE_FORM : form, options));
+        }
+      }
+    }
+    
+    if (list_mode)
+      return 0;
+    if (options.json)
+      print_json(std::cout, results, options);
+    else
+      print_table(std::cout, results);
+  } catch (std::runtime_error err) {
+    std::cerr << err.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
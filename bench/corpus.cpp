@@ -0,0 +1,91 @@
+//
+//  corpus.cpp
+//  bench
+//
+//  Created by Warner Nielsen on 5/1/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include "corpus.hpp"
+
+const char *phase_name(BenchPhase phase) {
+  switch (phase) {
+    case PARSE_PHASE:
+      return "parse";
+    case OPTIMIZE_PHASE:
+      return "optimize";
+    case INTERP_PHASE:
+      return "interp";
+  }
+  return "?";
+}
+
+static std::string fib(int n) {
+  return "_let fib = _fun (fib) _fun (x)"
+         "  _if x == 0 _then 1"
+         "  _else _if x == 1 _then 1"
+         "  _else fib(fib)(x + -1) + fib(fib)(x + -2)"
+         " _in fib(fib)(" + std::to_string(n) + ")";
+}
+
+// n computations of 20!, which overflows into big numbers
+static std::string factorial(int n) {
+  return "_let fact = _fun (fact) _fun (n)"
+         "  _if n == 0 _then 1 _else n * fact(fact)(n + -1)"
+         " _in _let loop = _fun (loop) _fun (n)"
+         "  _if n == 0 _then 0 _else fact(fact)(20) + loop(loop)(n + -1)"
+         " _in loop(loop)(" + std::to_string(n) + ")";
+}
+
+// n nested `_let`s, each shadowing the one outside it
+static std::string deep_let(int n) {
+  std::string source = "_let x = 1 _in ";
+  for (int i = 1; i < n; i++)
+    source += "_let x = x + 1 _in ";
+  return source + "x";
+}
+
+// 1 + 2 + ... + n
+static std::string sum_chain(int n) {
+  std::string source = "1";
+  for (int i = 2; i <= n; i++)
+    source += " + " + std::to_string(i);
+  return source;
+}
+
+// the `add`/`addFive` program from the parser tests, called n times
+static std::string currying(int n) {
+  return "_let add = _fun (x) _fun (y) x + y"
+         " _in _let addFive = add(5)"
+         " _in _let loop = _fun (loop) _fun (n)"
+         "  _if n == 0 _then 0 _else addFive(n) + loop(loop)(n + -1)"
+         " _in loop(loop)(" + std::to_string(n) + ")";
+}
+
+// n function definitions and calls, with every kind of expression
+static std::string large_program(int n) {
+  std::string source;
+  for (int i = 0; i < n; i++)
+    source += "_let f = _fun (x) _if x == " + std::to_string(i) + " _then (2 + 3) * x _else f(x + -1) _in ";
+  return source + "f(3)";
+}
+
+// n terms whose constant parts fold away
+static std::string foldable_sum(int n) {
+  std::string source = "_let x = 2 _in (1 + 2) * x";
+  for (int i = 1; i < n; i++)
+    source += " + (" + std::to_string(i) + " * 3 + x) * (_let y = 4 _in y + 1)";
+  return source;
+}
+
+std::vector<Workload> standard_corpus() {
+  std::vector<Workload> corpus;
+  corpus.push_back({"fib", INTERP_PHASE, 20, fib(20), "10946"});
+  corpus.push_back({"factorial", INTERP_PHASE, 200, factorial(200), "486580401635328000000"});
+  corpus.push_back({"deep_let", INTERP_PHASE, 2000, deep_let(2000), "2000"});
+  corpus.push_back({"sum_chain", INTERP_PHASE, 5000, sum_chain(5000), "12502500"});
+  corpus.push_back({"currying", INTERP_PHASE, 2000, currying(2000), "2011000"});
+  corpus.push_back({"parse_large", PARSE_PHASE, 2000, large_program(2000), ""});
+  corpus.push_back({"optimize_large", OPTIMIZE_PHASE, 2000, foldable_sum(2000), ""});
+  return corpus;
+}
@@ -0,0 +1,38 @@
+//
+//  corpus.hpp
+//  bench
+//
+//  Created by Warner Nielsen on 5/1/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef corpus_hpp
+#define corpus_hpp
+
+#include <string>
+#include <vector>
+
+// The part of running a program that a workload times
+enum BenchPhase {
+  PARSE_PHASE,
+  OPTIMIZE_PHASE,
+  INTERP_PHASE
+};
+
+const char *phase_name(BenchPhase phase);
+
+struct Workload {
+  std::string name;
+  BenchPhase phase;
+  // the workload's scaling parameter (n for fib(n), terms in a chain, ...)
+  int size;
+  std::string source;
+  // what the timed phase must produce, as printed; empty to skip the check
+  std::string expected;
+};
+
+// The standard workloads, the same on every run so that timings can
+// be compared across changes
+std::vector<Workload> standard_corpus();
+
+#endif /* corpus_hpp */
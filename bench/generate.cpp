@@ -0,0 +1,136 @@
+//
+//  generate.cpp
+//  bench
+//
+//  Created by Warner Nielsen on 5/4/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include "generate.hpp"
+
+ProgramGenerator::ProgramGenerator(const GenOptions &options)
+: options(options), rng((std::mt19937::result_type)options.seed) {
+  this->names_used = 0;
+  this->in_function = 0;
+}
+
+std::string ProgramGenerator::generate() {
+  names_used = 0;
+  in_function = 0;
+  nums.clear();
+  funs.clear();
+  int size = std::max(options.size, 1);
+  if (options.recursion_depth <= 0)
+    return num_expr(size, 0);
+  
+  // the generated body runs once per level, and can use the level
+  std::string level = fresh_name();
+  nums.push_back(level);
+  std::string body = num_expr(size, 0);
+  return "_let loop = _fun (loop) _fun (" + level + ")"
+         " _if " + level + " == 0 _then 0 _else " + body + " + loop(loop)(" + level + " + -1)"
+         " _in loop(loop)(" + std::to_string(options.recursion_depth) + ")";
+}
+
+int ProgramGenerator::below(int n) {
+  return (int)(rng() % (unsigned)n);
+}
+
+bool ProgramGenerator::chance(double p) {
+  return (rng() >> 8) * (1.0 / (1 << 24)) < p;
+}
+
+// a, b, ... z, ba, bb, ... in order, so programs differ only by seed
+std::string ProgramGenerator::fresh_name() {
+  int n = names_used++;
+  std::string name;
+  do {
+    name.insert(name.begin(), (char)('a' + n % 26));
+    n /= 26;
+  } while (n > 0);
+  return name;
+}
+
+std::string ProgramGenerator::literal() {
+  return std::to_string(below(20) - 5);
+}
+
+// Every expression is parenthesized, so precedence never matters
+std::string ProgramGenerator::num_expr(int size, int depth) {
+  if (size <= 1 || depth >= options.max_depth) {
+    if (!nums.empty() && chance(0.5))
+      return nums[below((int)nums.size())];
+    return literal();
+  }
+  
+  if (size >= 3 && chance(options.let_density)) {
+    int rhs_size = 1 + below(size - 2);
+    std::string rhs = num_expr(rhs_size, depth + 1);
+    std::string name = fresh_name();
+    nums.push_back(name);
+    std::string body = num_expr(size - 1 - rhs_size, depth + 1);
+    nums.pop_back();
+    return "(_let " + name + " = " + rhs + " _in " + body + ")";
+  }
+  
+  if (size >= 3 && chance(options.closure_density)) {
+    int fun_size = 1 + below(size - 2);
+    std::string fun = fun_expr(fun_size, depth + 1);
+    if (in_function > 0 || chance(0.5)) {
+      // call it right away
+      std::string arg = num_expr(size - 1 - fun_size, depth + 1);
+      return fun + "(" + arg + ")";
+    }
+    std::string name = fresh_name();
+    funs.push_back(name);
+    std::string body = num_expr(size - 1 - fun_size, depth + 1);
+    funs.pop_back();
+    return "(_let " + name + " = " + fun + " _in " + body + ")";
+  }
+  
+  if (!funs.empty() && chance(options.closure_density))
+    return funs[below((int)funs.size())] + "(" + num_expr(size - 1, depth + 1) + ")";
+  
+  int kind = below(20);
+  if (kind < 9 || size < 4) {
+    int lhs_size = 1 + below(size - 1);
+    return "(" + num_expr(lhs_size, depth + 1) + " + " + num_expr(size - lhs_size, depth + 1) + ")";
+  } else if (kind < 13) {
+    // a literal factor keeps numbers from growing without bound
+    return "(" + num_expr(size - 1, depth + 1) + " * " + std::to_string(below(5) - 1) + ")";
+  } else {
+    int test_size = 1 + below(size - 3);
+    int then_size = 1 + below(size - 2 - test_size);
+    int else_size = size - 1 - test_size - then_size;
+    return "(_if " + bool_expr(test_size, depth + 1) + " _then " + num_expr(then_size, depth + 1)
+           + " _else " + num_expr(else_size, depth + 1) + ")";
+  }
+}
+
+std::string ProgramGenerator::bool_expr(int size, int depth) {
+  if (size <= 2 || depth >= options.max_depth)
+    return chance(0.5) ? "_true" : "_false";
+  int lhs_size = 1 + below(size - 2);
+  return "(" + num_expr(lhs_size, depth + 1) + " == " + num_expr(size - 1 - lhs_size, depth + 1) + ")";
+}
+
+// A one-argument function. Its body can capture numbers in scope but
+// not functions, and defines no named ones, so every part of a program
+// runs at most once per evaluation and running time stays linear in
+// its size.
+std::string ProgramGenerator::fun_expr(int size, int depth) {
+  std::string formal_arg = fresh_name();
+  std::vector<std::string> outer_funs;
+  outer_funs.swap(funs);
+  nums.push_back(formal_arg);
+  in_function++;
+  std::string body = num_expr(std::max(size - 1, 1), depth + 1);
+  in_function--;
+  nums.pop_back();
+  funs.swap(outer_funs);
+  return "(_fun (" + formal_arg + ") " + body + ")";
+}
+
+std::string generate_program(const GenOptions &options) {
+  return ProgramGenerator(options).generate();
+}
@@ -0,0 +1,63 @@
+//
+//  generate.hpp
+//  bench
+//
+//  Created by Warner Nielsen on 5/4/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef generate_hpp
+#define generate_hpp
+
+#include <random>
+#include <string>
+#include <vector>
+
+struct GenOptions {
+  unsigned long seed = 1;
+  // roughly how many expressions the program has
+  int size = 200;
+  // deepest nesting of expressions
+  int max_depth = 24;
+  // chance that an expression is a `_let`
+  double let_density = 0.15;
+  // chance that an expression defines or calls a function
+  double closure_density = 0.1;
+  // when above 0, the program is the body of a recursive function
+  // that calls itself this many times deep
+  int recursion_depth = 0;
+};
+
+/*
+ * Generates random, well-formed programs that evaluate to a number
+ * without errors. The same options always give the same program:
+ * only the exactly specified `mt19937` engine is used, never the
+ * library's distributions.
+ * */
+class ProgramGenerator {
+public:
+  ProgramGenerator(const GenOptions &options);
+  std::string generate();
+
+private:
+  GenOptions options;
+  std::mt19937 rng;
+  int names_used;
+  // how many function bodies enclose the expression being generated
+  int in_function;
+  // variables in scope, holding numbers and one-argument functions
+  std::vector<std::string> nums;
+  std::vector<std::string> funs;
+
+  int below(int n);
+  bool chance(double p);
+  std::string fresh_name();
+  std::string literal();
+  std::string num_expr(int size, int depth);
+  std::string bool_expr(int size, int depth);
+  std::string fun_expr(int size, int depth);
+};
+
+std::string generate_program(const GenOptions &options);
+
+#endif /* generate_hpp */
@@ -0,0 +1,39 @@
+//
+//  stats.cpp
+//  bench
+//
+//  Created by Warner Nielsen on 5/1/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#include <algorithm>
+#include <cmath>
+#include "stats.hpp"
+
+static double percentile(const std::vector<double> &sorted, double p) {
+  size_t rank = (size_t)std::ceil(p / 100 * sorted.size());
+  if (rank == 0)
+    rank = 1;
+  return sorted[rank - 1];
+}
+
+Summary summarize(std::vector<double> samples) {
+  std::sort(samples.begin(), samples.end());
+  
+  double sum = 0;
+  for (double s : samples)
+    sum += s;
+  double mean = sum / samples.size();
+  double squares = 0;
+  for (double s : samples)
+    squares += (s - mean) * (s - mean);
+  
+  Summary summary;
+  summary.min = samples.front();
+  summary.median = percentile(samples, 50);
+  summary.p99 = percentile(samples, 99);
+  summary.mean = mean;
+  summary.stddev = (samples.size() > 1) ? std::sqrt(squares / (samples.size() - 1)) : 0;
+  summary.max = samples.back();
+  return summary;
+}
@@ -0,0 +1,28 @@
+//
+//  stats.hpp
+//  bench
+//
+//  Created by Warner Nielsen on 5/1/20.
+//  Copyright © 2020 Warner Nielsen. All rights reserved.
+//
+
+#ifndef stats_hpp
+#define stats_hpp
+
+#include <vector>
+
+// Summary statistics for a set of timings
+struct Summary {
+  double min;
+  double median;
+  double p99;
+  double mean;
+  double stddev;
+  double max;
+};
+
+// `samples` must not be empty. Percentiles use the nearest rank, so
+// they are always one of the samples.
+Summary summarize(std::vector<double> samples);
+
+#endif /* stats_hpp */